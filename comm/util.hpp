@@ -4,10 +4,12 @@
 #include <string>
 #include <vector>
 #include <atomic>
+#include <cstdint>
 #include <fstream>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <algorithm>
 #include <string_view>
@@ -41,12 +43,107 @@ namespace ns_util
 		}
 	};
 
+    class HashUtil
+    {
+    public:
+        // 计算content的SHA-256摘要，返回64位十六进制字符串
+        // 用于内容寻址(编译缓存等)，不能用std::hash这种可能碰撞的哈希
+        static std::string Sha256(const std::string &content)
+        {
+            static const uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+            uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+            // 补位：0x80 + 若干0 + 64位的原始比特长度(大端)
+            std::string msg = content;
+            uint64_t bit_len = static_cast<uint64_t>(content.size()) * 8;
+            msg.push_back(static_cast<char>(0x80));
+            while (msg.size() % 64 != 56)
+            {
+                msg.push_back('\0');
+            }
+            for (int i = 7; i >= 0; --i)
+            {
+                msg.push_back(static_cast<char>((bit_len >> (i * 8)) & 0xff));
+            }
+
+            auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+            for (size_t chunk = 0; chunk < msg.size(); chunk += 64)
+            {
+                uint32_t w[64];
+                for (int i = 0; i < 16; ++i)
+                {
+                    const unsigned char *p = reinterpret_cast<const unsigned char *>(msg.data() + chunk + i * 4);
+                    w[i] = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+                }
+                for (int i = 16; i < 64; ++i)
+                {
+                    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+                }
+                uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+                for (int i = 0; i < 64; ++i)
+                {
+                    uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+                    uint32_t ch = (e & f) ^ (~e & g);
+                    uint32_t t1 = hh + s1 + ch + k[i] + w[i];
+                    uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+                    uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                    uint32_t t2 = s0 + maj;
+                    hh = g; g = f; f = e; e = d + t1;
+                    d = c; c = b; b = a; a = t1 + t2;
+                }
+                h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+                h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+            }
+
+            static const char *hex = "0123456789abcdef";
+            std::string digest;
+            for (int i = 0; i < 8; ++i)
+            {
+                for (int j = 28; j >= 0; j -= 4)
+                {
+                    digest.push_back(hex[(h[i] >> j) & 0xf]);
+                }
+            }
+            return digest;
+        }
+
+        // 一组内容整体的摘要：各部分摘要拼接之后再取一次摘要，部分之间的边界不会混淆
+        // 用作测试数据的版本(依次是每个用例的输入、输出)，oj_server和编译服务按同样的方式计算
+        static std::string Sha256List(const std::vector<std::string> &parts)
+        {
+            std::string digests;
+            for (const auto &part : parts)
+            {
+                digests += Sha256(part);
+            }
+            return Sha256(digests);
+        }
+    };
+
     class PathUtil
     {
     public:
+        // 临时文件所在的目录，默认是temp_path，可以在启动时改到tmpfs上
+        static std::string &TempPath()
+        {
+            static std::string path = temp_path;
+            return path;
+        }
+
         static std::string AddSuffix(const std::string &file_name, const std::string &suffix)
         {
-            std::string path_name = temp_path;
+            std::string path_name = TempPath();
             path_name += file_name;
             path_name += suffix;
             return path_name;
@@ -65,6 +162,12 @@ namespace ns_util
             return AddSuffix(file_name, ".exe");
         }
 
+        // 分离编译时用户代码的目标文件
+        static std::string Obj(const std::string &file_name)
+        {
+            return AddSuffix(file_name, ".o");
+        }
+
         // 编译时报错
         static std::string CompilerError(const std::string &file_name)
         {
@@ -106,6 +209,96 @@ namespace ns_util
             gettimeofday(&_time, nullptr);
             return std::to_string(_time.tv_sec * 1000 + _time.tv_usec / 1000);
         }
+        // 单调时钟的毫秒数，只用来计算耗时，不受系统时间调整影响
+        static int64_t GetMonotonicMs()
+        {
+            timespec _time;
+            clock_gettime(CLOCK_MONOTONIC, &_time);
+            return static_cast<int64_t>(_time.tv_sec) * 1000 + _time.tv_nsec / 1000000;
+        }
+    };
+
+    // Server-Sent Events的帧: "event: 名称\ndata: 数据\n\n"，数据有多行时每行一个data:
+    // 编译服务推送判题进度给oj_server，oj_server再转发给浏览器，两边都用这里的格式
+    class SseUtil
+    {
+    public:
+        static std::string Frame(const std::string &event, const std::string &data)
+        {
+            std::string frame = "event: " + event + "\n";
+            std::vector<std::string> lines;
+            StringUtil::SplitString(data, &lines, "\n");
+            for (const auto &line : lines)
+            {
+                frame += "data: " + line + "\n";
+            }
+            frame += "\n";
+            return frame;
+        }
+    };
+
+    // 增量地解析SSE的事件流：数据按网络分块到达，一个帧(比如很大的判题结果)可能跨越很多块
+    // 记住已经找过"\n\n"的位置，每个字节只扫描一次；已经取出的帧在没有完整的帧时才一起删掉
+    class SseParser
+    {
+    public:
+        void Append(const char *data, size_t len)
+        {
+            buffer.append(data, len);
+        }
+
+        // 取出下一个完整的帧，没有时返回false；没有data的帧(比如保持连接的注释 ": keepalive")直接跳过
+        bool Next(std::string *event, std::string *data)
+        {
+            while (true)
+            {
+                size_t end = buffer.find("\n\n", scanned);
+                if (end == std::string::npos)
+                {
+                    // 末尾的"\n"可能和下一块开头的"\n"组成帧的结尾
+                    scanned = buffer.empty() ? 0 : buffer.size() - 1;
+                    if (start > 0)
+                    {
+                        buffer.erase(0, start);
+                        scanned -= std::min(scanned, start);
+                        start = 0;
+                    }
+                    return false;
+                }
+                std::vector<std::string> lines;
+                StringUtil::SplitString(buffer.substr(start, end - start), &lines, "\n");
+                start = end + 2;
+                scanned = start;
+                bool has_data = false;
+                event->clear();
+                data->clear();
+                for (const auto &line : lines)
+                {
+                    if (line.compare(0, 7, "event: ") == 0)
+                    {
+                        *event = line.substr(7);
+                    }
+                    else if (line.compare(0, 6, "data: ") == 0)
+                    {
+                        if (has_data)
+                        {
+                            data->push_back('\n');
+                        }
+                        data->append(line, 6, std::string::npos);
+                        has_data = true;
+                    }
+                }
+                if (has_data)
+                {
+                    return true;
+                }
+            }
+        }
+
+    private:
+        std::string buffer;
+        size_t start = 0;   // 还没有取出的第一个帧的位置
+        size_t scanned = 0; // 从这里开始找帧的结尾，之前的部分已经找过
     };
 
     class FileUtil
@@ -0,0 +1,546 @@
+#include "launcher.hpp"
+#include "compile_run.hpp"
+#include "sandbox.hpp"
+#include "forkserver.hpp"
+#include "speed.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <map>
+
+// 编译服务的微基准测试，不参与编译服务本身的构建
+// 用法：./bench spawn [rss_mb]
+//       ./bench io [jobs]
+//       ./bench sandbox [runs]
+//   spawn: 对比 fork+exec 和 Launcher(clone CLONE_VM|CLONE_VFORK) 在 1/8/64 个并发下创建子进程的延迟
+//          rss_mb: 先让本进程占用这么多内存，模拟一个已经跑了很久、很大的编译服务
+//   io: 对比磁盘临时文件和in_memory两种模式下，jobs个并发判题的延迟和IO(默认32个)
+//       数据来自/proc/self/io，子进程被回收后它们的IO也会累加进来，所以不启动zygote
+//   sandbox: 空程序(/bin/true)的延迟：不隔离、每次从头建沙箱(命名空间+只读挂载+seccomp)、从沙箱池里取，默认各200次
+//   forkserver: 一个读入一个数再输出的iostream程序，每个测试用例exec一次，和从停在main之前的fork server fork，默认各500次
+//   checker: mb MB的输出(每行一个数，默认128)和同样的期望输出，四种比较方式的吞吐，
+//            对比整个读入内存、按行规范化之后再比较的做法
+//   testdata: 每次运行准备一个kb KB的标准输入(默认1024)，各runs次(默认1000)：写临时文件、复制到新的内存文件、
+//             重新打开测试数据仓库里封存的内存文件
+//   speed: 速度校准的基准程序的耗时和每毫秒指令数，在参考机器上运行得到speed_reference_ms和instructions_per_ms
+//   pch: 按conf(默认./conf/compile_server.conf)里编译器的资源限制生成几种常见的预编译头(包括<bits/stdc++.h>)，
+//        报告大小和耗时，有一种生成失败时返回1，用来检查编译器的限制放得下预编译头
+using namespace ns_launcher;
+using namespace ns_compile_and_run;
+using namespace ns_conf;
+using namespace ns_sandbox;
+using namespace ns_forkserver;
+
+static void Usage(const std::string &proc)
+{
+    std::cerr << "Usage: " << "\n\t" << proc << " spawn [rss_mb]" << "\n\t" << proc << " io [jobs]"
+              << "\n\t" << proc << " sandbox [runs]" << "\n\t" << proc << " forkserver [runs]"
+              << "\n\t" << proc << " checker [mb]" << "\n\t" << proc << " testdata [kb] [runs]"
+              << "\n\t" << proc << " speed" << "\n\t" << proc << " pch [conf]" << std::endl;
+}
+
+// 执行total次spawn，concurrency个线程同时进行，返回每一次spawn到子进程退出的延迟(us)
+template <class SpawnFunc>
+static std::vector<double> RunConcurrent(int concurrency, int total, SpawnFunc spawn)
+{
+    std::vector<std::vector<double>> per_thread(concurrency);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < concurrency; ++i)
+    {
+        threads.emplace_back([&, i]()
+        {
+            for (int j = i; j < total; j += concurrency)
+            {
+                auto begin = std::chrono::steady_clock::now();
+                spawn();
+                auto end = std::chrono::steady_clock::now();
+                per_thread[i].push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+            }
+        });
+    }
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    std::vector<double> all;
+    for (auto &v : per_thread)
+    {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    std::sort(all.begin(), all.end());
+    return all;
+}
+
+static void Report(const std::string &name, int concurrency, std::vector<double> lat, double wall_ms)
+{
+    double sum = 0;
+    for (double v : lat)
+    {
+        sum += v;
+    }
+    printf("%-12s conc=%-3d n=%-5zu avg=%8.1fus p50=%8.1fus p99=%8.1fus throughput=%8.1f/s\n",
+           name.c_str(), concurrency, lat.size(), sum / lat.size(), lat[lat.size() / 2],
+           lat[lat.size() * 99 / 100], lat.size() * 1000.0 / wall_ms);
+}
+
+static void ForkExec()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execl("/bin/true", "true", nullptr);
+        _exit(127);
+    }
+    waitpid(pid, nullptr, 0);
+}
+
+static void LauncherSpawn()
+{
+    SpawnRequest req;
+    req.argv = {"/bin/true"};
+    ExitInfo info;
+    Launcher::SpawnAndWait(req, &info);
+}
+
+static int BenchSpawn(size_t rss_mb)
+{
+    // 占用并写入内存，让页表足够大
+    std::vector<char> ballast(rss_mb * 1024 * 1024);
+    for (size_t i = 0; i < ballast.size(); i += 4096)
+    {
+        ballast[i] = 1;
+    }
+    printf("rss ballast: %zu MB\n", rss_mb);
+
+    for (int concurrency : {1, 8, 64})
+    {
+        int total = std::max(256, concurrency * 8);
+        for (int kind = 0; kind < 2; ++kind)
+        {
+            auto begin = std::chrono::steady_clock::now();
+            std::vector<double> lat = kind == 0 ? RunConcurrent(concurrency, total, ForkExec)
+                                                : RunConcurrent(concurrency, total, LauncherSpawn);
+            auto end = std::chrono::steady_clock::now();
+            Report(kind == 0 ? "fork+exec" : "launcher", concurrency, lat,
+                   std::chrono::duration<double, std::milli>(end - begin).count());
+        }
+    }
+    return 0;
+}
+
+static std::map<std::string, long long> ReadProcIo()
+{
+    std::map<std::string, long long> io;
+    std::ifstream in("/proc/self/io");
+    std::string key;
+    long long value;
+    while (in >> key >> value)
+    {
+        io[key.substr(0, key.size() - 1)] = value;
+    }
+    return io;
+}
+
+static int BenchIo(int jobs)
+{
+    static std::atomic_int seq(0);
+    for (bool in_memory : {false, true})
+    {
+        Conf::Instance().Set("in_memory", in_memory ? "true" : "false");
+        PathUtil::TempPath() = in_memory ? "/dev/shm/oj_bench/" : "./temp/";
+        mkdir(PathUtil::TempPath().c_str(), 0755);
+        if (in_memory)
+        {
+            setenv("TMPDIR", PathUtil::TempPath().c_str(), 1);
+        }
+
+        std::map<std::string, long long> before = ReadProcIo();
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<double> lat = RunConcurrent(jobs, jobs, []()
+        {
+            // 每份代码都不一样，编译缓存也没有初始化，保证每次都真正编译
+            Json::Value in_value;
+            in_value["code"] = "#include <cstdio>\nint main(){ printf(\"" + std::to_string(++seq) + "\"); }\n";
+            in_value["input"] = "";
+            in_value["cpu_limit"] = 1;
+            in_value["mem_limit"] = 256 * 1024;
+            Json::FastWriter writer;
+            std::string out_json;
+            CompileAndRun::Start(writer.write(in_value), &out_json);
+        });
+        auto end = std::chrono::steady_clock::now();
+        std::map<std::string, long long> after = ReadProcIo();
+
+        double wall_ms = std::chrono::duration<double, std::milli>(end - begin).count();
+        Report(in_memory ? "in_memory" : "disk", jobs, lat, wall_ms);
+        long long syscalls = after["syscr"] + after["syscw"] - before["syscr"] - before["syscw"];
+        printf("%-12s read_syscalls=%lld write_syscalls=%lld io_syscalls/s=%.0f storage_read_kb=%lld storage_write_kb=%lld\n",
+               "", after["syscr"] - before["syscr"], after["syscw"] - before["syscw"], syscalls * 1000.0 / wall_ms,
+               (after["read_bytes"] - before["read_bytes"]) / 1024, (after["write_bytes"] - before["write_bytes"]) / 1024);
+    }
+    return 0;
+}
+
+// 每次都从头创建沙箱：新的命名空间(PID命名空间要再fork一次才能进入)、把挂载点改成只读、挂载私有/tmp和/proc、安装seccomp
+static void ScratchSandbox()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (unshare(CLONE_NEWPID) < 0)
+        {
+            _exit(1);
+        }
+        pid_t init = fork();
+        if (init != 0)
+        {
+            int status = 0;
+            waitpid(init, &status, 0);
+            _exit(init < 0 ? 1 : 0);
+        }
+        if (!Sandbox::Setup(16) || prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0 ||
+            prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, Sandbox::Filter()) < 0)
+        {
+            _exit(1);
+        }
+        execl("/bin/true", "/bin/true", nullptr);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+}
+
+static void PooledSandbox()
+{
+    SpawnRequest req;
+    req.argv = {"/bin/true"};
+    ExitInfo info;
+    Zygote *sandbox = SandboxPool::Instance().Acquire();
+    sandbox->Spawn(req, &info);
+    SandboxPool::Instance().Release(sandbox);
+}
+
+static int BenchSandbox(int runs)
+{
+    // 沙箱池是fork出来的，必须在创建线程之前初始化
+    if (!SandboxPool::Instance().Init(1, 16, "nobody"))
+    {
+        std::cerr << "沙箱不可用(需要root和CAP_SYS_ADMIN)" << std::endl;
+        return 1;
+    }
+    const char *names[] = {"none", "scratch", "pooled"};
+    void (*funcs[])() = {LauncherSpawn, ScratchSandbox, PooledSandbox};
+    for (int kind = 0; kind < 3; ++kind)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<double> lat = RunConcurrent(1, runs, funcs[kind]);
+        auto end = std::chrono::steady_clock::now();
+        Report(names[kind], 1, lat, std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+    return 0;
+}
+
+// 运行一个测试用例：标准输入是"21"，返回标准输出
+static std::string RunCase(Zygote *server, const std::string &exe)
+{
+    SpawnRequest req;
+    req.argv = {exe};
+    req.stdin_fd = MemFd::Create("stdin", "21\n");
+    req.stdout_fd = MemFd::Create("stdout");
+    ExitInfo info;
+    if (server != nullptr)
+    {
+        server->Spawn(req, &info);
+    }
+    else
+    {
+        Launcher::SpawnAndWait(req, &info);
+    }
+    std::string out;
+    MemFd::ReadAll(req.stdout_fd, &out);
+    close(req.stdin_fd);
+    close(req.stdout_fd);
+    return out;
+}
+
+static int BenchForkServer(int runs)
+{
+    std::string code = "#include <iostream>\nint main(){ int x; std::cin >> x; std::cout << x * 2 << std::endl; }\n";
+    PathUtil::TempPath() = "./temp/";
+    mkdir(PathUtil::TempPath().c_str(), 0755);
+    FileUtil::WriteFile(PathUtil::Src("bench_exec"), code);
+    FileUtil::WriteFile(PathUtil::Src("bench_fork"), code);
+    // 先编译不带stub的版本，再设置链接参数编译带stub的版本
+    if (Compiler::Compile("bench_exec", code) != CompileStatus::SUCCESS ||
+        !ForkServerStub::Instance().Init("./forkserver_stub.cpp", fork_server_path, 2) ||
+        Compiler::Compile("bench_fork", code) != CompileStatus::SUCCESS)
+    {
+        std::cerr << "编译测试程序失败" << std::endl;
+        return 1;
+    }
+    std::string exec_exe = PathUtil::Exe("bench_exec");
+    std::string fork_exe = PathUtil::Exe("bench_fork");
+
+    // 启动fork server，等待它停在main之前
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+    SpawnRequest req;
+    req.argv = {fork_exe};
+    req.control_fd = sv[1];
+    pid_t pid = Launcher::Spawn(req);
+    close(sv[1]);
+    Reply ready;
+    if (pid < 0 || !Zygote::ReadReply(sv[0], &ready) || ready.type != READY)
+    {
+        std::cerr << "fork server启动失败" << std::endl;
+        return 1;
+    }
+    Zygote server;
+    server.Attach(sv[0]);
+    std::cout << "exec: " << RunCase(nullptr, exec_exe) << "fork server: " << RunCase(&server, fork_exe);
+
+    const char *names[] = {"exec", "exec+stub", "fork server"};
+    for (int kind = 0; kind < 3; ++kind)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<double> lat = RunConcurrent(1, runs, [&]()
+        {
+            if (kind == 0) RunCase(nullptr, exec_exe);
+            if (kind == 1) RunCase(nullptr, fork_exe);
+            if (kind == 2) RunCase(&server, fork_exe);
+        });
+        auto end = std::chrono::steady_clock::now();
+        Report(names[kind], 1, lat, std::chrono::duration<double, std::milli>(end - begin).count());
+    }
+    server.Close();
+    waitpid(pid, nullptr, 0);
+    CompileAndRun::RemoveTempFile("bench_exec");
+    CompileAndRun::RemoveTempFile("bench_fork");
+    return 0;
+}
+
+// 之前的做法：整个输出读入内存，去掉每行末尾的空白和末尾的空行
+static std::string NormalizeLines(const std::string &content)
+{
+    std::string result;
+    size_t begin = 0;
+    while (begin < content.size())
+    {
+        size_t end = content.find('\n', begin);
+        if (end == std::string::npos)
+        {
+            end = content.size();
+        }
+        size_t last = end;
+        while (last > begin && isspace(static_cast<unsigned char>(content[last - 1])))
+        {
+            --last;
+        }
+        result.append(content, begin, last - begin);
+        result += '\n';
+        begin = end + 1;
+    }
+    while (!result.empty() && result.back() == '\n')
+    {
+        result.pop_back();
+    }
+    return result;
+}
+
+static int BenchChecker(int mb)
+{
+    std::string expected;
+    size_t size = static_cast<size_t>(mb) << 20;
+    expected.reserve(size + 32);
+    for (int i = 0; expected.size() < size; ++i)
+    {
+        expected += std::to_string(i);
+        expected += i % 2 ? ".25\n" : "\n";
+    }
+    int fd = MemFd::Create("bench_output", expected);
+    if (fd < 0)
+    {
+        std::cerr << "创建内存文件失败" << std::endl;
+        return 1;
+    }
+    double total_mb = expected.size() / 1048576.0;
+    printf("output: %.1f MB\n", total_mb);
+
+    const char *names[] = {"exact", "line", "token", "float"};
+    for (const char *name : names)
+    {
+        CheckMode mode = CheckMode::LINE;
+        Checker::ParseMode(name, &mode);
+        lseek(fd, 0, SEEK_SET);
+        auto begin = std::chrono::steady_clock::now();
+        CheckResult result = Checker::Check(fd, expected.data(), expected.size(), mode, 1e-6);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        printf("%-12s ok=%d time=%8.1fms throughput=%8.1fMB/s\n", name, result.ok, ms, total_mb * 1000 / ms);
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    std::string output;
+    MemFd::ReadAll(fd, &output);
+    bool ok = NormalizeLines(output) == NormalizeLines(expected);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    printf("%-12s ok=%d time=%8.1fms throughput=%8.1fMB/s\n", "read+normalize", ok, ms, total_mb * 1000 / ms);
+    close(fd);
+    return 0;
+}
+
+// 准备runs次标准输入，每次读到文件末尾(子进程读取的部分)后关闭，返回平均每次的时间(us)
+template <class OpenFunc>
+static double TimeStdin(int runs, size_t size, OpenFunc open_stdin)
+{
+    std::vector<char> buffer(1 << 16);
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < runs; ++i)
+    {
+        int fd = open_stdin();
+        size_t total = 0;
+        ssize_t n;
+        while ((n = read(fd, buffer.data(), buffer.size())) > 0)
+        {
+            total += n;
+        }
+        close(fd);
+        if (total != size)
+        {
+            std::cerr << "读到的长度不对: " << total << std::endl;
+        }
+    }
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count() / runs;
+}
+
+static int BenchTestData(int kb, int runs)
+{
+    Json::Value tests;
+    tests[0]["input"] = std::string(static_cast<size_t>(kb) * 1024, '7');
+    tests[0]["output"] = "";
+    const std::string input = tests[0]["input"].asString();
+    std::shared_ptr<const TestData> data = TestData::Create(tests);
+    if (!data)
+    {
+        std::cerr << "创建测试数据失败" << std::endl;
+        return 1;
+    }
+    std::string path = PathUtil::Stdin("bench_testdata");
+    double file_us = TimeStdin(runs, input.size(), [&]()
+                               {
+                                   FileUtil::WriteFile(path, input);
+                                   return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                               });
+    unlink(path.c_str());
+    double copy_us = TimeStdin(runs, input.size(), [&]()
+                               { return MemFd::Create("stdin", input); });
+    double store_us = TimeStdin(runs, input.size(), [&]()
+                                { return MemFd::Reopen(data->InputFd(0)); });
+    printf("input: %d KB, runs: %d\n", kb, runs);
+    printf("%-16s %10.1fus/run\n", "temp file", file_us);
+    printf("%-16s %10.1fus/run\n", "memfd copy", copy_us);
+    printf("%-16s %10.1fus/run\n", "sealed reopen", store_us);
+    return 0;
+}
+
+static int BenchPch(const std::string &conf_file)
+{
+    if (!Conf::Instance().Load(conf_file))
+    {
+        return 1;
+    }
+    const std::vector<std::pair<std::string, std::string>> sets = {
+        {"palindrome", "#include <iostream>\n#include <string>\n#include <vector>\n#include <algorithm>\n"},
+        {"contest", "#include <iostream>\n#include <vector>\n#include <string>\n#include <algorithm>\n#include <map>\n"
+                    "#include <set>\n#include <queue>\n#include <unordered_map>\n#include <cstring>\n#include <cmath>\n"},
+        {"bits", "#include <bits/stdc++.h>\n"},
+    };
+    char dir_template[] = "/tmp/bench_pch_XXXXXX";
+    if (mkdtemp(dir_template) == nullptr)
+    {
+        return 1;
+    }
+    std::string dir = dir_template;
+    int failed = 0;
+    for (const auto &item : sets)
+    {
+        std::string header = dir + "/" + item.first + ".h";
+        std::string gch = header + ".gch";
+        std::string err_file = header + ".err";
+        FileUtil::WriteFile(header, item.second);
+        auto begin = std::chrono::steady_clock::now();
+        bool ok = Compiler::CompileHeader(header, gch, err_file);
+        auto end = std::chrono::steady_clock::now();
+        struct stat st;
+        long long size_kb = ok && stat(gch.c_str(), &st) == 0 ? st.st_size / 1024 : 0;
+        printf("%-12s %-6s size=%8lldKB time=%8.1fms\n", item.first.c_str(), ok ? "ok" : "FAILED", size_kb,
+               std::chrono::duration<double, std::milli>(end - begin).count());
+        if (!ok)
+        {
+            std::string err;
+            FileUtil::ReadFile(err_file, &err, true);
+            std::cerr << err;
+            ++failed;
+        }
+        unlink(header.c_str());
+        unlink(gch.c_str());
+        unlink(err_file.c_str());
+    }
+    rmdir(dir.c_str());
+    return failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        Usage(argv[0]);
+        return 1;
+    }
+    std::string mode = argv[1];
+    if (mode == "spawn")
+    {
+        return BenchSpawn(argc > 2 ? atoi(argv[2]) : 256);
+    }
+    if (mode == "io")
+    {
+        return BenchIo(argc > 2 ? atoi(argv[2]) : 32);
+    }
+    if (mode == "sandbox")
+    {
+        return BenchSandbox(argc > 2 ? atoi(argv[2]) : 200);
+    }
+    if (mode == "forkserver")
+    {
+        return BenchForkServer(argc > 2 ? atoi(argv[2]) : 500);
+    }
+    if (mode == "checker")
+    {
+        return BenchChecker(argc > 2 ? atoi(argv[2]) : 128);
+    }
+    if (mode == "speed")
+    {
+        printf("speed_reference_ms=%lld\n", static_cast<long long>(ns_speed::SpeedCalibration::Benchmark()));
+        // 硬件性能计数器不可用时为0
+        printf("instructions_per_ms=%lld\n", static_cast<long long>(ns_perf::InstructionCounter::Measure()));
+        return 0;
+    }
+    if (mode == "testdata")
+    {
+        return BenchTestData(argc > 2 ? atoi(argv[2]) : 1024, argc > 3 ? atoi(argv[3]) : 1000);
+    }
+    if (mode == "pch")
+    {
+        return BenchPch(argc > 2 ? argv[2] : compile_server_conf);
+    }
+    Usage(argv[0]);
+    return 1;
+}
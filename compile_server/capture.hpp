@@ -0,0 +1,189 @@
+#pragma once
+
+#include "../comm/log.hpp"
+
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+
+// 通过管道收集子进程的标准输出和标准错误，不再经过临时文件
+// 写端交给子进程，读端由等待子进程退出的一方(reaper线程，或者没有reaper时的请求线程)非阻塞地读入内存
+// 两者合计超过上限时多出来的部分直接丢弃，等待方看到Exceeded后杀掉整个进程组
+// 无限输出的程序因此既写不满磁盘，也占不满内存
+// 设置了标准输出的sink时(比如输出检查，见checker.hpp)，读出的每一块立即交给它，只保存开头的一部分
+namespace ns_capture
+{
+    using namespace ns_log;
+
+    class OutputCapture
+    {
+    public:
+        enum Stream
+        {
+            STDOUT = 0,
+            STDERR = 1,
+        };
+
+        // limit: 标准输出和标准错误合计的字节数上限，0表示不限制
+        explicit OutputCapture(size_t limit) : limit(limit)
+        {
+        }
+
+        ~OutputCapture()
+        {
+            CloseWriteEnds();
+            Close(STDOUT);
+            Close(STDERR);
+        }
+
+        // 标准输出的每一块读出后交给sink(在调用Drain/Finish的线程里)，自己只保存前keep个字节
+        // 输出上限仍然按全部的输出计算
+        void SetStdoutSink(std::function<void(const char *, size_t)> stdout_sink, size_t keep)
+        {
+            sink = std::move(stdout_sink);
+            sink_keep = keep;
+        }
+
+        // 创建两个管道，读端非阻塞，两端都是O_CLOEXEC，写端由Launcher/zygote dup2到1/2
+        bool Open()
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                int fds[2];
+                if (pipe2(fds, O_CLOEXEC) < 0)
+                {
+                    LOG(ERROR) << "创建输出管道失败: " << strerror(errno) << "\n";
+                    return false;
+                }
+                read_fds[i] = fds[0];
+                write_fds[i] = fds[1];
+                fcntl(read_fds[i], F_SETFL, O_NONBLOCK);
+                // 默认64KB，输出多的程序要频繁唤醒读取方；调大失败(超过pipe-max-size)时保持默认
+                fcntl(write_fds[i], F_SETPIPE_SZ, pipe_size);
+            }
+            return true;
+        }
+
+        int WriteFd(Stream stream) const
+        {
+            return write_fds[stream];
+        }
+
+        int ReadFd(Stream stream) const
+        {
+            return read_fds[stream];
+        }
+
+        // 子进程创建之后关闭自己手里的写端，子进程(以及它的后代)是唯一的写入方
+        void CloseWriteEnds()
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                if (write_fds[i] >= 0)
+                {
+                    close(write_fds[i]);
+                    write_fds[i] = -1;
+                }
+            }
+        }
+
+        // 读出管道里现有的数据，最多max_bytes个字节(0表示读到管道为空)
+        // 返回值：false表示写端都已经关闭(或者出错)，不会再有数据，调用方应该Close
+        bool Drain(Stream stream, size_t max_bytes = 0)
+        {
+            char buffer[64 * 1024];
+            size_t drained = 0;
+            while (max_bytes == 0 || drained < max_bytes)
+            {
+                ssize_t n = read(read_fds[stream], buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0)
+                {
+                    return errno == EAGAIN;
+                }
+                if (n == 0)
+                {
+                    return false;
+                }
+                Append(stream, buffer, n);
+                drained += n;
+            }
+            return true;
+        }
+
+        void Close(Stream stream)
+        {
+            if (read_fds[stream] >= 0)
+            {
+                close(read_fds[stream]);
+                read_fds[stream] = -1;
+            }
+        }
+
+        // 子进程已经退出：读出管道里剩下的数据并关闭读端
+        // 子进程的后代可能还拿着写端，所以不等待EOF；管道里剩下的最多是一个管道的容量，更多的只能来自还在写的后代，不再读
+        void Finish()
+        {
+            for (int i = 0; i < 2; ++i)
+            {
+                Stream stream = static_cast<Stream>(i);
+                if (read_fds[stream] >= 0)
+                {
+                    Drain(stream, pipe_size);
+                    Close(stream);
+                }
+            }
+        }
+
+        // 等待方每轮最多从一个管道读出的字节数：程序写得比读得快时管道一直可读，
+        // 一次读到空会让读取和输出检查(sink)占住等待方，截止时刻和其他子进程都得不到处理；
+        // 剩下的数据留在管道里，下一轮poll/epoll(水平触发)再读
+        static const size_t drain_chunk = 1024 * 1024;
+
+        bool Exceeded() const
+        {
+            return exceeded;
+        }
+
+        std::string &Data(Stream stream)
+        {
+            return data[stream];
+        }
+
+    private:
+        void Append(Stream stream, const char *p, size_t n)
+        {
+            if (limit > 0 && total + n > limit)
+            {
+                n = limit - total;
+                exceeded = true;
+            }
+            total += n;
+            if (stream == STDOUT && sink)
+            {
+                sink(p, n);
+                n = std::min(n, sink_keep - std::min(sink_keep, data[stream].size()));
+            }
+            data[stream].append(p, n);
+        }
+
+    private:
+        static const int pipe_size = 1024 * 1024;
+
+        size_t limit;
+        size_t total = 0;
+        bool exceeded = false;
+        int read_fds[2] = {-1, -1};
+        int write_fds[2] = {-1, -1};
+        std::string data[2];
+        std::function<void(const char *, size_t)> sink;
+        size_t sink_keep = 0;
+    };
+}
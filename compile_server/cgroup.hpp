@@ -0,0 +1,307 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+#include "launcher.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <jsoncpp/json/json.h>
+
+// cgroup v2 后端：用户程序运行在单独的cgroup里
+// memory.max 限制的是真正使用的内存(RSS+页缓存)，不像RLIMIT_AS那样把预留的虚拟地址空间也算进去
+// pids.max 限制fork炸弹，cpu.max 限制最多使用的CPU，memory.peak/cpu.stat 用来统计，memory.events里的oom_kill用来判断MLE
+// cgroup从池子里复用，不用每次运行都mkdir/rmdir；运行结束后用cgroup.kill杀掉所有残留的进程(包括setsid逃出进程组的)
+// 不可用时(不是cgroup v2、没有需要的控制器、没有权限)退回到rlimit
+namespace ns_cgroup
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_launcher;
+
+    class Cgroup
+    {
+    public:
+        explicit Cgroup(const std::string &cgroup_path) : path(cgroup_path) {}
+        ~Cgroup()
+        {
+            CloseFds();
+        }
+
+        const std::string &Path() const
+        {
+            return path;
+        }
+
+        // 设置本次运行的限制，并记录统计的起点
+        // mem_limit: kb，0表示不限制；cpu_quota/cpu_period: us
+        bool Prepare(int mem_limit, int pids_max, int cpu_quota, int cpu_period)
+        {
+            CloseFds();
+            std::string memory_max = mem_limit > 0 ? std::to_string(static_cast<int64_t>(mem_limit) * 1024) : "max";
+            std::string cpu_max = (cpu_quota > 0 ? std::to_string(cpu_quota) : "max") + " " + std::to_string(cpu_period);
+            if (!Write("memory.max", memory_max) ||
+                !Write("pids.max", pids_max > 0 ? std::to_string(pids_max) : "max") ||
+                !Write("cpu.max", cpu_max))
+            {
+                return false;
+            }
+            // 不允许用swap绕过内存限制，没有开启swap统计时这个文件不存在
+            Write("memory.swap.max", "0");
+            // 重置峰值内存：写memory.peak只对这个fd之后的读取生效
+            peak_fd = open((path + "/memory.peak").c_str(), O_RDWR | O_CLOEXEC);
+            if (peak_fd < 0 || write(peak_fd, "reset", 5) < 0)
+            {
+                return false;
+            }
+            procs_fd = open((path + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+            if (procs_fd < 0)
+            {
+                return false;
+            }
+            cpu_usec_before = ReadKey("cpu.stat", "usage_usec");
+            oom_kills_before = ReadKey("memory.events", "oom_kill");
+            return true;
+        }
+
+        // 交给Launcher的cgroup.procs，子进程在exec之前把自己写进去
+        int ProcsFd() const
+        {
+            return procs_fd;
+        }
+
+        // 子进程退出后调用：用cgroup的统计覆盖usage中的CPU时间和峰值内存
+        // 返回值：本次运行是否被OOM杀掉
+        bool Collect(ResourceUsage *usage)
+        {
+            char buffer[64];
+            ssize_t n = pread(peak_fd, buffer, sizeof(buffer) - 1, 0);
+            if (n > 0)
+            {
+                buffer[n] = '\0';
+                usage->max_rss_kb = atoll(buffer) / 1024;
+            }
+            int64_t cpu_usec = ReadKey("cpu.stat", "usage_usec");
+            if (cpu_usec >= cpu_usec_before)
+            {
+                usage->cpu_ms = (cpu_usec - cpu_usec_before) / 1000;
+            }
+            return ReadKey("memory.events", "oom_kill") > oom_kills_before;
+        }
+
+        // 杀掉cgroup里残留的所有进程
+        void KillAll()
+        {
+            CloseFds();
+            Write("cgroup.kill", "1");
+        }
+
+        // cgroup里是否还有进程
+        bool Populated()
+        {
+            return ReadKey("cgroup.events", "populated") != 0;
+        }
+
+        bool Write(const std::string &file, const std::string &content)
+        {
+            int fd = open((path + "/" + file).c_str(), O_WRONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                return false;
+            }
+            bool ok = write(fd, content.c_str(), content.size()) == static_cast<ssize_t>(content.size());
+            close(fd);
+            return ok;
+        }
+
+    private:
+        // 读取 "key value" 格式的文件(cpu.stat、memory.events、cgroup.events)中key对应的值，失败返回-1
+        int64_t ReadKey(const std::string &file, const std::string &key)
+        {
+            std::string content;
+            if (!FileUtil::ReadFile(path + "/" + file, &content, true))
+            {
+                return -1;
+            }
+            std::vector<std::string> lines;
+            StringUtil::SplitString(content, &lines, "\n");
+            for (const auto &line : lines)
+            {
+                if (line.compare(0, key.size() + 1, key + " ") == 0)
+                {
+                    return atoll(line.c_str() + key.size() + 1);
+                }
+            }
+            return -1;
+        }
+
+        void CloseFds()
+        {
+            if (peak_fd >= 0) close(peak_fd);
+            if (procs_fd >= 0) close(procs_fd);
+            peak_fd = -1;
+            procs_fd = -1;
+        }
+
+    private:
+        std::string path;
+        int peak_fd = -1;
+        int procs_fd = -1;
+        int64_t cpu_usec_before = 0;
+        int64_t oom_kills_before = 0;
+    };
+
+    class CgroupPool
+    {
+    public:
+        static CgroupPool &Instance()
+        {
+            static CgroupPool pool;
+            return pool;
+        }
+
+        // root: cgroup v2的挂载点，在它下面创建 oj_judge/run_N
+        // pids_max: 每次运行最多的进程(线程)数；cpus: 每次运行最多使用的CPU个数
+        bool Init(const std::string &root, int pids_max, int cpus)
+        {
+            struct statfs fs;
+            if (statfs(root.c_str(), &fs) < 0 || fs.f_type != CGROUP2_SUPER_MAGIC)
+            {
+                LOG(WARNING) << root << " 不是cgroup v2，使用rlimit限制资源" << "\n";
+                return false;
+            }
+            std::string controllers;
+            FileUtil::ReadFile(root + "/cgroup.controllers", &controllers);
+            for (const char *controller : {"memory", "pids", "cpu"})
+            {
+                if ((" " + controllers + " ").find(std::string(" ") + controller + " ") == std::string::npos)
+                {
+                    LOG(WARNING) << root << " 没有 " << controller << " 控制器，使用rlimit限制资源" << "\n";
+                    return false;
+                }
+            }
+            base = root + "/oj_judge";
+            mkdir(base.c_str(), 0755);
+            // 子cgroup要使用这些控制器，上一级必须先在subtree_control中打开
+            Cgroup root_group(root), base_group(base);
+            root_group.Write("cgroup.subtree_control", "+memory +pids +cpu");
+            if (!base_group.Write("cgroup.subtree_control", "+memory +pids +cpu"))
+            {
+                LOG(WARNING) << "打开cgroup控制器失败: " << strerror(errno) << "，使用rlimit限制资源" << "\n";
+                return false;
+            }
+            pids_limit = pids_max;
+            cpu_quota = cpus > 0 ? cpus * cpu_period : 0;
+
+            // 试用一次，确认可以设置限制(比如memory.peak需要较新的内核才能重置)
+            std::shared_ptr<Cgroup> probe = Create();
+            if (!probe || !probe->Prepare(0, pids_limit, cpu_quota, cpu_period))
+            {
+                LOG(WARNING) << "cgroup不可用: " << strerror(errno) << "，使用rlimit限制资源" << "\n";
+                return false;
+            }
+            probe->KillAll();
+            free_list.push_back(probe);
+            enabled = true;
+            LOG(INFO) << "cgroup v2 后端启动成功: " << base << "\n";
+            return true;
+        }
+
+        bool Enabled() const
+        {
+            return enabled;
+        }
+
+        // 取出一个空闲的cgroup并设置好限制，失败返回nullptr(调用方退回到rlimit)
+        std::shared_ptr<Cgroup> Acquire(int mem_limit)
+        {
+            std::shared_ptr<Cgroup> cgroup;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                // 上一次运行残留的进程可能还没有死透，跳过这样的cgroup
+                for (auto iter = free_list.begin(); iter != free_list.end(); ++iter)
+                {
+                    if (!(*iter)->Populated())
+                    {
+                        cgroup = *iter;
+                        free_list.erase(iter);
+                        break;
+                    }
+                }
+            }
+            if (!cgroup)
+            {
+                cgroup = Create();
+            }
+            if (!cgroup || !cgroup->Prepare(mem_limit, pids_limit, cpu_quota, cpu_period))
+            {
+                LOG(WARNING) << "准备cgroup失败，本次运行使用rlimit" << "\n";
+                if (cgroup)
+                {
+                    Release(cgroup);
+                }
+                return nullptr;
+            }
+            return cgroup;
+        }
+
+        // 运行结束，杀掉残留进程后放回池子
+        void Release(const std::shared_ptr<Cgroup> &cgroup)
+        {
+            cgroup->KillAll();
+            std::lock_guard<std::mutex> lock(mtx);
+            free_list.push_back(cgroup);
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["created"] = Json::UInt64(created);
+            stats["free"] = Json::UInt64(free_list.size());
+            return stats;
+        }
+
+    private:
+        CgroupPool() = default;
+        CgroupPool(const CgroupPool &) = delete;
+        CgroupPool &operator=(const CgroupPool &) = delete;
+
+        std::shared_ptr<Cgroup> Create()
+        {
+            size_t id;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                id = created++;
+            }
+            std::string path = base + "/run_" + std::to_string(id);
+            if (mkdir(path.c_str(), 0755) < 0 && errno != EEXIST)
+            {
+                LOG(ERROR) << "创建cgroup失败: " << path << " " << strerror(errno) << "\n";
+                return nullptr;
+            }
+            return std::make_shared<Cgroup>(path);
+        }
+
+    private:
+        static const int cpu_period = 100000; // cpu.max的周期(us)
+        bool enabled = false;
+        std::string base;
+        int pids_limit = 0;
+        int cpu_quota = 0;
+        std::mutex mtx;
+        std::vector<std::shared_ptr<Cgroup>> free_list;
+        size_t created = 0;
+    };
+}
@@ -0,0 +1,615 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// 输出检查：程序的标准输出和期望输出逐块比较，不复制、不规范化，几百MB的输出也只占用一块缓冲区
+// 程序输出一块一块地交给StreamChecker(运行时从管道读出一块就检查一块，见capture.hpp)，也可以来自fd
+// 支持四种模式：
+//   exact: 逐字节相同
+//   line:  忽略每行末尾的空白和末尾的空行，行首和行内的空白要相同(默认，和之前按行规范化后比较的结果一致)
+//   token: 按空白分隔成记号逐个比较，空白的种类和个数都不重要
+//   float: 同token，不相同的两个记号都是数字时，绝对误差或相对误差不超过epsilon就算相同
+// 空白指所有不大于空格(0x20)的字节：空格、\t、\n、\r等
+// 字节扫描在x86_64上按CPU选择AVX2或者SSE2，每次比较32/16个字节
+namespace ns_checker
+{
+    enum class CheckMode
+    {
+        EXACT,
+        LINE,
+        TOKEN,
+        FLOAT,
+    };
+
+    struct CheckResult
+    {
+        bool ok = true;
+        int64_t offset = 0; // 第一个不一致的位置在程序输出中的字节偏移
+        int64_t line = 0;   // 第一个不一致的位置在程序输出中的行号，从1开始
+    };
+
+    // 字节扫描，返回第一个满足条件的位置，没有时返回n
+    class Scan
+    {
+    public:
+        // a[i] != b[i]
+        static size_t Mismatch(const char *a, const char *b, size_t n)
+        {
+            return Find<MISMATCH>(a, b, n);
+        }
+
+        // a[i] != b[i]，或者a[i]是空白(此时b[i]也是同一个空白)
+        static size_t MismatchOrSpace(const char *a, const char *b, size_t n)
+        {
+            return Find<MISMATCH_OR_SPACE>(a, b, n);
+        }
+
+        static size_t FindSpace(const char *p, size_t n)
+        {
+            return Find<SPACE>(p, p, n);
+        }
+
+        static size_t FindNonSpace(const char *p, size_t n)
+        {
+            return Find<NON_SPACE>(p, p, n);
+        }
+
+        // c出现的次数
+        static size_t Count(const char *p, size_t n, char c)
+        {
+            size_t count = 0;
+            size_t i = 0;
+#if defined(__x86_64__)
+            __m128i target = _mm_set1_epi8(c);
+            for (; i + 16 <= n; i += 16)
+            {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+                count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, target)));
+            }
+#endif
+            for (; i < n; ++i)
+            {
+                count += p[i] == c;
+            }
+            return count;
+        }
+
+        static bool IsSpace(char c)
+        {
+            return static_cast<unsigned char>(c) <= 0x20;
+        }
+
+    private:
+        enum Kind
+        {
+            MISMATCH,
+            MISMATCH_OR_SPACE,
+            SPACE,
+            NON_SPACE,
+        };
+
+        template <Kind kind>
+        static bool Match(char a, char b)
+        {
+            switch (kind)
+            {
+            case MISMATCH:
+                return a != b;
+            case MISMATCH_OR_SPACE:
+                return a != b || IsSpace(a);
+            case SPACE:
+                return IsSpace(a);
+            default:
+                return !IsSpace(a);
+            }
+        }
+
+        template <Kind kind>
+        static size_t FindScalar(const char *a, const char *b, size_t n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (Match<kind>(a[i], b[i]))
+                {
+                    return i;
+                }
+            }
+            return n;
+        }
+
+#if defined(__x86_64__)
+        // 16个字节的结果，第i位为1表示第i个字节满足条件
+        template <Kind kind>
+        static uint32_t Mask16(const char *a, const char *b)
+        {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+            // 无符号比较 va <= 0x20：min(va, 0x20) == va
+            __m128i space = _mm_set1_epi8(0x20);
+            uint32_t is_space = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(va, space), va));
+            if (kind == SPACE)
+            {
+                return is_space;
+            }
+            if (kind == NON_SPACE)
+            {
+                return ~is_space & 0xFFFF;
+            }
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+            uint32_t neq = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+            return kind == MISMATCH ? neq : (neq | is_space);
+        }
+
+        template <Kind kind>
+        __attribute__((target("avx2"))) static uint32_t Mask32(const char *a, const char *b)
+        {
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a));
+            __m256i space = _mm256_set1_epi8(0x20);
+            uint32_t is_space = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(va, space), va));
+            if (kind == SPACE)
+            {
+                return is_space;
+            }
+            if (kind == NON_SPACE)
+            {
+                return ~is_space;
+            }
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+            uint32_t neq = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+            return kind == MISMATCH ? neq : (neq | is_space);
+        }
+
+        template <Kind kind>
+        static size_t FindSse2(const char *a, const char *b, size_t n)
+        {
+            size_t i = 0;
+            for (; i + 16 <= n; i += 16)
+            {
+                uint32_t mask = Mask16<kind>(a + i, b + i);
+                if (mask != 0)
+                {
+                    return i + __builtin_ctz(mask);
+                }
+            }
+            return i + FindScalar<kind>(a + i, b + i, n - i);
+        }
+
+        template <Kind kind>
+        __attribute__((target("avx2"))) static size_t FindAvx2(const char *a, const char *b, size_t n)
+        {
+            size_t i = 0;
+            for (; i + 32 <= n; i += 32)
+            {
+                uint32_t mask = Mask32<kind>(a + i, b + i);
+                if (mask != 0)
+                {
+                    return i + __builtin_ctz(mask);
+                }
+            }
+            return i + FindSse2<kind>(a + i, b + i, n - i);
+        }
+
+        static bool HasAvx2()
+        {
+            static const bool avx2 = __builtin_cpu_supports("avx2");
+            return avx2;
+        }
+#endif
+
+        // 只比较一个流时b传入a
+        template <Kind kind>
+        static size_t Find(const char *a, const char *b, size_t n)
+        {
+#if defined(__x86_64__)
+            return HasAvx2() ? FindAvx2<kind>(a, b, n) : FindSse2<kind>(a, b, n);
+#else
+            return FindScalar<kind>(a, b, n);
+#endif
+        }
+    };
+
+    // 增量的输出检查：程序输出按到达的顺序一块一块地交给Feed(比如运行时从管道读出的每一块)，期望输出整块在内存里
+    // 每一块处理完就可以丢弃，程序输出多大都不需要保存；记号和空白可以跨越块的边界，状态保存在这里
+    class StreamChecker
+    {
+    public:
+        // expected/size: 期望输出，检查结束之前要一直有效
+        // epsilon: float模式下允许的绝对误差或相对误差
+        StreamChecker(const char *expected, size_t size, CheckMode mode, double epsilon)
+            : exp(expected), exp_size(size), mode(mode), epsilon(epsilon)
+        {
+            if (mode != CheckMode::EXACT)
+            {
+                // 开头可能有一段空白(可以为空)，之后空白和记号交替出现
+                EnterBlank();
+            }
+        }
+
+        // 程序输出的下一块，已经确定不一致之后的输出直接忽略
+        void Feed(const char *data, size_t size)
+        {
+            if (mode == CheckMode::EXACT)
+            {
+                FeedExact(data, size);
+                return;
+            }
+            size_t pos = 0;
+            while (pos < size && result.ok)
+            {
+                switch (state)
+                {
+                case State::BLANK:
+                    pos += FeedBlank(data + pos, size - pos);
+                    break;
+                case State::TOKEN:
+                    pos += FeedToken(data + pos, size - pos);
+                    break;
+                case State::DIVERGED:
+                    pos += FeedDiverged(data + pos, size - pos);
+                    break;
+                }
+            }
+        }
+
+        // 程序输出已经结束，返回检查结果
+        CheckResult Finish()
+        {
+            if (!result.ok)
+            {
+                return result;
+            }
+            if (mode == CheckMode::EXACT)
+            {
+                // 程序输出是期望输出的前缀
+                if (exp_pos < exp_size)
+                {
+                    Fail(offset, line);
+                }
+                return result;
+            }
+            if (state == State::TOKEN && exp_pos < exp_size && !Scan::IsSpace(exp[exp_pos]))
+            {
+                // 程序输出的记号在末尾结束，期望输出的记号还没有结束
+                if (mode != CheckMode::FLOAT)
+                {
+                    Fail(token_offset, line);
+                    return result;
+                }
+                state = State::DIVERGED;
+                ReadExpToken();
+            }
+            if (state == State::DIVERGED && !CloseNumbers(out_token, exp_token, epsilon))
+            {
+                Fail(token_offset, line);
+                return result;
+            }
+            if (state != State::BLANK)
+            {
+                exp_pos += Scan::FindNonSpace(exp + exp_pos, exp_size - exp_pos);
+            }
+            // 末尾的空白和空行不影响结果，期望输出还有记号就是不一致
+            if (exp_pos < exp_size)
+            {
+                Fail(offset, line);
+            }
+            return result;
+        }
+
+        // 已经确定不一致，之后的输出不影响结果
+        bool Failed() const
+        {
+            return !result.ok;
+        }
+
+    private:
+        enum class State
+        {
+            BLANK,    // 在两个记号之间的空白里，期望输出的这段空白已经整个跳过
+            TOKEN,    // 在记号里，到目前为止和期望输出的记号逐字节相同
+            DIVERGED, // float模式下记号出现了不同，读完程序输出的记号之后按数字比较
+        };
+
+        // float模式下记号的前若干个字节，更长的记号不会是要按误差比较的数字
+        struct Token
+        {
+            char data[64];
+            size_t size = 0;
+            bool overflow = false;
+
+            void Append(const char *p, size_t n)
+            {
+                if (overflow || size + n >= sizeof(data))
+                {
+                    overflow = true;
+                    return;
+                }
+                memcpy(data + size, p, n);
+                size += n;
+            }
+        };
+
+        void Fail(int64_t at_offset, int64_t at_line)
+        {
+            result.ok = false;
+            result.offset = at_offset;
+            result.line = at_line;
+        }
+
+        void FeedExact(const char *data, size_t size)
+        {
+            if (!result.ok)
+            {
+                return;
+            }
+            size_t n = std::min(size, exp_size - exp_pos);
+            size_t i = Scan::Mismatch(data, exp + exp_pos, n);
+            if (i < size)
+            {
+                // 不一样，或者程序输出比期望输出长
+                Fail(offset + i, line + Scan::Count(data, i, '\n'));
+                return;
+            }
+            offset += size;
+            line += Scan::Count(data, size, '\n');
+            exp_pos += size;
+        }
+
+        // 程序输出进入一段空白(可以为空)：期望输出对应的空白整个跳过，记下换行数和最后一行的缩进
+        void EnterBlank()
+        {
+            state = State::BLANK;
+            blank_offset = offset;
+            blank_line = line;
+            out_newlines = 0;
+            indent_size = 0;
+            indent_same = true;
+            const char *p = exp + exp_pos;
+            size_t n = Scan::FindNonSpace(p, exp_size - exp_pos);
+            exp_newlines = Scan::Count(p, n, '\n');
+            const char *last = static_cast<const char *>(memrchr(p, '\n', n));
+            exp_indent = last != nullptr ? last + 1 : p;
+            exp_indent_size = p + n - exp_indent;
+            exp_pos += n;
+        }
+
+        void EnterToken()
+        {
+            state = State::TOKEN;
+            token_offset = offset;
+            out_token = Token();
+            exp_token = Token();
+        }
+
+        // line模式：程序输出当前这一行的缩进又多了一段，和期望输出的缩进比较
+        void AppendIndent(const char *p, size_t n)
+        {
+            if (indent_same && (indent_size + n > exp_indent_size || memcmp(exp_indent + indent_size, p, n) != 0))
+            {
+                indent_same = false;
+            }
+            indent_size += n;
+        }
+
+        // 返回值：处理了多少字节
+        size_t FeedBlank(const char *p, size_t n)
+        {
+            size_t k = Scan::FindNonSpace(p, n);
+            size_t newlines = Scan::Count(p, k, '\n');
+            out_newlines += newlines;
+            line += newlines;
+            if (mode == CheckMode::LINE)
+            {
+                const char *indent = p;
+                if (newlines > 0)
+                {
+                    indent = static_cast<const char *>(memrchr(p, '\n', k)) + 1;
+                    indent_size = 0;
+                    indent_same = true;
+                }
+                AppendIndent(indent, p + k - indent);
+            }
+            offset += k;
+            if (k == n)
+            {
+                return k; // 空白在下一块里继续
+            }
+            if (exp_pos == exp_size)
+            {
+                Fail(offset, line); // 程序输出的记号更多
+                return k;
+            }
+            if (mode == CheckMode::LINE &&
+                (out_newlines != exp_newlines || !indent_same || indent_size != exp_indent_size))
+            {
+                Fail(blank_offset, blank_line);
+                return k;
+            }
+            EnterToken();
+            return k;
+        }
+
+        // 大部分输出和期望完全相同：先逐字节比较，跳过相同的部分，只在不一样的地方按记号比较
+        // 相同部分的最后一段(记号或者空白)可能在不一样的地方或者下一块里继续，要退回到这一段的开头
+        size_t FeedToken(const char *p, size_t n)
+        {
+            size_t m = std::min(n, exp_size - exp_pos);
+            size_t same = Scan::Mismatch(p, exp + exp_pos, m);
+            if (same > 0)
+            {
+                bool space = Scan::IsSpace(p[same - 1]);
+                size_t start = same - 1;
+                while (start > 0 && Scan::IsSpace(p[start - 1]) == space)
+                {
+                    --start;
+                }
+                if (start > 0)
+                {
+                    // 当前记号在相同的部分里结束，之后的各段完全相同，两边都停在最后一段的开头
+                    line += Scan::Count(p, start, '\n');
+                    offset += start;
+                    exp_pos += start;
+                    if (space)
+                    {
+                        EnterBlank();
+                    }
+                    else
+                    {
+                        EnterToken();
+                    }
+                    return start;
+                }
+            }
+            bool numeric = mode == CheckMode::FLOAT;
+            size_t i = Scan::MismatchOrSpace(p, exp + exp_pos, m);
+            if (numeric)
+            {
+                out_token.Append(p, i);
+                exp_token.Append(exp + exp_pos, i);
+            }
+            offset += i;
+            exp_pos += i;
+            if (i == n)
+            {
+                return i; // 记号可能在下一块里继续
+            }
+            bool exp_space = exp_pos == exp_size || Scan::IsSpace(exp[exp_pos]);
+            if (Scan::IsSpace(p[i]) && exp_space)
+            {
+                EnterBlank(); // 两边的记号一起结束
+                return i;
+            }
+            if (!numeric)
+            {
+                Fail(token_offset, line);
+                return i;
+            }
+            state = State::DIVERGED;
+            ReadExpToken();
+            return i;
+        }
+
+        size_t FeedDiverged(const char *p, size_t n)
+        {
+            size_t k = Scan::FindSpace(p, n);
+            out_token.Append(p, k);
+            offset += k;
+            if (k == n)
+            {
+                return k;
+            }
+            if (!CloseNumbers(out_token, exp_token, epsilon))
+            {
+                Fail(token_offset, line);
+                return k;
+            }
+            EnterBlank();
+            return k;
+        }
+
+        // 期望输出的记号剩下的部分
+        void ReadExpToken()
+        {
+            size_t k = Scan::FindSpace(exp + exp_pos, exp_size - exp_pos);
+            exp_token.Append(exp + exp_pos, k);
+            exp_pos += k;
+        }
+
+        static bool ParseNumber(Token &token, double *value)
+        {
+            if (token.overflow || token.size == 0)
+            {
+                return false;
+            }
+            token.data[token.size] = '\0';
+            char *end = nullptr;
+            *value = strtod(token.data, &end);
+            return end == token.data + token.size && std::isfinite(*value);
+        }
+
+        // 绝对误差或相对误差不超过epsilon
+        static bool CloseNumbers(Token &out_token, Token &exp_token, double epsilon)
+        {
+            double actual, expected;
+            if (!ParseNumber(out_token, &actual) || !ParseNumber(exp_token, &expected))
+            {
+                return false;
+            }
+            return std::fabs(actual - expected) <= epsilon * std::max(1.0, std::fabs(expected));
+        }
+
+    private:
+        const char *exp;
+        size_t exp_size;
+        size_t exp_pos = 0; // 期望输出中已经处理到的位置
+        CheckMode mode;
+        double epsilon;
+        State state = State::TOKEN;
+        CheckResult result;
+        int64_t offset = 0; // 程序输出中已经处理的字节数
+        int64_t line = 1;   // 当前位置的行号
+
+        // 当前的空白
+        int64_t blank_offset = 0;
+        int64_t blank_line = 1;
+        int64_t out_newlines = 0;
+        int64_t exp_newlines = 0;
+        const char *exp_indent = nullptr; // line模式：期望输出这段空白最后一个换行之后的部分
+        size_t exp_indent_size = 0;
+        size_t indent_size = 0;  // 程序输出当前这一行的缩进的长度
+        bool indent_same = true; // 程序输出当前这一行的缩进到目前为止是不是期望的缩进的前缀
+
+        // 当前的记号
+        int64_t token_offset = 0;
+        Token out_token;
+        Token exp_token;
+    };
+
+    class Checker
+    {
+    public:
+        static const size_t chunk_size = 256 * 1024;
+
+        // 模式名称：exact、line、token、float
+        static bool ParseMode(const std::string &name, CheckMode *mode)
+        {
+            if (name == "exact") *mode = CheckMode::EXACT;
+            else if (name == "line") *mode = CheckMode::LINE;
+            else if (name == "token") *mode = CheckMode::TOKEN;
+            else if (name == "float") *mode = CheckMode::FLOAT;
+            else return false;
+            return true;
+        }
+
+        // out_fd: 程序的标准输出，从当前位置读到末尾，读取出错按末尾处理
+        // expected/size: 期望输出
+        static CheckResult Check(int out_fd, const char *expected, size_t size, CheckMode mode, double epsilon)
+        {
+            StreamChecker checker(expected, size, mode, epsilon);
+            std::unique_ptr<char[]> buffer(new char[chunk_size]);
+            while (!checker.Failed())
+            {
+                ssize_t n = read(out_fd, buffer.get(), chunk_size);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    break;
+                }
+                checker.Feed(buffer.get(), n);
+            }
+            return checker.Finish();
+        }
+    };
+}
@@ -2,11 +2,22 @@
 
 #include "../comm/util.hpp"
 #include "../comm/log.hpp"
+#include "launcher.hpp"
+#include "zygote.hpp"
+#include "reaper.hpp"
+#include "memfd.hpp"
+#include "conf.hpp"
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <regex>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 
 namespace ns_compiler
@@ -14,6 +25,19 @@ namespace ns_compiler
     // 引入对应的命名空间
     using namespace ns_util;
     using namespace ns_log;
+    using namespace ns_launcher;
+    using namespace ns_zygote;
+    using namespace ns_reaper;
+    using namespace ns_memfd;
+    using namespace ns_conf;
+
+    // 编译的结果
+    enum class CompileStatus
+    {
+        SUCCESS,        // 形成了可执行程序
+        FAILED,         // 编译失败，报错在compile_error文件中
+        LIMIT_EXCEEDED, // g++超过了CPU、内存、输出文件大小或墙上时间的限制
+    };
 
     class Compiler
     {
@@ -23,55 +47,300 @@ namespace ns_compiler
         ~Compiler()
         {}
 
-        // 返回值：编译成功(true)、编译失败(false)
+        // 编译选项，除了源文件和目标文件之外传给g++的全部参数
+        // 编译缓存用它参与计算key，改了选项旧的缓存自然失效
+        static const std::vector<std::string> &Flags()
+        {
+            static const std::vector<std::string> flags = {
+                "-D", "COMPILER_ONLINE", // 去掉测试用例的头部内容
+                "-std=c++11"             // 编译版本
+            };
+            return flags;
+        }
+
+        // 链接可执行程序时追加的参数(比如fork server的stub)，启动时设置
+        // 会改变生成的可执行程序，编译缓存同样用它计算key；只编译不链接的目标文件(harness)和预编译头不使用
+        static std::vector<std::string> &LinkFlags()
+        {
+            static std::vector<std::string> flags;
+            return flags;
+        }
+
+        // 源代码是否不落盘：开启后源代码通过内存文件作为g++的标准输入(-x c++ -)
+        static bool InMemory()
+        {
+            return Conf::Instance().GetBool("in_memory", false);
+        }
+
+        // 返回值：编译成功(SUCCESS)、编译失败(FAILED)、超过编译器的资源限制(LIMIT_EXCEEDED)
         // 输入参数：编译的文件名
         // file_name: 1234
-        // 1234 -> ./temp/1234.cpp 源文件
+        // 1234 -> ./temp/1234.cpp 源文件(InMemory时不存在)
         // 1234 -> ./temp/1234.exe 可执行文件
         // 1234 -> ./temp/1234.stderr 错误文件
-        static bool Compile(const std::string& file_name)
+        // code: 源代码，InMemory时通过标准输入交给g++
+        // extra_flags: 不影响编译结果的附加参数，比如预编译头的 -include
+        // usage: 不为nullptr时累加本次编译(包括链接)的CPU时间、墙上时间，峰值内存取最大值
+        static CompileStatus Compile(const std::string& file_name, const std::string& code,
+                                     const std::vector<std::string>& extra_flags = {}, ResourceUsage* usage = nullptr)
         {
-            pid_t pid = fork();
-            if(pid < 0)
+            int _stdin = -1;
+            std::vector<std::string> args = {"-o", PathUtil::Exe(file_name)}; // 目标文件
+            if(!AddSource(file_name, code, &args, &_stdin))                   // 源文件
             {
-                LOG(ERROR) << "内部错误，创建子进程失败" << "\n";
-                return false;
+                return CompileStatus::FAILED;
+            }
+            args.insert(args.end(), Flags().begin(), Flags().end());
+            args.insert(args.end(), extra_flags.begin(), extra_flags.end());
+            if(!LinkFlags().empty())
+            {
+                // InMemory时的 -x c++ 对之后所有的输入文件生效，链接的目标文件要恢复按后缀识别
+                args.insert(args.end(), {"-x", "none"});
+                args.insert(args.end(), LinkFlags().begin(), LinkFlags().end());
+            }
+            int ret = RunGxx(args, PathUtil::CompilerError(file_name), _stdin, usage);
+            if(_stdin >= 0) close(_stdin);
+            if(ret == limit_exceeded)
+            {
+                return CompileStatus::LIMIT_EXCEEDED;
+            }
+            if(ret < 0)
+            {
+                return CompileStatus::FAILED;
             }
-            else if(pid == 0)
-            {
-                umask(0);
-                int _stderr = open(PathUtil::CompilerError(file_name).c_str(), O_CREAT | O_WRONLY, 0644);
-                if(_stderr < 0)
-                {
-                    LOG(WARNING) << "没有成功形成compile_error文件" << "\n";
-                    exit(1);
-                }
-                // 重定向标准错误到_stderr
-                dup2(_stderr, 2);
-
-                // 子进程：调用编译器，完成对代码的编译工作
-                execlp("g++", "g++", "-o", 
-                    PathUtil::Exe(file_name).c_str(),PathUtil::Src(file_name).c_str(), // 目标文件 源文件
-                    "-D", "COMPILER_ONLINE", // 去掉测试用例的头部内容
-                    "-std=c++11", nullptr); // 编译版本
-                LOG(ERROR) << "启动编译器g++失败，可能是参数错误" << "\n";
-                exit(2);
-            }
-            else
-            {
-                // 父进程
-                waitpid(pid, nullptr, 0);
-                // 编译是否成功
-                // 判断一个文件是否存在
-                if(FileUtil::IsFileExists(PathUtil::Exe(file_name)))
-                {
-                    LOG(INFO) << PathUtil::Src(file_name) << " 编译成功!" << "\n";
-                    return true;
-                }
+            // 编译是否成功
+            // 判断一个文件是否存在
+            if(FileUtil::IsFileExists(PathUtil::Exe(file_name)))
+            {
+                LOG(INFO) << PathUtil::Src(file_name) << " 编译成功!" << "\n";
+                return CompileStatus::SUCCESS;
             }
             LOG(ERROR) << "编译失败，没有形成可执行程序" << "\n";
-            return false;
+            return CompileStatus::FAILED;
         }
 
+        // 分离编译模式：只编译用户代码这一个翻译单元，再和已经编译好的harness目标文件链接
+        // 1234 -> ./temp/1234.o 用户代码的目标文件
+        static CompileStatus CompileWithHarness(const std::string& file_name, const std::string& code, const std::string& harness_obj,
+                                                const std::vector<std::string>& extra_flags = {}, ResourceUsage* usage = nullptr)
+        {
+            int _stdin = -1;
+            std::string obj = PathUtil::Obj(file_name);
+            std::vector<std::string> args = {"-c", "-o", obj};
+            if(!AddSource(file_name, code, &args, &_stdin))
+            {
+                return CompileStatus::FAILED;
+            }
+            args.insert(args.end(), Flags().begin(), Flags().end());
+            args.insert(args.end(), extra_flags.begin(), extra_flags.end());
+            int ret = RunGxx(args, PathUtil::CompilerError(file_name), _stdin, usage);
+            if(_stdin >= 0) close(_stdin);
+            if(ret == limit_exceeded)
+            {
+                return CompileStatus::LIMIT_EXCEEDED;
+            }
+            if(ret != 0 || !FileUtil::IsFileExists(obj))
+            {
+                LOG(ERROR) << "编译失败，没有形成目标文件" << "\n";
+                return CompileStatus::FAILED;
+            }
+            std::vector<std::string> link_args = {"-o", PathUtil::Exe(file_name), obj, harness_obj};
+            link_args.insert(link_args.end(), LinkFlags().begin(), LinkFlags().end());
+            ret = RunGxx(link_args, PathUtil::CompilerError(file_name), -1, usage);
+            if(ret == limit_exceeded)
+            {
+                return CompileStatus::LIMIT_EXCEEDED;
+            }
+            if(ret < 0)
+            {
+                return CompileStatus::FAILED;
+            }
+            if(FileUtil::IsFileExists(PathUtil::Exe(file_name)))
+            {
+                LOG(INFO) << PathUtil::Src(file_name) << " 编译链接成功!" << "\n";
+                return CompileStatus::SUCCESS;
+            }
+            LOG(ERROR) << "链接失败，没有形成可执行程序" << "\n";
+            return CompileStatus::FAILED;
+        }
+
+        // 把源文件src编译成目标文件obj，用于只需要编译一次的harness和fork server的stub
+        // 源文件来自题目和编译服务自己，不是用户代码，不受compile_fsize_limit限制
+        static bool CompileObject(const std::string& src, const std::string& obj, const std::string& err_file)
+        {
+            std::vector<std::string> args = {"-c", "-o", obj, src};
+            args.insert(args.end(), Flags().begin(), Flags().end());
+            return RunGxx(args, err_file, -1, nullptr, 0) == 0 && FileUtil::IsFileExists(obj);
+        }
+
+        // 把头文件header预编译成gch，编译选项必须和Compile完全一致，否则g++会拒绝使用
+        // gch比普通的目标文件大得多(<bits/stdc++.h>约80MB)，写出文件的大小限制用pch_fsize_limit
+        static bool CompileHeader(const std::string& header, const std::string& gch, const std::string& err_file)
+        {
+            std::vector<std::string> args = {"-x", "c++-header", header, "-o", gch};
+            args.insert(args.end(), Flags().begin(), Flags().end());
+            int fsize_limit = Conf::Instance().GetInt("pch_fsize_limit", 256 * 1024);
+            return RunGxx(args, err_file, -1, nullptr, fsize_limit) == 0 && FileUtil::IsFileExists(gch);
+        }
+
+    private:
+        // 把源文件加入g++的参数：InMemory时源代码写入内存文件作为标准输入，否则使用 ./temp/ 下的源文件
+        static bool AddSource(const std::string& file_name, const std::string& code,
+                              std::vector<std::string>* args, int* stdin_fd)
+        {
+            if(!InMemory())
+            {
+                args->push_back(PathUtil::Src(file_name));
+                return true;
+            }
+            *stdin_fd = MemFd::Create("source", code);
+            if(*stdin_fd < 0)
+            {
+                return false;
+            }
+            // -pipe: 编译的各个阶段之间用管道传递，不在TMPDIR下生成中间文件
+            args->insert(args->end(), {"-pipe", "-x", "c++", "-"});
+            return true;
+        }
+
+        // RunGxx的返回值：g++超过了资源限制
+        static const int limit_exceeded = -2;
+
+        // 创建子进程执行g++，args是g++之后的全部参数，标准错误追加到err_file
+        // stdin_fd: 不为-1时作为g++的标准输入
+        // 优先交给zygote创建子进程，zygote不可用时自己通过Launcher创建，由reaper线程等待退出
+        // g++及其子进程(cc1plus、as、ld)各自受CPU时间、地址空间、写出文件大小的限制，整个编译受墙上时间限制，
+        // 防止模板元编程炸弹或者海量的报错拖垮整台编译机
+        // usage: 不为nullptr时累加g++的资源使用情况
+        // fsize_limit: 写出文件的大小限制(kb)，-1表示用compile_fsize_limit，0表示不限制
+        // 返回值：g++的退出码，内部错误返回-1，超过资源限制返回limit_exceeded
+        static int RunGxx(const std::vector<std::string>& args, const std::string& err_file, int stdin_fd = -1,
+                          ResourceUsage* usage = nullptr, int fsize_limit = -1)
+        {
+            // 编译和链接的报错都追加到同一个文件，超限时需要读回报错的末尾
+            int _stderr = open(err_file.c_str(), O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
+            if(_stderr < 0)
+            {
+                LOG(WARNING) << "没有成功形成compile_error文件" << "\n";
+                return -1;
+            }
+            Conf &conf = Conf::Instance();
+            SpawnRequest req;
+            req.argv.push_back("g++");
+            req.argv.insert(req.argv.end(), args.begin(), args.end());
+            req.stdin_fd = stdin_fd;
+            req.stderr_fd = _stderr; // 重定向标准错误到_stderr
+            req.cpu_limit = conf.GetInt("compile_cpu_limit", 10);
+            req.mem_limit = conf.GetInt("compile_mem_limit", 2 * 1024 * 1024);
+            req.fsize_limit = fsize_limit >= 0 ? fsize_limit : conf.GetInt("compile_fsize_limit", 32 * 1024);
+            req.wall_limit = conf.GetInt("compile_wall_limit", 30000);
+
+            ExitInfo info;
+            bool spawned = Reaper::Instance().SpawnAndWait(req, &info);
+            if(!spawned)
+            {
+                close(_stderr);
+                LOG(ERROR) << "启动编译器g++失败" << "\n";
+                return -1;
+            }
+            if(usage != nullptr)
+            {
+                usage->cpu_ms += info.usage.cpu_ms;
+                usage->wall_ms += info.usage.wall_ms;
+                usage->max_rss_kb = std::max(usage->max_rss_kb, info.usage.max_rss_kb);
+            }
+            bool exceeded = LimitExceeded(info, _stderr, req);
+            close(_stderr);
+            if(exceeded)
+            {
+                LOG(WARNING) << "编译器超过资源限制: " << err_file << "\n";
+                return limit_exceeded;
+            }
+            return ExitCode(info.status);
+        }
+
+        // 判断g++是不是因为资源限制而失败
+        // 首先看退出状态和资源使用：墙上时间超时、g++自己被杀掉、CPU时间用完、报错写满了文件
+        // cc1plus、as、ld被杀掉或者分配内存失败时，g++只是以1退出，这时只相信报错的最后一行是驱动程序(或者
+        // cc1plus的内存分配器)自己打印的、格式完全确定的信息。用户代码的报错每一行都带着"文件:行:列: "之类的
+        // 后缀，即使用#line改了文件名也凑不出完整的一行，#error memory exhausted之类不会被当成超限
+        static bool LimitExceeded(const ExitInfo& info, int err_fd, const SpawnRequest& req)
+        {
+            if(info.wall_timeout)
+            {
+                return true;
+            }
+            if(WIFSIGNALED(info.status))
+            {
+                int sig = WTERMSIG(info.status);
+                return sig == SIGKILL || sig == SIGXCPU || sig == SIGXFSZ;
+            }
+            if(WEXITSTATUS(info.status) == 0)
+            {
+                return false;
+            }
+            if(req.cpu_limit > 0 && info.usage.cpu_ms >= static_cast<int64_t>(req.cpu_limit) * 1000)
+            {
+                return true;
+            }
+            struct stat st;
+            if(fstat(err_fd, &st) < 0)
+            {
+                return false;
+            }
+            if(req.fsize_limit > 0 && st.st_size >= static_cast<off_t>(req.fsize_limit) * 1024)
+            {
+                return true;
+            }
+            char tail[4096];
+            off_t offset = std::max<off_t>(0, st.st_size - static_cast<off_t>(sizeof(tail)));
+            ssize_t n = pread(err_fd, tail, sizeof(tail), offset);
+            if(n <= 0)
+            {
+                return false;
+            }
+            std::vector<std::string> lines;
+            StringUtil::SplitString(std::string(tail, n), &lines, "\n");
+            while(!lines.empty() && lines.back().empty())
+            {
+                lines.pop_back();
+            }
+            if(lines.empty())
+            {
+                return false;
+            }
+            // 驱动程序的致命错误之后还有一行"compilation terminated."
+            if(lines.back() == "compilation terminated." && lines.size() >= 2)
+            {
+                const std::string& line = lines[lines.size() - 2];
+                static const std::regex killed(
+                    // cc1plus、as、collect2被信号杀掉
+                    "g\\+\\+: fatal error: (Killed|CPU time limit exceeded|File size limit exceeded) "
+                    "signal terminated program [A-Za-z0-9_+-]+"
+                    // collect2报告ld被信号杀掉
+                    "|collect2: fatal error: ld terminated with signal [0-9]+ "
+                    "\\[(Killed|CPU time limit exceeded|File size limit exceeded)\\]");
+                return std::regex_match(line, killed);
+            }
+            // 被SIGXCPU、SIGXFSZ杀掉时驱动程序(gcc 12)当作内部错误报告，后面是固定的两行提示
+            if(lines.size() >= 3 && lines[lines.size() - 2].compare(0, 33, "Please submit a full bug report, ") == 0)
+            {
+                static const std::regex hint("See <[^<>]*> for instructions\\.");
+                static const std::regex ice(
+                    "g\\+\\+: internal compiler error: (Killed|CPU time limit exceeded|File size limit exceeded) "
+                    "signal terminated program [A-Za-z0-9_+-]+");
+                return std::regex_match(lines.back(), hint) && std::regex_match(lines[lines.size() - 3], ice);
+            }
+            // cc1plus超过RLIMIT_AS，分配内存失败后直接退出
+            static const std::regex exhausted(
+                "virtual memory exhausted: Cannot allocate memory"
+                "|cc1plus: out of memory allocating [0-9]+ bytes after a total of [0-9]+ bytes");
+            return std::regex_match(lines.back(), exhausted);
+        }
+
+        static int ExitCode(int status)
+        {
+            return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
     };
 }
\ No newline at end of file
@@ -0,0 +1,343 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <unordered_map>
+#include <algorithm>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <jsoncpp/json/json.h>
+
+// 编译缓存：以 (最终源代码 + 编译选项 + 编译器版本) 的SHA-256为key
+// 编译成功缓存可执行程序，编译失败缓存compile_error报错信息
+// 文件存放在磁盘的缓存目录中，内存中维护LRU索引，总大小超过上限时淘汰最久未使用的
+namespace ns_compile_cache
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    const std::string cache_path = "./cache/";
+
+    enum class CacheResult
+    {
+        MISS,      // 未命中，需要真正编译
+        HIT_EXE,   // 命中，可执行程序已经放到了 ./temp/xxx.exe
+        HIT_ERROR, // 命中，之前编译失败过，报错已经放到了 ./temp/xxx.compile_error
+    };
+
+    class CompileCache
+    {
+    private:
+        struct Entry
+        {
+            std::string key;
+            bool success;        // true: 缓存的是可执行程序 false: 缓存的是编译报错
+            uint64_t size;       // 缓存文件的字节数
+            uint64_t compile_ms; // 这次编译花费的时间，命中时累加到节省的时间里
+        };
+
+    public:
+        static CompileCache &Instance()
+        {
+            static CompileCache cache;
+            return cache;
+        }
+
+        // dir: 缓存目录 max_bytes: 缓存文件总大小的上限
+        // 目录里已有的缓存文件会按修改时间重新建立索引，重启之后缓存依然有效
+        void Init(const std::string &dir, uint64_t max_bytes)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            cache_dir = dir;
+            if (cache_dir.empty() || cache_dir.back() != '/')
+            {
+                cache_dir += "/";
+            }
+            capacity = max_bytes;
+            compiler_version = CompilerVersion();
+            mkdir(cache_dir.c_str(), 0755);
+
+            std::vector<std::pair<time_t, Entry>> found;
+            DIR *d = opendir(cache_dir.c_str());
+            if (d == nullptr)
+            {
+                LOG(ERROR) << "打开编译缓存目录 " << cache_dir << " 失败，编译缓存不可用" << "\n";
+                return;
+            }
+            while (dirent *ent = readdir(d))
+            {
+                std::string name = ent->d_name;
+                Entry e;
+                if (EndsWith(name, ".exe"))
+                {
+                    e.key = name.substr(0, name.size() - 4);
+                    e.success = true;
+                }
+                else if (EndsWith(name, ".compile_error"))
+                {
+                    e.key = name.substr(0, name.size() - 14);
+                    e.success = false;
+                }
+                else
+                {
+                    // 写了一半的临时文件
+                    if (EndsWith(name, ".tmp"))
+                    {
+                        unlink((cache_dir + name).c_str());
+                    }
+                    continue;
+                }
+                struct stat st;
+                if (stat((cache_dir + name).c_str(), &st) != 0)
+                {
+                    continue;
+                }
+                e.size = st.st_size;
+                e.compile_ms = 0;
+                found.push_back({st.st_mtime, e});
+            }
+            closedir(d);
+
+            // 越新的越靠近LRU表头
+            std::sort(found.begin(), found.end(), [](const std::pair<time_t, Entry> &a, const std::pair<time_t, Entry> &b)
+                      { return a.first > b.first; });
+            for (auto &item : found)
+            {
+                if (index.count(item.second.key))
+                {
+                    continue;
+                }
+                lru.push_back(item.second);
+                index[item.second.key] = std::prev(lru.end());
+                used += item.second.size;
+            }
+            EvictLocked();
+            enabled = true;
+            LOG(INFO) << "编译缓存初始化成功，已有缓存 " << lru.size() << " 项, " << used << " 字节" << "\n";
+        }
+
+        bool Enabled() const
+        {
+            return enabled;
+        }
+
+        // 计算缓存的key，flags变化或者编译器升级，key都会变化
+        std::string Key(const std::string &code, const std::vector<std::string> &flags) const
+        {
+            std::string material = compiler_version;
+            material.push_back('\0');
+            for (const auto &flag : flags)
+            {
+                material += flag;
+                material.push_back('\0');
+            }
+            material += code;
+            return HashUtil::Sha256(material);
+        }
+
+        // 命中时把缓存的可执行程序/编译报错放到file_name对应的临时文件上
+        // 跨文件系统时LinkOrCopy是整个文件的拷贝，不在锁里做：锁里只固定住条目(淘汰时跳过)，拷贝完再回来更新索引
+        CacheResult Lookup(const std::string &key, const std::string &file_name)
+        {
+            std::string path;
+            bool success;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                auto iter = index.find(key);
+                if (iter == index.end())
+                {
+                    ++misses;
+                    return CacheResult::MISS;
+                }
+                success = iter->second->success;
+                path = EntryPath(key, success);
+                ++pinned[key];
+            }
+            std::string target = success ? PathUtil::Exe(file_name) : PathUtil::CompilerError(file_name);
+            bool copied = LinkOrCopy(path, target);
+
+            std::lock_guard<std::mutex> lock(mtx);
+            if (--pinned[key] == 0)
+            {
+                pinned.erase(key);
+            }
+            // 拷贝期间条目可能被并发的Store替换，重新查找；替换后的文件内容相同，拷贝出来的结果仍然有效
+            auto iter = index.find(key);
+            if (!copied)
+            {
+                unlink(target.c_str());
+                if (iter != index.end() && iter->second->success == success)
+                {
+                    // 缓存文件被外部删除了，索引作废
+                    LOG(WARNING) << "编译缓存文件丢失: " << path << "\n";
+                    used -= iter->second->size;
+                    lru.erase(iter->second);
+                    index.erase(iter);
+                }
+                ++misses;
+                return CacheResult::MISS;
+            }
+            if (iter != index.end())
+            {
+                lru.splice(lru.begin(), lru, iter->second);
+                saved_ms += iter->second->compile_ms;
+            }
+            ++hits;
+            // 固定期间跳过的淘汰现在补上
+            EvictLocked();
+            return success ? CacheResult::HIT_EXE : CacheResult::HIT_ERROR;
+        }
+
+        // 编译完成后调用，把 ./temp/ 下的结果放入缓存
+        void Store(const std::string &key, const std::string &file_name, bool success, uint64_t compile_ms)
+        {
+            std::string source = success ? PathUtil::Exe(file_name) : PathUtil::CompilerError(file_name);
+            struct stat st;
+            if (stat(source.c_str(), &st) != 0)
+            {
+                // 没有形成编译结果(比如内部错误)，不能缓存
+                return;
+            }
+            std::string final_path = EntryPath(key, success);
+            std::string tmp_path = cache_dir + file_name + ".tmp";
+            if (!LinkOrCopy(source, tmp_path) || rename(tmp_path.c_str(), final_path.c_str()) != 0)
+            {
+                unlink(tmp_path.c_str());
+                LOG(WARNING) << "写入编译缓存失败: " << final_path << "\n";
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mtx);
+            auto iter = index.find(key);
+            if (iter != index.end())
+            {
+                // 并发编译了同样的代码，rename已经覆盖了旧文件
+                used -= iter->second->size;
+                lru.erase(iter->second);
+                index.erase(iter);
+            }
+            lru.push_front(Entry{key, success, static_cast<uint64_t>(st.st_size), compile_ms});
+            index[key] = lru.begin();
+            used += st.st_size;
+            EvictLocked();
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["hits"] = Json::UInt64(hits);
+            stats["misses"] = Json::UInt64(misses);
+            stats["evictions"] = Json::UInt64(evictions);
+            stats["entries"] = Json::UInt64(lru.size());
+            stats["bytes"] = Json::UInt64(used);
+            stats["max_bytes"] = Json::UInt64(capacity);
+            stats["saved_compile_ms"] = Json::UInt64(saved_ms);
+            return stats;
+        }
+
+    private:
+        CompileCache() = default;
+        CompileCache(const CompileCache &) = delete;
+        CompileCache &operator=(const CompileCache &) = delete;
+
+        std::string EntryPath(const std::string &key, bool success) const
+        {
+            return cache_dir + key + (success ? ".exe" : ".compile_error");
+        }
+
+        // 调用者必须持有mtx；Lookup正在拷贝的条目跳过，从表尾往前找下一个
+        void EvictLocked()
+        {
+            auto iter = lru.end();
+            while (used > capacity && iter != lru.begin())
+            {
+                --iter;
+                if (pinned.count(iter->key))
+                {
+                    continue;
+                }
+                unlink(EntryPath(iter->key, iter->success).c_str());
+                used -= iter->size;
+                index.erase(iter->key);
+                iter = lru.erase(iter);
+                ++evictions;
+            }
+        }
+
+        static bool EndsWith(const std::string &str, const std::string &suffix)
+        {
+            return str.size() > suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+        }
+
+        // 同一个文件系统下用硬链接，零拷贝；跨文件系统时退化为拷贝
+        static bool LinkOrCopy(const std::string &from, const std::string &to)
+        {
+            if (link(from.c_str(), to.c_str()) == 0)
+            {
+                return true;
+            }
+            std::ifstream in(from, std::ios::binary);
+            if (!in)
+            {
+                return false;
+            }
+            std::ofstream out(to, std::ios::binary | std::ios::trunc);
+            if (!out)
+            {
+                return false;
+            }
+            out << in.rdbuf();
+            out.close();
+            struct stat st;
+            if (stat(from.c_str(), &st) == 0)
+            {
+                chmod(to.c_str(), st.st_mode & 0777);
+            }
+            return static_cast<bool>(out);
+        }
+
+        static std::string CompilerVersion()
+        {
+            std::string version;
+            FILE *fp = popen("g++ -dumpfullversion -dumpversion 2>/dev/null", "r");
+            if (fp == nullptr)
+            {
+                return version;
+            }
+            char buffer[128];
+            while (fgets(buffer, sizeof(buffer), fp) != nullptr)
+            {
+                version += buffer;
+            }
+            pclose(fp);
+            return version;
+        }
+
+    private:
+        std::mutex mtx;
+        bool enabled = false;
+        std::string cache_dir = cache_path;
+        std::string compiler_version;
+        std::list<Entry> lru; // 表头是最近使用的
+        std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        std::unordered_map<std::string, int> pinned; // Lookup正在拷贝的key和并发拷贝的个数，不淘汰
+        uint64_t capacity = 0;
+        uint64_t used = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t saved_ms = 0;
+    };
+}
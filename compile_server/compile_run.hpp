@@ -2,10 +2,22 @@
 
 #include "compile.hpp"
 #include "runner.hpp"
+#include "compile_cache.hpp"
+#include "pch.hpp"
+#include "harness.hpp"
+#include "forkserver.hpp"
+#include "checker.hpp"
+#include "testdata.hpp"
+#include "conf.hpp"
 #include "../comm/util.hpp"
 #include "../comm/log.hpp"
 #include <jsoncpp/json/json.h>
 #include <signal.h>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace ns_compile_and_run
 {
@@ -13,6 +25,58 @@ namespace ns_compile_and_run
     using namespace ns_util;
     using namespace ns_compiler;
     using namespace ns_runner;
+    using namespace ns_compile_cache;
+    using namespace ns_pch;
+    using namespace ns_harness;
+    using namespace ns_forkserver;
+    using namespace ns_checker;
+    using namespace ns_testdata;
+    using namespace ns_conf;
+
+    // 判题进度的回调：event是事件名称，data是事件的内容，可能在编译、运行和reaper线程中调用(见progress.hpp)
+    // state: {"state": "compiling"} 开始编译，{"state": "running", "total": 用例数, "compile": 编译的资源使用} 开始运行
+    // test: {"index": 用例编号(从1开始), "status", "reason", "usage", "mismatch"} 一个用例结束或者被取消
+    using JudgeProgress = std::function<void(const std::string &event, const Json::Value &data)>;
+
+    // 一个测试用例的结果：输入和期望输出在Job::test_data里，标准输出边运行边和期望输出比较(见checker.hpp)，不保存
+    struct TestCase
+    {
+        int status_code = 0; // 同Job::status_code，输出和期望不一致时为-8，被取消时为-9
+        CheckResult check;   // 输出检查的结果，程序正常结束时才有
+        ResourceUsage usage;
+    };
+
+    // 一次判题任务，在编译、运行各个阶段之间传递
+    struct Job
+    {
+        Json::Value in_value;
+        std::string code;
+        std::string input;
+        int cpu_limit = 0;
+        int mem_limit = 0;
+        int wall_limit = 0;      // 运行的墙上时间限制(ms)
+        std::string file_name;   // 临时文件的唯一名称
+        std::string harness_obj; // 分离编译时harness的目标文件
+        int status_code = 0;
+        std::string stdout_content;
+        std::string stderr_content;
+        ResourceUsage compile_usage; // g++(包括链接)的资源使用情况
+        bool compile_cached = false; // 命中编译缓存时没有调用g++
+        bool ran = false;            // 是否进入了运行阶段
+        ResourceUsage run_usage;     // 用户程序的资源使用情况，多个测试用例时取各项的最大值
+        std::vector<TestCase> tests; // 为空时只运行一次，结果就是程序的输出
+        std::shared_ptr<const TestData> test_data; // 测试用例的输入和期望输出，和tests一一对应
+        std::shared_ptr<ForkServer> fork_server; // 测试用例足够多时，所有用例从它fork
+        std::once_flag fork_server_once;         // 第一个开始运行的用例负责启动fork server
+        bool fail_fast = false;                  // 第一个没通过的用例出现后取消剩下的用例
+        std::shared_ptr<CancelGroup> cancel;     // fail_fast时所有用例加入这个取消组
+        size_t output_limit = 0;                 // 运行时标准输出和标准错误合计的上限(字节)
+        CheckMode check_mode = CheckMode::LINE;  // 测试用例输出的比较方式
+        double check_epsilon = 1e-6;             // float模式允许的误差
+        JudgeProgress progress;                  // 可选，流式接口推送判题进度
+        std::function<void(std::function<void()>)> post; // 可选，运行结束后的收尾交给谁执行(见RunOptions::post)
+    };
+
     class CompileAndRun
     {
     public:
@@ -37,6 +101,30 @@ namespace ns_compile_and_run
             case -3:
                 FileUtil::ReadFile(PathUtil::CompilerError(file_name), &desc, true);
                 break;
+            case -4:
+                desc = "编译服务繁忙，请稍后再试";
+                break;
+            case -5:
+                desc = "编译超出资源限制(CPU时间、内存、输出大小或编译时间)";
+                break;
+            case -6:
+                desc = "运行超过墙上时间限制";
+                break;
+            case -7:
+                desc = "内存超过限制";
+                break;
+            case -8:
+                desc = "答案错误";
+                break;
+            case -9:
+                desc = "已取消，其他测试用例没有通过";
+                break;
+            case -10:
+                desc = "输出超过限制";
+                break;
+            case -11:
+                desc = "编译服务上没有这份测试数据，请附带tests重新提交";
+                break;
             case SIGABRT: // 6
                 desc = "内存超过范围";
                 break;
@@ -53,25 +141,68 @@ namespace ns_compile_and_run
             return desc;
         }
 
+        // 临时文件可能不存在，直接unlink即可，不需要先stat
         static void RemoveTempFile(const std::string& file_name)
         {
-            std::string _src = PathUtil::Src(file_name);
-            if(FileUtil::IsFileExists(_src)) unlink(_src.c_str());
-
-            std::string _compiler_error = PathUtil::CompilerError(file_name);
-            if(FileUtil::IsFileExists(_compiler_error)) unlink(_compiler_error.c_str());
-
-            std::string _execute = PathUtil::Exe(file_name);
-            if(FileUtil::IsFileExists(_execute)) unlink(_execute.c_str());
+            unlink(PathUtil::Src(file_name).c_str());
+            unlink(PathUtil::CompilerError(file_name).c_str());
+            unlink(PathUtil::Exe(file_name).c_str());
+            unlink(PathUtil::Obj(file_name).c_str());
+            if (Compiler::InMemory())
+            {
+                // 标准输入是内存文件，不会形成临时文件
+                return;
+            }
+            // 标准输出和标准错误通过管道收集，测试用例的标准输入来自测试数据仓库，只有自定义输入的文件
+            unlink(PathUtil::Stdin(file_name).c_str());
+        }
 
-            std::string _stdin = PathUtil::Stdin(file_name);
-            if(FileUtil::IsFileExists(_stdin)) unlink(_stdin.c_str());
+        // 编译一次：有harness时只编译用户代码再链接harness，否则编译整份代码
+        static CompileStatus CompileOnce(const std::string &code, const std::string &file_name, const std::string &harness_obj,
+                                         ResourceUsage *usage)
+        {
+            PchLease pch = PchManager::Instance().Prepare(code);
+            if (harness_obj.empty())
+            {
+                return Compiler::Compile(file_name, code, pch.flags, usage);
+            }
+            return Compiler::CompileWithHarness(file_name, code, harness_obj, pch.flags, usage);
+        }
 
-            std::string _stdout = PathUtil::Stdout(file_name);
-            if(FileUtil::IsFileExists(_stdout)) unlink(_stdout.c_str());
-            
-            std::string _stderr = PathUtil::Stderr(file_name);
-            if(FileUtil::IsFileExists(_stderr)) unlink(_stderr.c_str());
+        // 先按内容查编译缓存，命中就直接复用之前的可执行程序/编译报错，未命中才真正调用g++
+        // 真正编译时尽量使用预编译头
+        // harness_obj: 分离编译的harness目标文件，路径中包含了题号和版本，参与计算缓存的key
+        // 返回值同Compiler::Compile，超过资源限制的结果不进入缓存(可能只是这台机器当时太忙)
+        // usage: 真正编译时g++的资源使用情况，hit: 是否命中了编译缓存
+        static CompileStatus CachedCompile(const std::string &code, const std::string &file_name, const std::string &harness_obj,
+                                           ResourceUsage *usage, bool *hit)
+        {
+            CompileCache &cache = CompileCache::Instance();
+            if (!cache.Enabled())
+            {
+                return CompileOnce(code, file_name, harness_obj, usage);
+            }
+            std::vector<std::string> flags = Compiler::Flags();
+            if (!harness_obj.empty())
+            {
+                flags.push_back(harness_obj);
+            }
+            flags.insert(flags.end(), Compiler::LinkFlags().begin(), Compiler::LinkFlags().end());
+            std::string key = cache.Key(code, flags);
+            CacheResult result = cache.Lookup(key, file_name);
+            if (result != CacheResult::MISS)
+            {
+                LOG(INFO) << PathUtil::Src(file_name) << " 命中编译缓存 " << key << "\n";
+                *hit = true;
+                return result == CacheResult::HIT_EXE ? CompileStatus::SUCCESS : CompileStatus::FAILED;
+            }
+            int64_t begin = TimeUtil::GetMonotonicMs();
+            CompileStatus status = CompileOnce(code, file_name, harness_obj, usage);
+            if (status != CompileStatus::LIMIT_EXCEEDED)
+            {
+                cache.Store(key, file_name, status == CompileStatus::SUCCESS, TimeUtil::GetMonotonicMs() - begin);
+            }
+            return status;
         }
 
         /***
@@ -80,6 +211,19 @@ namespace ns_compile_and_run
          * input: 用户给自己提交的代码对应的输入 不做处理
          * cpu_limit: 代码的CPU时间限制
          * mem_limit: 代码的内存限制
+         * wall_limit: 可选，运行的墙上时间限制(ms)，默认是cpu_limit的run_wall_factor倍
+         * output_limit: 可选，运行时标准输出和标准错误合计的上限(kb)，默认是run_output_limit_kb，超过时状态码为-10
+         * harness: 可选，分离编译的测试用例 {"id": 题号, "version": 版本, "source": harness源代码}
+         *          有harness时code只包含用户代码(和适配代码)，harness单独编译一次后链接
+         * tests: 可选，数据驱动的测试用例 [{"input": 标准输入, "output": 期望输出}, ...]
+         *        每个用例单独运行一次程序，有自己的时间、内存判定，多个用例并行运行
+         * test_data: 可选，测试数据的题号和版本 {"id": 题号, "version": 所有输入输出的摘要}(见testdata.hpp)
+         *            有tests时保存到测试数据仓库，之后同一版本的请求可以不带tests；
+         *            不带tests而编译服务上没有这个版本时状态码为-11，调用方附带tests重新提交
+         * fail_fast: 可选，默认false，为true时第一个没通过的用例出现后，还没运行的用例不再运行，
+         *            正在运行的用例被杀掉，这些用例的状态码为-9；提交判题时使用，运行自定义输入时不需要
+         * checker: 可选，测试用例输出的比较方式 {"mode": exact|line|token|float, "epsilon": float模式的误差}
+         *          默认line：忽略每行末尾的空白和末尾的空行
          *
          * 输出：
          * 必填
@@ -88,77 +232,458 @@ namespace ns_compile_and_run
          * 选填
          * stdout：我的程序运行完的结果
          * stderr：我的程序运行完的错误结果
+         * usage：{"compile": {cpu_ms, wall_ms, max_rss_kb, cached}, "run": {cpu_ms, wall_ms, max_rss_kb, instructions}}
+         *        instructions只在按指令数限制运行时间(instruction_limit)时有
+         *        本机和参考机器的速度不同时，run里还有normalized_cpu_ms，usage里有speed_factor(见speed.hpp)
+         *        没有进入运行阶段时没有run
+         * tests：[{status, reason, usage}, ...] 每个测试用例的结果，status是第一个没通过的用例的状态码
+         * passed/total：通过的测试用例个数和总数
+         * failed_case：第一个没通过的用例的编号(从1开始)，全部通过时没有
+         * tests[i].mismatch：答案错误时第一个不一致的位置 {"offset": 字节偏移, "line": 行号}
          *
+         * 判题分为三步：Parse -> CompileStage -> RunStage -> Finish
+         * Start在当前线程依次执行；流水线模式下编译和运行由各自的线程池执行(见pipeline.hpp)
+         * progress: 可选，判题过程中的进度事件(见JudgeProgress)，最终结果仍然在out_json里
          */
-        static void Start(const std::string &in_json, std::string *out_json)
+        static void Start(const std::string &in_json, std::string *out_json, const JudgeProgress &progress = nullptr)
         {
-            Json::Value in_value;
-            Json::Reader reader;
-            reader.parse(in_json, in_value);
+            Job job;
+            Parse(in_json, &job);
+            job.progress = progress;
+            if (CompileStage(job))
+            {
+                RunStage(job);
+            }
+            Finish(job, out_json);
+        }
 
-            std::string code = in_value["code"].asString();
-            std::string input = in_value["input"].asString();
-            int cpu_limit = in_value["cpu_limit"].asInt();
-            int mem_limit = in_value["mem_limit"].asInt();
+        static void Parse(const std::string &in_json, Job *job)
+        {
+            Json::Reader reader;
+            reader.parse(in_json, job->in_value);
 
-            Json::Value out_value;
-            int status_code = 0;
-            int run_result = 0;
+            job->code = job->in_value["code"].asString();
+            job->input = job->in_value["input"].asString();
+            job->cpu_limit = job->in_value["cpu_limit"].asInt();
+            job->mem_limit = job->in_value["mem_limit"].asInt();
+            job->wall_limit = job->in_value.get("wall_limit", 0).asInt();
+            ParseTests(job);
+            const Json::Value &checker = job->in_value["checker"];
+            if (checker.isObject())
+            {
+                std::string mode = checker.get("mode", "line").asString();
+                if (!Checker::ParseMode(mode, &job->check_mode))
+                {
+                    LOG(WARNING) << "未知的输出比较方式: " << mode << "，按line比较" << "\n";
+                }
+                job->check_epsilon = checker.get("epsilon", job->check_epsilon).asDouble();
+            }
+            job->fail_fast = job->in_value.get("fail_fast", false).asBool();
+            if (job->fail_fast && !job->tests.empty())
+            {
+                job->cancel = std::make_shared<CancelGroup>();
+            }
+            int output_limit_kb = job->in_value.get("output_limit", 0).asInt();
+            if (output_limit_kb <= 0)
+            {
+                output_limit_kb = Conf::Instance().GetInt("run_output_limit_kb", 64 * 1024);
+            }
+            job->output_limit = static_cast<size_t>(output_limit_kb) * 1024;
+            if (job->wall_limit <= 0)
+            {
+                // 留出进程创建、页面换入的余量，最少1秒
+                int factor = Conf::Instance().GetInt("run_wall_factor", 2);
+                job->wall_limit = std::max(1000, job->cpu_limit * 1000 * factor);
+            }
 
             // 毫秒级时间戳+原子性递增唯一值
-            std::string file_name = FileUtil::UniqFileName(); // 获取具有唯一性的名称
+            job->file_name = FileUtil::UniqFileName(); // 获取具有唯一性的名称
+        }
+
+        // 编译阶段，返回值：是否需要进入运行阶段
+        static bool CompileStage(Job &job)
+        {
+            if (job.status_code != 0)
+            {
+                return false; // Parse时已经出错(比如缺少测试数据)
+            }
+            if (job.code.size() == 0)
+            {
+                job.status_code = -1; // 代码为空
+                return false;
+            }
+            Json::Value state;
+            state["state"] = "compiling";
+            Report(job, "state", state);
 
-            if (code.size() == 0)
+            // 形成临时src文件，InMemory时源代码直接通过标准输入交给g++
+            if (!Compiler::InMemory() && !FileUtil::WriteFile(PathUtil::Src(job.file_name), job.code))
             {
-                status_code = -1; // 代码为空
-                goto END;
+                job.status_code = -2; // 未知错误
+                return false;
             }
 
-            if (!FileUtil::WriteFile(PathUtil::Src(file_name), code)) // 形成临时src文件
+            if (job.in_value.isMember("harness"))
             {
-                status_code = -2; // 未知错误
-                goto END;
+                const Json::Value &harness = job.in_value["harness"];
+                job.harness_obj = HarnessCache::Instance().Get(harness["id"].asString(), harness["version"].asString(),
+                                                               harness["source"].asString());
+                if (job.harness_obj.empty())
+                {
+                    job.status_code = -2; // 未知错误，harness是题目的问题，不是用户的
+                    return false;
+                }
             }
 
-            if (!Compiler::Compile(file_name))
+            CompileStatus compile_status = CachedCompile(job.code, job.file_name, job.harness_obj,
+                                                         &job.compile_usage, &job.compile_cached);
+            if (compile_status == CompileStatus::LIMIT_EXCEEDED)
             {
-                status_code = -3; // 编译失败
-                goto END;
+                job.status_code = -5; // 编译超出资源限制
+                return false;
             }
+            if (compile_status != CompileStatus::SUCCESS)
+            {
+                job.status_code = -3; // 编译失败
+                return false;
+            }
+            state["state"] = "running";
+            state["total"] = Json::UInt64(job.tests.size());
+            state["compile"] = UsageToJson(job.compile_usage);
+            state["compile"]["cached"] = job.compile_cached;
+            Report(job, "state", state);
+            return true;
+        }
 
-            run_result = Runner::Run(file_name, cpu_limit, mem_limit);
-            if (run_result < 0)
+        // 运行阶段
+        static void RunStage(Job &job)
+        {
+            if (job.tests.empty())
+            {
+                job.ran = true;
+                RunOptions options;
+                options.output_limit = job.output_limit;
+                int run_result = Runner::Run(job.file_name, job.cpu_limit, job.mem_limit, job.wall_limit,
+                                             &job.stdout_content, &job.stderr_content, &job.run_usage, options);
+                job.status_code = RunResultToStatus(run_result);
+                return;
+            }
+            // 测试用例之间互不依赖，最多同时运行CPU核数个
+            size_t parallel = std::max(1u, std::thread::hardware_concurrency());
+            std::mutex mtx;
+            std::condition_variable cv;
+            size_t running = 0;
+            for (size_t i = 0; i < job.tests.size(); ++i)
+            {
+                if (SkipCase(job, i))
+                {
+                    continue;
+                }
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [&]()
+                            { return running < parallel; });
+                    ++running;
+                }
+                RunCaseAsync(job, i, [&]()
+                             {
+                                 std::lock_guard<std::mutex> lock(mtx);
+                                 --running;
+                                 cv.notify_all();
+                             });
+            }
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&]()
+                    { return running == 0; });
+        }
+
+        // 异步的运行阶段：创建子进程后立即返回，程序结束后调用done，job要保证在此之前一直有效
+        static void RunStageAsync(Job &job, std::function<void()> done)
+        {
+            job.ran = true;
+            RunOptions options;
+            options.output_limit = job.output_limit;
+            options.post = job.post;
+            Runner::RunAsync(job.file_name, job.file_name, "", job.cpu_limit, job.mem_limit, job.wall_limit,
+                             &job.stdout_content, &job.stderr_content, &job.run_usage, [&job, done](int run_result)
+                             {
+                                 job.status_code = RunResultToStatus(run_result);
+                                 done();
+                             },
+                             options);
+        }
+
+        // fail_fast的任务已经有用例没通过时，第index个用例不再运行，标记为已取消
+        // 返回值：true表示跳过了这个用例
+        static bool SkipCase(Job &job, size_t index)
+        {
+            if (!job.cancel || !job.cancel->Cancelled())
             {
-                status_code = -2; // 未知错误
+                return false;
             }
-            else if (run_result == 0)
+            job.tests[index].status_code = -9; // 已取消
+            ReportCase(job, index);
+            return true;
+        }
+
+        // 异步运行第index个测试用例，结束后调用done，各个用例只写自己的TestCase，可以同时运行
+        // 所有用例的结果在Finish中汇总
+        static void RunCaseAsync(Job &job, size_t index, std::function<void()> done)
+        {
+            job.ran = true;
+            if (SkipCase(job, index))
             {
-                // 运行成功
-                status_code = 0;
+                done();
+                return;
             }
-            else
+            std::call_once(job.fork_server_once, [&job]()
+                           { StartForkServer(job); });
+            TestCase &test = job.tests[index];
+            const SealedFile &expected = job.test_data->Expected(index);
+            RunOptions options;
+            options.server = job.fork_server ? job.fork_server->Client() : nullptr;
+            options.cancel = job.cancel;
+            options.output_limit = job.output_limit;
+            options.post = job.post;
+            options.stdin_fd = job.test_data->InputFd(index);
+            // 标准输出边运行边检查，不保存；程序正常结束时再看检查的结果
+            auto checker = std::make_shared<StreamChecker>(expected.Data(), expected.Size(), job.check_mode,
+                                                           job.check_epsilon);
+            options.stdout_sink = [checker](const char *data, size_t size)
+            {
+                checker->Feed(data, size);
+            };
+            Runner::RunAsync(job.file_name, job.file_name, "", job.cpu_limit, job.mem_limit,
+                             job.wall_limit, nullptr, nullptr, &test.usage,
+                             [&job, &test, index, done, checker](int run_result)
+                             {
+                                 test.status_code = RunResultToStatus(run_result);
+                                 if (test.status_code == 0)
+                                 {
+                                     test.check = checker->Finish();
+                                 }
+                                 if (test.status_code == 0 && !test.check.ok)
+                                 {
+                                     test.status_code = -8; // 答案错误
+                                 }
+                                 if (job.cancel && test.status_code != 0 && test.status_code != -9)
+                                 {
+                                     // 结果已经确定，杀掉正在运行的用例，还没开始的用例也不再运行
+                                     job.cancel->Cancel();
+                                 }
+                                 ReportCase(job, index);
+                                 done();
+                             },
+                             options);
+        }
+
+        // 形成应答并清理临时文件
+        static void Finish(Job &job, std::string *out_json)
+        {
+            Json::Value out_value;
+            if (job.ran && !job.tests.empty())
             {
-                status_code = run_result; // 运行出错
+                SummarizeCases(job, &out_value);
             }
-        END:
-            out_value["status"] = status_code;
-            out_value["reason"] = CodeToDesc(status_code, file_name);
-            if (status_code == 0)
+            out_value["status"] = job.status_code;
+            out_value["reason"] = CodeToDesc(job.status_code, job.file_name);
+            if (job.status_code == 0)
             {
                 // 整个过程全部成功
-                std::string _stdout;
-                std::string _stderr;
-                FileUtil::ReadFile(PathUtil::Stdout(file_name), &_stdout, true);
-                FileUtil::ReadFile(PathUtil::Stderr(file_name), &_stderr, true);
-                out_value["stdout"] = _stdout;
-                out_value["stderr"] = _stderr;
+                out_value["stdout"] = job.stdout_content;
+                out_value["stderr"] = job.stderr_content;
+            }
+            // 资源使用情况，方便按题目调整cpu_limit/mem_limit、发现慢的主机
+            Json::Value &compile_usage = out_value["usage"]["compile"];
+            compile_usage = UsageToJson(job.compile_usage);
+            compile_usage["cached"] = job.compile_cached;
+            if (job.ran)
+            {
+                out_value["usage"]["run"] = UsageToJson(job.run_usage);
+                // 本机的速度系数，cpu_ms是本机的时间，normalized_cpu_ms是折算到参考机器上的时间
+                SpeedCalibration &speed = SpeedCalibration::Instance();
+                if (speed.Scaling())
+                {
+                    out_value["usage"]["run"]["normalized_cpu_ms"] = Json::Int64(speed.Normalize(job.run_usage.cpu_ms));
+                    out_value["usage"]["speed_factor"] = speed.Factor();
+                }
             }
             // 序列化过程
             Json::StyledWriter writer;
             *out_json = writer.write(out_value);
 
+            // 所有用例都已经结束，关闭fork server
+            job.fork_server.reset();
             // 清理所有的临时文件
-            RemoveTempFile(file_name);
+            RemoveTempFile(job.file_name);
+        }
+
+    private:
+        static void Report(const Job &job, const std::string &event, const Json::Value &data)
+        {
+            if (job.progress)
+            {
+                job.progress(event, data);
+            }
+        }
+
+        // 第index个用例结束时推送它的结果，各个用例只读自己的TestCase
+        static void ReportCase(const Job &job, size_t index)
+        {
+            if (job.progress)
+            {
+                Json::Value value = CaseToJson(job, index);
+                value["index"] = Json::UInt64(index + 1);
+                job.progress("test", value);
+            }
+        }
+
+        // 一个测试用例的结果，被取消的用例没有资源使用情况
+        static Json::Value CaseToJson(const Job &job, size_t index)
+        {
+            const TestCase &test = job.tests[index];
+            Json::Value value;
+            value["status"] = test.status_code;
+            value["reason"] = CodeToDesc(test.status_code, job.file_name);
+            if (test.status_code == -9)
+            {
+                return value;
+            }
+            value["usage"] = UsageToJson(test.usage);
+            if (test.status_code == -8)
+            {
+                value["mismatch"]["offset"] = Json::Int64(test.check.offset);
+                value["mismatch"]["line"] = Json::Int64(test.check.line);
+            }
+            return value;
+        }
+
+        static Json::Value UsageToJson(const ResourceUsage &usage)
+        {
+            Json::Value value;
+            value["cpu_ms"] = Json::Int64(usage.cpu_ms);
+            value["wall_ms"] = Json::Int64(usage.wall_ms);
+            value["max_rss_kb"] = Json::Int64(usage.max_rss_kb);
+            if (usage.instructions > 0)
+            {
+                value["instructions"] = Json::Int64(usage.instructions);
+            }
+            return value;
+        }
+
+        // 测试用例来自请求里的tests，或者测试数据仓库(test_data)
+        static void ParseTests(Job *job)
+        {
+            const Json::Value &tests = job->in_value["tests"];
+            const Json::Value &ref = job->in_value["test_data"];
+            bool has_tests = tests.isArray() && !tests.empty();
+            if (ref.isObject())
+            {
+                std::string id = ref["id"].asString();
+                std::string version = ref["version"].asString();
+                TestDataStore &store = TestDataStore::Instance();
+                job->test_data = has_tests ? store.Put(id, version, tests) : store.Get(id, version);
+                if (!job->test_data)
+                {
+                    job->status_code = has_tests ? -2 : -11; // 测试数据不合法 / 编译服务上没有这个版本
+                    return;
+                }
+            }
+            else if (has_tests)
+            {
+                // 没有题号和版本的测试数据只用这一次，不保存
+                job->test_data = TestData::Create(tests);
+                if (!job->test_data)
+                {
+                    job->status_code = -2;
+                    return;
+                }
+            }
+            if (job->test_data)
+            {
+                job->tests.resize(job->test_data->Size());
+                // 测试数据已经在内存文件里，释放请求里的副本
+                job->in_value.removeMember("tests");
+            }
+        }
+
+        // 测试用例足够多时启动fork server，启动失败就逐个exec
+        static void StartForkServer(Job &job)
+        {
+            if (!ForkServerStub::Instance().Use(job.tests.size()))
+            {
+                return;
+            }
+            auto server = std::make_shared<ForkServer>();
+            // 所有用例在最坏情况下依次运行，fork server自己的墙上时间按此兜底
+            int server_wall = job.wall_limit * static_cast<int>(job.tests.size() + 1);
+            if (server->Start(job.file_name, job.cpu_limit, job.mem_limit, job.wall_limit, server_wall, job.output_limit))
+            {
+                job.fork_server = server;
+            }
+        }
+
+        // Runner的返回值转换成状态码
+        static int RunResultToStatus(int run_result)
+        {
+            if (run_result == Runner::wall_time_exceeded)
+            {
+                return -6; // 超过墙上时间
+            }
+            if (run_result == Runner::memory_limit_exceeded)
+            {
+                return -7; // 超过内存限制
+            }
+            if (run_result == Runner::cancelled)
+            {
+                return -9; // 已取消
+            }
+            if (run_result == Runner::output_limit_exceeded)
+            {
+                return -10; // 输出超过限制
+            }
+            if (run_result < 0)
+            {
+                return -2; // 未知错误
+            }
+            // 0表示运行成功，大于0表示运行出错
+            return run_result;
+        }
+
+        // 汇总所有测试用例：状态码取第一个没通过的用例，资源使用取各项的最大值
+        // 被取消的用例既不算通过也不算没通过，也不计入资源使用
+        // 测试数据不返回给用户，每个用例只有状态和资源使用情况
+        static void SummarizeCases(Job &job, Json::Value *out_value)
+        {
+            job.status_code = 0;
+            job.run_usage = ResourceUsage();
+            int passed = 0;
+            Json::Value &tests = (*out_value)["tests"];
+            tests = Json::Value(Json::arrayValue);
+            for (size_t i = 0; i < job.tests.size(); ++i)
+            {
+                const TestCase &test = job.tests[i];
+                tests.append(CaseToJson(job, i));
+                if (test.status_code == -9)
+                {
+                    continue;
+                }
+                if (test.status_code == 0)
+                {
+                    ++passed;
+                }
+                else if (job.status_code == 0)
+                {
+                    job.status_code = test.status_code;
+                    (*out_value)["failed_case"] = Json::UInt64(i + 1);
+                }
+                job.run_usage.cpu_ms = std::max(job.run_usage.cpu_ms, test.usage.cpu_ms);
+                job.run_usage.wall_ms = std::max(job.run_usage.wall_ms, test.usage.wall_ms);
+                job.run_usage.max_rss_kb = std::max(job.run_usage.max_rss_kb, test.usage.max_rss_kb);
+                job.run_usage.instructions = std::max(job.run_usage.instructions, test.usage.instructions);
+            }
+            (*out_value)["passed"] = passed;
+            (*out_value)["total"] = Json::UInt64(job.tests.size());
         }
     };
-}
\ No newline at end of file
+}
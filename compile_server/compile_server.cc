@@ -1,7 +1,23 @@
 #include "compile_run.hpp"
+#include "conf.hpp"
+#include "scheduler.hpp"
+#include "pipeline.hpp"
+#include "reaper.hpp"
+#include "cgroup.hpp"
+#include "sandbox.hpp"
+#include "forkserver.hpp"
+#include "progress.hpp"
 #include "../comm/httplib.h"
 
 using namespace ns_compile_and_run;
+using namespace ns_conf;
+using namespace ns_scheduler;
+using namespace ns_pipeline;
+using namespace ns_reaper;
+using namespace ns_cgroup;
+using namespace ns_sandbox;
+using namespace ns_forkserver;
+using namespace ns_progress;
 using namespace httplib;
 
 static void Usage(std::string proc)
@@ -9,6 +25,31 @@ static void Usage(std::string proc)
     std::cerr << "Usage: " << "\n\t" << proc << " port" << std::endl;
 }
 
+// 排队已满，让oj_server换一台主机或者稍后重试
+static void ReplyBusy(Response &resp, const std::string &retry_after)
+{
+    Json::Value out_value;
+    out_value["status"] = -4;
+    out_value["reason"] = CompileAndRun::CodeToDesc(-4, "");
+    Json::StyledWriter writer;
+    resp.status = 503;
+    resp.set_header("Retry-After", retry_after);
+    resp.set_content(writer.write(out_value), "application/json;charset=utf-8");
+}
+
+// 执行一个判题任务，流水线模式下交给流水线
+static void Judge(const std::string &in_json, std::string *out_json, const JudgeProgress &progress = nullptr)
+{
+    if (Pipeline::Instance().Enabled())
+    {
+        Pipeline::Instance().Submit(in_json, out_json, progress);
+    }
+    else
+    {
+        CompileAndRun::Start(in_json, out_json, progress);
+    }
+}
+
 // 编译服务随时可能被多个人请求，必须保证传递上来的code，形成源文件名称的时候要有唯一性。
 int main(int argc, char* argv[])
 {
@@ -18,20 +59,192 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    // 加载配置，初始化编译缓存、harness目录和预编译头
+    Conf &conf = Conf::Instance();
+    conf.Load(compile_server_conf);
+    // 临时文件放到tmpfs上，源代码和标准输入输出使用内存文件，判题过程不读写磁盘
+    if (conf.GetBool("in_memory", false))
+    {
+        PathUtil::TempPath() = conf.GetString("in_memory_dir", "/dev/shm/oj_temp/");
+        mkdir(PathUtil::TempPath().c_str(), 0755);
+        // g++链接时的中间文件也放到tmpfs上
+        setenv("TMPDIR", PathUtil::TempPath().c_str(), 1);
+    }
+    // 编译和运行流水线：默认运行线程数为CPU核数的一半，编译线程使用剩下的核
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    size_t run_workers = conf.GetInt("run_workers", 0);
+    if (run_workers == 0)
+    {
+        run_workers = std::max<size_t>(1, cores / 2);
+    }
+    size_t compile_workers = conf.GetInt("compile_workers", 0);
+    if (compile_workers == 0)
+    {
+        compile_workers = std::max<size_t>(1, cores - std::min(cores, run_workers));
+    }
+    // CPU绑核：当前线程(以及之后创建的所有线程和子进程)绑定到编译服务的核上，必须最先设置
+    std::string run_cpus = conf.GetString("run_cpus", "");
+    if (!run_cpus.empty())
+    {
+        CorePool::Instance().Init(run_cpus, conf.GetString("compile_cpus", ""));
+    }
+    // 机器速度校准：此时还没有创建任何线程，基准程序不会被编译服务自己的线程干扰
+    SpeedCalibration::Instance().Init(conf.GetInt("speed_reference_ms", 0),
+                                      atof(conf.GetString("speed_factor", "0").c_str()));
+    // 按指令数限制运行时间，每毫秒指令数为0时在这里校准(绑核之后，校准在编译服务的核上进行)，按速度系数折算成参考机器的值
+    if (conf.GetBool("instruction_limit", false))
+    {
+        InstructionCounter::Instance().Init(conf.GetInt("instructions_per_ms", 0), SpeedCalibration::Instance().Factor());
+    }
+    // 同时运行的用户程序个数，默认等于运行线程数，绑核时等于运行用户程序的核数
+    size_t run_concurrency = conf.GetInt("run_concurrency", 0);
+    if (run_concurrency == 0)
+    {
+        run_concurrency = CorePool::Instance().Enabled() ? CorePool::Instance().Size() : run_workers;
+    }
+    // zygote和沙箱都是fork出来的进程，必须在创建任何线程之前启动
+    if (conf.GetBool("zygote", true))
+    {
+        Zygote::Instance().Start();
+    }
+    // 沙箱池：默认每个同时运行的用户程序一个沙箱
+    if (conf.GetBool("sandbox", false))
+    {
+        size_t sandboxes = conf.GetInt("sandbox_pool", 0);
+        SandboxPool::Instance().Init(sandboxes > 0 ? sandboxes : run_concurrency, conf.GetInt("sandbox_tmp_mb", 16),
+                                     conf.GetString("sandbox_user", "nobody"));
+    }
+    // 所有子进程都由reaper线程集中等待退出
+    if (conf.GetBool("reaper", true))
+    {
+        Reaper::Instance().Start();
+    }
+    if (conf.GetBool("compile_cache", true))
+    {
+        CompileCache::Instance().Init(conf.GetString("compile_cache_dir", cache_path),
+                                      conf.GetInt("compile_cache_max_mb", 256) * 1024 * 1024);
+    }
+    // 用户程序的内存、进程数、CPU限制使用cgroup v2，不可用时退回到rlimit
+    if (conf.GetBool("cgroup", false))
+    {
+        CgroupPool::Instance().Init(conf.GetString("cgroup_root", "/sys/fs/cgroup"), conf.GetInt("cgroup_pids_max", 64),
+                                    conf.GetInt("cgroup_cpus", 1));
+    }
+    HarnessCache::Instance().Init(conf.GetString("harness_dir", harness_path));
+    TestDataStore::Instance().Init(static_cast<uint64_t>(conf.GetInt("test_data_max_mb", 1024)) * 1024 * 1024);
+    // fork server：每个用户程序都链接stub，测试用例多时从停在main之前的快照fork，不再逐个exec
+    if (conf.GetBool("fork_server", false))
+    {
+        ForkServerStub::Instance().Init(conf.GetString("fork_server_stub", "./forkserver_stub.cpp"),
+                                        conf.GetString("fork_server_dir", fork_server_path),
+                                        conf.GetInt("fork_server_min_cases", 2));
+    }
+    if (conf.GetBool("pch", true))
+    {
+        PchManager::Instance().Init(conf.GetString("pch_dir", pch_path), conf.GetInt("pch_max_headers", 64),
+                                    conf.GetInt("pch_max_mb", 1024) * 1024 * 1024);
+    }
+
+    bool pipeline = conf.GetBool("pipeline", true);
+    if (pipeline)
+    {
+        Pipeline::Instance().Init(compile_workers, run_workers, run_concurrency);
+    }
+
+    // 准入控制：默认同时执行的任务数等于CPU核数，流水线模式下等于编译线程数加上同时运行的程序数
+    size_t max_running = conf.GetInt("max_running", 0);
+    if (max_running == 0)
+    {
+        max_running = pipeline ? compile_workers + run_concurrency : cores;
+    }
+    JobScheduler::Instance().Init(max_running, conf.GetInt("max_queued", 64));
+    std::string retry_after = conf.GetString("retry_after", "1");
+
     // 提供的编译服务打包成一个网络服务
     // cpp-httplib
     Server svr;
+    // 线程数要能容纳所有执行中和排队中的任务，超出的请求才能立即得到503，而不是在httplib内部无限排队
+    size_t threads = JobScheduler::Instance().Capacity() + 4;
+    svr.new_task_queue = [threads]() { return new ThreadPool(threads); };
     
-    svr.Post("/compile_and_run", [](const Request &req, Response &resp)
+    svr.Post("/compile_and_run", [retry_after](const Request &req, Response &resp)
     {
         // 用户请求的服务正文正是我们想要的json string
         std::string in_json = req.body;
         std::string out_json;
         if(!in_json.empty())
         {
-            CompileAndRun::Start(in_json,&out_json);
+            JobSlot slot;
+            if(!slot.Acquired())
+            {
+                ReplyBusy(resp, retry_after);
+                return;
+            }
+            Judge(in_json, &out_json);
             resp.set_content(out_json, "application/json;charset=utf-8");
         } 
     });
+
+    // 流式判题：请求同/compile_and_run，应答是text/event-stream(SSE)
+    // 依次推送state(开始编译、开始运行)、每个测试用例结束时的test(见compile_run.hpp的JudgeProgress)，
+    // 最后是result，内容同/compile_and_run的应答；排队已满时同样是503
+    svr.Post("/compile_and_run/stream", [retry_after](const Request &req, Response &resp)
+    {
+        // 准入在写应答头之前决定，名额一直占用到判题结束
+        auto slot = std::make_shared<JobSlot>();
+        if(!slot->Acquired())
+        {
+            ReplyBusy(resp, retry_after);
+            return;
+        }
+        std::string in_json = req.body;
+        resp.set_header("Cache-Control", "no-cache");
+        resp.set_chunked_content_provider("text/event-stream", [slot, in_json](size_t, DataSink &sink)
+        {
+            // 判题在单独的线程里进行，当前的HTTP线程只负责把进度写出去
+            auto stream = std::make_shared<ProgressStream>();
+            std::thread judge([stream, in_json]()
+            {
+                std::string out_json;
+                Judge(in_json, &out_json, [stream](const std::string &event, const Json::Value &data)
+                      { stream->Push(event, data); });
+                stream->Close(out_json);
+            });
+            // 对方断开之后继续取完，判题结束之前不释放名额
+            bool ok = true;
+            std::string frame;
+            while(stream->Pop(2000, &frame))
+            {
+                ok = ok && sink.write(frame.data(), frame.size());
+            }
+            judge.join();
+            if(ok)
+            {
+                sink.done();
+            }
+            return ok;
+        });
+    });
+
+    // 运行状态统计，方便观察编译缓存、预编译头节省了多少g++的时间
+    svr.Get("/stats", [](const Request &, Response &resp)
+    {
+        Json::Value stats;
+        stats["compile_cache"] = CompileCache::Instance().Stats();
+        stats["pch"] = PchManager::Instance().Stats();
+        stats["harness"] = HarnessCache::Instance().Stats();
+        stats["test_data"] = TestDataStore::Instance().Stats();
+        stats["scheduler"] = JobScheduler::Instance().Stats();
+        stats["pipeline"] = Pipeline::Instance().Stats();
+        stats["reaper"] = Reaper::Instance().Stats();
+        stats["cgroup"] = CgroupPool::Instance().Stats();
+        stats["cpuset"] = CorePool::Instance().Stats();
+        stats["instructions"] = InstructionCounter::Instance().Stats();
+        stats["speed"] = SpeedCalibration::Instance().Stats();
+        stats["sandbox"] = SandboxPool::Instance().Stats();
+        stats["fork_server"] = ForkServerStub::Instance().Stats();
+        Json::StyledWriter writer;
+        resp.set_content(writer.write(stats), "application/json;charset=utf-8");
+    });
     svr.listen("0.0.0.0", atoi(argv[1]));
 }
\ No newline at end of file
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <unordered_map>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+
+// 编译服务的配置：./conf/compile_server.conf
+// 每行一个 key=value，#开头的行是注释，没有配置的项使用代码里的默认值
+namespace ns_conf
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    const std::string compile_server_conf = "./conf/compile_server.conf";
+
+    class Conf
+    {
+    public:
+        static Conf &Instance()
+        {
+            static Conf conf;
+            return conf;
+        }
+
+        bool Load(const std::string &conf_file)
+        {
+            std::ifstream in(conf_file);
+            if (!in.is_open())
+            {
+                LOG(WARNING) << "加载: " << conf_file << " 失败，使用默认配置" << "\n";
+                return false;
+            }
+            std::string line;
+            while (std::getline(in, line))
+            {
+                if (line.empty() || line[0] == '#')
+                {
+                    continue;
+                }
+                std::vector<std::string> tokens;
+                StringUtil::SplitString(line, &tokens, "=");
+                if (tokens.size() != 2)
+                {
+                    LOG(WARNING) << " 切分 " << line << "失败！" << "\n";
+                    continue;
+                }
+                kv[tokens[0]] = tokens[1];
+            }
+            in.close();
+            LOG(INFO) << "加载 " << conf_file << " 成功! " << "\n";
+            return true;
+        }
+
+        std::string GetString(const std::string &key, const std::string &def) const
+        {
+            auto iter = kv.find(key);
+            return iter == kv.end() ? def : iter->second;
+        }
+
+        // 值不是整数(空、多余的字符、超出范围)时记录日志并使用默认值，不让一行写错的配置在启动时抛异常
+        long long GetInt(const std::string &key, long long def) const
+        {
+            auto iter = kv.find(key);
+            if (iter == kv.end())
+            {
+                return def;
+            }
+            const char *begin = iter->second.c_str();
+            char *end = nullptr;
+            errno = 0;
+            long long value = strtoll(begin, &end, 10);
+            while (end != begin && isspace(static_cast<unsigned char>(*end)))
+            {
+                ++end;
+            }
+            if (end == begin || *end != '\0' || errno == ERANGE)
+            {
+                LOG(WARNING) << "配置项 " << key << "=" << iter->second << " 不是整数，使用默认值: " << def << "\n";
+                return def;
+            }
+            return value;
+        }
+
+        bool GetBool(const std::string &key, bool def) const
+        {
+            auto iter = kv.find(key);
+            if (iter == kv.end())
+            {
+                return def;
+            }
+            return iter->second == "true" || iter->second == "1" || iter->second == "on";
+        }
+
+        // 启动时或者测试时修改配置，不是线程安全的，必须在服务线程启动之前调用
+        void Set(const std::string &key, const std::string &value)
+        {
+            kv[key] = value;
+        }
+
+    private:
+        Conf() = default;
+        Conf(const Conf &) = delete;
+        Conf &operator=(const Conf &) = delete;
+
+        std::unordered_map<std::string, std::string> kv;
+    };
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sched.h>
+#include <jsoncpp/json/json.h>
+
+// CPU绑核：同一台机器上同时运行的用户程序互相抢核，同一份代码在空闲和繁忙时的CPU时间相差很大
+// 开启后每个用户程序独占run_cpus中的一个核(exec之前sched_setaffinity)，没有空闲的核时排队等待
+// 编译服务自己的线程、zygote、沙箱和g++都绑定在compile_cpus上(启动时设置，子进程继承)，不和用户程序抢核
+// 沙箱的seccomp禁止sched_setaffinity，用户程序不能自己换核
+namespace ns_cpuset
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    class CorePool
+    {
+    public:
+        static CorePool &Instance()
+        {
+            static CorePool pool;
+            return pool;
+        }
+
+        // run_cpus: 运行用户程序的核，比如 "2-7" 或者 "2,3,6-7"
+        // compile_cpus: 编译服务自己和g++使用的核，为空时是当前允许的核中除去run_cpus的部分，
+        //               两者重叠时运行不再独占，只用于核数很少的机器
+        // 必须在创建任何线程和子进程之前调用，失败时不绑核
+        bool Init(const std::string &run_cpus, const std::string &compile_cpus)
+        {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+            {
+                LOG(ERROR) << "读取CPU亲和性失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            std::vector<int> run;
+            if (!ParseList(run_cpus, &run) || run.empty())
+            {
+                LOG(ERROR) << "run_cpus不合法: " << run_cpus << "\n";
+                return false;
+            }
+            cpu_set_t compile;
+            CPU_ZERO(&compile);
+            std::vector<int> listed;
+            if (!ParseList(compile_cpus, &listed))
+            {
+                LOG(ERROR) << "compile_cpus不合法: " << compile_cpus << "\n";
+                return false;
+            }
+            for (int cpu : listed)
+            {
+                CPU_SET(cpu, &compile);
+            }
+            if (listed.empty())
+            {
+                CPU_OR(&compile, &compile, &allowed);
+            }
+            for (int cpu : run)
+            {
+                if (!CPU_ISSET(cpu, &allowed))
+                {
+                    LOG(ERROR) << "run_cpus中的核 " << cpu << " 不在当前进程允许的范围内" << "\n";
+                    return false;
+                }
+                // 明确配置的compile_cpus按配置来(核不够分的小机器上只好共用)
+                if (listed.empty())
+                {
+                    CPU_CLR(cpu, &compile);
+                }
+                else if (CPU_ISSET(cpu, &compile))
+                {
+                    LOG(WARNING) << "核 " << cpu << " 同时出现在run_cpus和compile_cpus中，用户程序会受到编译的干扰" << "\n";
+                }
+            }
+            CPU_AND(&compile, &compile, &allowed);
+            if (CPU_COUNT(&compile) == 0)
+            {
+                LOG(ERROR) << "除去run_cpus之后没有留给编译服务的核" << "\n";
+                return false;
+            }
+            if (sched_setaffinity(0, sizeof(compile), &compile) < 0)
+            {
+                LOG(ERROR) << "绑定编译服务的核失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            cores = run;
+            free_cores.assign(run.rbegin(), run.rend());
+            enabled = true;
+            LOG(INFO) << "CPU绑核已开启，运行用户程序的核: " << run_cpus << " 编译服务的核数: " << CPU_COUNT(&compile) << "\n";
+            return true;
+        }
+
+        bool Enabled() const
+        {
+            return enabled;
+        }
+
+        // 运行用户程序的核数
+        size_t Size() const
+        {
+            return cores.size();
+        }
+
+        // 取一个空闲的核，没有时阻塞等待；没有开启时返回-1
+        // 不能在reaper线程里调用，核是由reaper线程归还的
+        int Acquire()
+        {
+            if (!enabled)
+            {
+                return -1;
+            }
+            std::unique_lock<std::mutex> lock(mtx);
+            if (free_cores.empty())
+            {
+                ++waits;
+                ++waiting;
+                int64_t start = TimeUtil::GetMonotonicMs();
+                cv.wait(lock, [this]()
+                        { return !free_cores.empty(); });
+                --waiting;
+                wait_ms += TimeUtil::GetMonotonicMs() - start;
+            }
+            int cpu = free_cores.back();
+            free_cores.pop_back();
+            ++acquired;
+            return cpu;
+        }
+
+        void Release(int cpu)
+        {
+            if (cpu < 0)
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                free_cores.push_back(cpu);
+            }
+            cv.notify_one();
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["cores"] = Json::UInt64(cores.size());
+            stats["busy"] = Json::UInt64(cores.size() - free_cores.size());
+            stats["waiting"] = Json::UInt64(waiting);
+            stats["acquired"] = Json::UInt64(acquired);
+            stats["waits"] = Json::UInt64(waits);
+            stats["wait_ms"] = Json::Int64(wait_ms);
+            return stats;
+        }
+
+        // 解析 "0-3,6" 这样的核列表，空字符串得到空列表
+        static bool ParseList(const std::string &list, std::vector<int> *cpus)
+        {
+            std::vector<std::string> items;
+            StringUtil::SplitString(list, &items, ",");
+            for (const auto &item : items)
+            {
+                char *end = nullptr;
+                long first = strtol(item.c_str(), &end, 10);
+                long last = first;
+                if (*end == '-')
+                {
+                    last = strtol(end + 1, &end, 10);
+                }
+                if (end == item.c_str() || *end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+                {
+                    return false;
+                }
+                for (long cpu = first; cpu <= last; ++cpu)
+                {
+                    cpus->push_back(static_cast<int>(cpu));
+                }
+            }
+            return true;
+        }
+
+    private:
+        CorePool() = default;
+        CorePool(const CorePool &) = delete;
+        CorePool &operator=(const CorePool &) = delete;
+
+    private:
+        bool enabled = false;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<int> cores;      // 运行用户程序的全部核
+        std::vector<int> free_cores; // 空闲的核
+        size_t waiting = 0;
+        uint64_t acquired = 0;
+        uint64_t waits = 0; // 没有空闲的核、需要排队的次数
+        int64_t wait_ms = 0;
+    };
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+#include "launcher.hpp"
+#include "zygote.hpp"
+#include "reaper.hpp"
+#include "compile.hpp"
+#include "runner.hpp"
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <jsoncpp/json/json.h>
+
+// fork server：测试用例很多时，每个用例都exec一次用户程序，动态链接和libstdc++的静态初始化也跟着重复一次
+// 开启后每个用户程序都链接forkserver_stub.cpp(普通运行时它什么也不做)；
+// 一个任务有多个测试用例时先把程序启动一次，停在main之前，之后每个用例从这个快照fork出一个写时复制的子进程
+// fork server和zygote说同样的协议，每个用例照常经过Reaper等待退出、计算墙上时间、加入自己的cgroup
+// 用户程序的全局对象在fork server进程里构造，恶意代码可以篡改stub回报的退出状态和CPU时间；
+// 隔离依然由外部的沙箱、seccomp、cgroup和墙上时间保证，所以默认关闭
+namespace ns_forkserver
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_launcher;
+    using namespace ns_zygote;
+    using namespace ns_reaper;
+    using namespace ns_compiler;
+    using namespace ns_runner;
+
+    const std::string fork_server_path = "./forkserver/";
+
+    // 编译stub并设置链接参数
+    class ForkServerStub
+    {
+    public:
+        static ForkServerStub &Instance()
+        {
+            static ForkServerStub stub;
+            return stub;
+        }
+
+        // src: stub的源文件，和zygote_protocol.hpp在同一个目录
+        // dir: 编译好的目标文件 <dir>/stub_<版本>.o，版本是两个文件内容的SHA-256，修改协议后自然重新编译
+        // min_cases: 至少有这么多测试用例才使用fork server
+        bool Init(const std::string &src, const std::string &dir, int min_cases)
+        {
+            std::string source, protocol;
+            std::string src_dir = src.substr(0, src.find_last_of('/') + 1);
+            if (!FileUtil::ReadFile(src, &source, true) ||
+                !FileUtil::ReadFile(src_dir + "zygote_protocol.hpp", &protocol, true))
+            {
+                LOG(WARNING) << "没有找到fork server的stub: " << src << "，不使用fork server" << "\n";
+                return false;
+            }
+            std::string stub_dir = dir;
+            if (stub_dir.empty() || stub_dir.back() != '/')
+            {
+                stub_dir += "/";
+            }
+            mkdir(stub_dir.c_str(), 0755);
+            std::string base = stub_dir + "stub_" + HashUtil::Sha256(source + protocol);
+            std::string obj = base + ".o";
+            if (!FileUtil::IsFileExists(obj))
+            {
+                std::string tmp_obj = base + ".o.tmp";
+                std::string err_file = base + ".compile_error";
+                if (!Compiler::CompileObject(src, tmp_obj, err_file) || rename(tmp_obj.c_str(), obj.c_str()) != 0)
+                {
+                    unlink(tmp_obj.c_str());
+                    LOG(ERROR) << "编译fork server的stub失败，详情见: " << err_file << "\n";
+                    return false;
+                }
+                unlink(err_file.c_str());
+            }
+            // crt1.o对main的引用改成__wrap_main，stub里用__real_main调用用户的main
+            Compiler::LinkFlags() = {"-Wl,--wrap=main", obj};
+            min_tests = min_cases > 1 ? min_cases : 1;
+            enabled = true;
+            LOG(INFO) << "fork server启动成功: " << obj << "\n";
+            return true;
+        }
+
+        // 有cases个测试用例的任务是否使用fork server
+        // 需要reaper：fork server要一直运行到所有用例结束，不能在当前线程里等待它退出
+        bool Use(size_t cases) const
+        {
+            return enabled && cases >= min_tests && Reaper::Instance().Running();
+        }
+
+        void Started(bool ok)
+        {
+            ++(ok ? started : failed);
+        }
+
+        Json::Value Stats()
+        {
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["started"] = Json::UInt64(started);
+            stats["failed"] = Json::UInt64(failed);
+            return stats;
+        }
+
+    private:
+        ForkServerStub() = default;
+        ForkServerStub(const ForkServerStub &) = delete;
+        ForkServerStub &operator=(const ForkServerStub &) = delete;
+
+    private:
+        bool enabled = false;
+        size_t min_tests = 2;
+        std::atomic<uint64_t> started{0};
+        std::atomic<uint64_t> failed{0};
+    };
+
+    // 一个任务的fork server，任务结束(或者启动失败)时析构：关闭控制socket，同时杀掉fork server
+    // 正常的fork server这时已经没有子进程，收到关闭就会退出；被用户代码卡住的不理会关闭，
+    // 不杀掉的话会一直占着沙箱，直到它自己的墙上时间用完
+    class ForkServer
+    {
+    public:
+        ForkServer() = default;
+        ~ForkServer()
+        {
+            client.Close();
+            group->Cancel();
+        }
+
+        // 像运行普通用例一样启动程序(同样的沙箱、cgroup、资源限制)，把控制socket交给它，等待它停在main之前
+        // ready_timeout: 等待全局对象初始化完成的时间(ms)
+        // wall_limit: fork server本身的墙上时间(ms)，只是兜底，任务结束时会主动关闭它
+        // output_limit: 全局对象的构造函数在fork server里的输出上限，同测试用例
+        // 返回值：false表示启动失败，调用方按普通方式运行每个测试用例
+        bool Start(const std::string &file_name, int cpu_limit, int mem_limit, int ready_timeout, int wall_limit,
+                   size_t output_limit)
+        {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+            {
+                LOG(ERROR) << "创建fork server控制socket失败: " << strerror(errno) << "\n";
+                ForkServerStub::Instance().Started(false);
+                return false;
+            }
+            // fork server自己的输出和资源使用情况没有用，但是要保证在它退出之前一直有效
+            auto output = std::make_shared<Output>();
+            std::string io_name = file_name + "_server";
+            RunOptions options;
+            options.control_fd = sv[1];
+            options.output_limit = output_limit;
+            options.cancel = group;
+            Runner::RunAsync(file_name, io_name, "", cpu_limit, mem_limit, wall_limit, &output->out, &output->err,
+                             &output->usage, [output, io_name](int)
+                             {
+                                 if (!Compiler::InMemory())
+                                 {
+                                     unlink(PathUtil::Stdin(io_name).c_str());
+                                 }
+                             },
+                             options);
+            close(sv[1]);
+
+            // 创建失败或者程序在main之前就退出了，对端关闭，这里立即返回
+            Reply reply;
+            if (!Launcher::WaitReadable(sv[0], ready_timeout) || !Zygote::ReadReply(sv[0], &reply) || reply.type != READY)
+            {
+                LOG(WARNING) << "fork server没有在" << ready_timeout << "ms内停在main之前，改为exec运行" << "\n";
+                close(sv[0]);
+                ForkServerStub::Instance().Started(false);
+                return false;
+            }
+            client.Attach(sv[0]);
+            ForkServerStub::Instance().Started(true);
+            LOG(INFO) << "fork server启动成功, pid: " << reply.pid << "\n";
+            return true;
+        }
+
+        // 用例通过它创建子进程(Runner::RunAsync的server参数)
+        Zygote *Client()
+        {
+            return &client;
+        }
+
+    private:
+        ForkServer(const ForkServer &) = delete;
+        ForkServer &operator=(const ForkServer &) = delete;
+
+        struct Output
+        {
+            std::string out;
+            std::string err;
+            ResourceUsage usage;
+        };
+
+        Zygote client;
+        std::shared_ptr<CancelGroup> group = std::make_shared<CancelGroup>(); // 只有fork server自己
+    };
+}
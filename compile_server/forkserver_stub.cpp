@@ -0,0 +1,284 @@
+// fork server的stub：编译服务开启fork_server时，用 -Wl,--wrap=main 链接进每个用户程序
+// crt1.o对main的引用被改成__wrap_main，程序完成动态链接和全局对象的初始化之后先进入这里
+// 有控制socket(fd 198)时停在main之前，按zygote的协议(zygote_protocol.hpp)接收请求，
+// 每个请求fork出一个写时复制的子进程，子进程换上测试用例的标准输入输出、cgroup和资源限制后从main开始执行，
+// 省掉每个测试用例的exec、动态链接和libstdc++的静态初始化
+// 没有控制socket时(普通运行)直接进入main，和没有链接这个文件一样
+// 这个文件运行在用户程序里，只使用系统调用，不分配内存
+#include "zygote_protocol.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+
+using namespace ns_zygote;
+
+extern "C" int __real_main(int argc, char **argv, char **envp);
+
+namespace
+{
+    // 正在运行的子进程和它的应答socket
+    struct Child
+    {
+        pid_t pid;
+        int reply_fd;
+    };
+
+    const int max_children = 256;
+    Child children[max_children];
+    int child_count = 0;
+    char request[max_request_size];
+
+    void WriteReply(int sock, const Reply &reply)
+    {
+        send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+    }
+
+    // 和Launcher一样同时设置硬限制，用户的main不能再调高；CPU的硬限制多1秒，先收到SIGXCPU
+    // 在沙箱里seccomp拒绝修改资源限制，这里会失败，子进程沿用fork server启动时设置的(同样的)限制
+    void SetLimit(int resource, rlim_t value, rlim_t slack = 0)
+    {
+        rlimit limit;
+        limit.rlim_cur = value;
+        limit.rlim_max = value + slack;
+        setrlimit(resource, &limit);
+    }
+
+    // 收到一个请求，返回值：true表示当前是fork出来的子进程，应该进入main
+    // running: 编译服务关闭了控制socket时置为false
+    bool HandleRequest(int control, int sig_fd, const sigset_t &child_mask, bool *running)
+    {
+        iovec iov;
+        iov.iov_base = request;
+        iov.iov_len = sizeof(request);
+        char cmsg_buffer[CMSG_SPACE(sizeof(int) * 8)];
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buffer;
+        msg.msg_controllen = sizeof(cmsg_buffer);
+        ssize_t n = recvmsg(control, &msg, MSG_CMSG_CLOEXEC);
+        if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+        {
+            // 编译服务关闭了控制socket，处理完剩下的子进程就退出
+            *running = false;
+            return false;
+        }
+        if (n < 0)
+        {
+            return false;
+        }
+
+        int fds[8];
+        int fd_count = 0;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            {
+                int count = static_cast<int>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                for (int i = 0; i < count && fd_count < 8; ++i)
+                {
+                    memcpy(&fds[fd_count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                }
+            }
+        }
+        RequestHeader header;
+        if (static_cast<size_t>(n) < sizeof(header) || fd_count == 0)
+        {
+            for (int i = 0; i < fd_count; ++i) close(fds[i]);
+            return false;
+        }
+        memcpy(&header, request, sizeof(header));
+        int reply_fd = fds[0];
+        int index = 1;
+        // 不再exec，exe即使发过来也用不到
+        index += header.has_exe && index < fd_count ? 1 : 0;
+        int std_fds[3];
+        std_fds[0] = header.has_stdin && index < fd_count ? fds[index++] : -1;
+        std_fds[1] = header.has_stdout && index < fd_count ? fds[index++] : -1;
+        std_fds[2] = header.has_stderr && index < fd_count ? fds[index++] : -1;
+        int cgroup_fd = header.has_cgroup && index < fd_count ? fds[index++] : -1;
+
+        pid_t pid = -1;
+        if (child_count < max_children)
+        {
+            pid = fork();
+        }
+        else
+        {
+            errno = EAGAIN;
+        }
+        if (pid == 0)
+        {
+            // 子进程：关掉fork server自己的fd，别的测试用例的应答socket不能留在用户程序里
+            close(control);
+            close(sig_fd);
+            for (int i = 0; i < child_count; ++i)
+            {
+                close(children[i].reply_fd);
+            }
+            prctl(PR_SET_PDEATHSIG, SIGKILL); // fork server被杀掉时子进程跟着退出
+            setpgid(0, 0);                    // 和Launcher一样自成一个进程组，超时时整组杀掉
+            // STARTED由子进程自己发送，编译服务从内核附上的凭证里取得它的pid(见Zygote::ReadStarted)
+            Reply started = {STARTED, getpid(), 0, 0, 0, 0};
+            WriteReply(reply_fd, started);
+            close(reply_fd);
+            if (cgroup_fd >= 0 && write(cgroup_fd, "0", 1) < 0)
+            {
+                _exit(127);
+            }
+            for (int i = 0; i < 3; ++i)
+            {
+                if (std_fds[i] >= 0 && dup2(std_fds[i], i) < 0)
+                {
+                    _exit(127);
+                }
+            }
+            for (int i = 1; i < fd_count; ++i)
+            {
+                if (fds[i] > 2) close(fds[i]);
+            }
+            if (header.cpu >= 0)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(header.cpu, &cpus);
+                if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+                {
+                    _exit(127);
+                }
+            }
+            if (header.cpu_limit > 0) SetLimit(RLIMIT_CPU, header.cpu_limit, 1);
+            if (header.mem_limit > 0) SetLimit(RLIMIT_AS, static_cast<rlim_t>(header.mem_limit) * 1024);
+            if (header.fsize_limit > 0) SetLimit(RLIMIT_FSIZE, static_cast<rlim_t>(header.fsize_limit) * 1024);
+            sigprocmask(SIG_SETMASK, &child_mask, nullptr);
+            return true;
+        }
+
+        int fork_errno = pid < 0 ? errno : 0;
+        for (int i = 1; i < fd_count; ++i)
+        {
+            close(fds[i]);
+        }
+        if (pid < 0)
+        {
+            Reply reply = {STARTED, -1, 0, fork_errno, 0, 0};
+            WriteReply(reply_fd, reply);
+            close(reply_fd);
+            return false;
+        }
+        children[child_count].pid = pid;
+        children[child_count].reply_fd = reply_fd;
+        ++child_count;
+        return false;
+    }
+
+    // 回收退出的子进程，回复EXITED
+    void ReapChildren()
+    {
+        int status = 0;
+        struct rusage ru;
+        pid_t pid;
+        while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+        {
+            for (int i = 0; i < child_count; ++i)
+            {
+                if (children[i].pid != pid)
+                {
+                    continue;
+                }
+                int64_t cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000LL +
+                                 (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+                Reply reply = {EXITED, pid, status, 0, cpu_ms, ru.ru_maxrss};
+                WriteReply(children[i].reply_fd, reply);
+                close(children[i].reply_fd);
+                children[i] = children[--child_count];
+                break;
+            }
+        }
+    }
+
+    // fork server的主循环，只在fork出来的子进程里返回
+    void Serve(int control)
+    {
+        sigset_t mask, old_mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, &old_mask);
+        int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+        if (sig_fd < 0)
+        {
+            _exit(127);
+        }
+
+        Reply ready = {READY, getpid(), 0, 0, 0, 0};
+        WriteReply(control, ready);
+        bool running = true;
+        while (running || child_count > 0)
+        {
+            pollfd pfds[2];
+            pfds[0].fd = sig_fd;
+            pfds[0].events = POLLIN;
+            pfds[1].fd = running ? control : -1;
+            pfds[1].events = POLLIN;
+            if (poll(pfds, 2, -1) < 0)
+            {
+                continue;
+            }
+            if (pfds[0].revents & POLLIN)
+            {
+                signalfd_siginfo info;
+                while (read(sig_fd, &info, sizeof(info)) > 0)
+                {
+                }
+                ReapChildren();
+            }
+            if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                if (HandleRequest(control, sig_fd, old_mask, &running))
+                {
+                    return;
+                }
+            }
+        }
+        _exit(0);
+    }
+}
+
+// fd 198是编译服务交过来的SOCK_SEQPACKET，碰巧继承到的其他fd(比如http连接)不算
+static bool HasControlSocket()
+{
+    int type = 0, domain = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fork_server_fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+    {
+        return false;
+    }
+    len = sizeof(domain);
+    return getsockopt(fork_server_fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 &&
+           type == SOCK_SEQPACKET && domain == AF_UNIX;
+}
+
+extern "C" int __wrap_main(int argc, char **argv, char **envp)
+{
+    if (HasControlSocket())
+    {
+        // 全局对象的构造函数可能已经输出了内容，fork之前清空缓冲区，否则每个子进程都会再输出一遍
+        fflush(nullptr);
+        fcntl(fork_server_fd, F_SETFD, FD_CLOEXEC);
+        Serve(fork_server_fd);
+    }
+    return __real_main(argc, argv, envp);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "compile.hpp"
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <jsoncpp/json/json.h>
+
+// 单独编译的测试用例(harness)：
+// 每道题的harness.cpp只在编译服务上编译一次，形成 ./harness/<题号>_<版本>.o
+// 之后每次提交只编译用户代码这一个翻译单元，再和harness的目标文件链接
+// 版本就是harness源代码的SHA-256，题目的测试用例修改之后自然会生成新的目标文件
+namespace ns_harness
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_compiler;
+
+    const std::string harness_path = "./harness/";
+
+    class HarnessCache
+    {
+    public:
+        static HarnessCache &Instance()
+        {
+            static HarnessCache harness;
+            return harness;
+        }
+
+        void Init(const std::string &dir)
+        {
+            harness_dir = dir;
+            if (harness_dir.empty() || harness_dir.back() != '/')
+            {
+                harness_dir += "/";
+            }
+            mkdir(harness_dir.c_str(), 0755);
+        }
+
+        // id: 题号 version: harness源代码的SHA-256 source: harness源代码
+        // 返回harness目标文件的路径，编译失败或者参数不合法返回空
+        std::string Get(const std::string &id, const std::string &version, const std::string &source)
+        {
+            if (!ValidId(id) || version != HashUtil::Sha256(source))
+            {
+                LOG(ERROR) << "harness参数不合法，题号: " << id << " 版本: " << version << "\n";
+                return "";
+            }
+            std::string base = harness_dir + id + "_" + version;
+            std::string obj = base + ".o";
+
+            // 同一个版本只允许一个线程编译，其他线程等待它的结果
+            std::shared_ptr<std::mutex> build_mtx;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                std::shared_ptr<std::mutex> &m = building[obj];
+                if (!m)
+                {
+                    m = std::make_shared<std::mutex>();
+                }
+                build_mtx = m;
+            }
+            std::lock_guard<std::mutex> build_lock(*build_mtx);
+            if (FileUtil::IsFileExists(obj))
+            {
+                ++hits;
+                return obj;
+            }
+
+            std::string src = base + ".cpp";
+            std::string err_file = base + ".compile_error";
+            std::string tmp_obj = base + ".o.tmp";
+            if (!FileUtil::WriteFile(src, source) ||
+                !Compiler::CompileObject(src, tmp_obj, err_file) ||
+                rename(tmp_obj.c_str(), obj.c_str()) != 0)
+            {
+                unlink(tmp_obj.c_str());
+                LOG(ERROR) << "编译harness失败，题号: " << id << " 详情见: " << err_file << "\n";
+                return "";
+            }
+            unlink(src.c_str());
+            unlink(err_file.c_str());
+            ++builds;
+            LOG(INFO) << "编译harness成功: " << obj << "\n";
+            return obj;
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["hits"] = Json::UInt64(hits);
+            stats["builds"] = Json::UInt64(builds);
+            return stats;
+        }
+
+    private:
+        HarnessCache() = default;
+        HarnessCache(const HarnessCache &) = delete;
+        HarnessCache &operator=(const HarnessCache &) = delete;
+
+        // 题号会成为文件名的一部分，只允许字母数字下划线
+        static bool ValidId(const std::string &id)
+        {
+            if (id.empty() || id.size() > 64)
+            {
+                return false;
+            }
+            for (char c : id)
+            {
+                if (!isalnum(static_cast<unsigned char>(c)) && c != '_')
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+    private:
+        std::mutex mtx;
+        std::string harness_dir = harness_path;
+        std::unordered_map<std::string, std::shared_ptr<std::mutex>> building;
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> builds{0};
+    };
+}
@@ -0,0 +1,394 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+#include "zygote_protocol.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+// 统一的进程启动器：编译器、用户程序、zygote都通过它创建子进程
+// 使用 clone(CLONE_VM | CLONE_VFORK)：子进程和父进程共享地址空间，不复制页表，
+// 父进程挂起直到子进程exec或退出，开销和父进程的大小无关(posix_spawn也是这样实现的)
+// 子进程在exec之前只做一个很小的"跳板"：重定向标准输入输出、设置资源限制
+// 跳板里只能调用系统调用，不能分配内存、不能加锁，所有参数都在父进程里准备好
+namespace ns_launcher
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    // 一次创建子进程的请求
+    struct SpawnRequest
+    {
+        std::vector<std::string> argv; // argv[0]是要执行的程序，按PATH查找
+        int exe_fd = -1;               // 不为-1时通过fexecve执行这个文件，argv[0]只作为进程名
+        int stdin_fd = -1;             // -1 表示不重定向
+        int stdout_fd = -1;
+        int stderr_fd = -1;
+        int cpu_limit = 0; // CPU时间限制(s)，0表示不限制
+        int mem_limit = 0; // 地址空间限制(kb)，0表示不限制
+        int fsize_limit = 0; // 单个写出文件的大小限制(kb)，0表示不限制
+        int wall_limit = 0;  // 墙上时间限制(ms)，由等待方计时，超时杀掉整个进程组，0表示不限制
+        int cgroup_fd = -1;  // 不为-1时是某个cgroup的cgroup.procs，子进程在exec之前加入这个cgroup
+        int control_fd = -1; // 不为-1时dup2到fork_server_fd，链接了fork server的用户程序通过它接收请求
+        int cpu = -1;        // 不为-1时子进程在exec之前绑定到这个核(见cpuset.hpp)
+        int64_t instruction_limit = 0; // 大于0时统计子进程的指令数，到达上限时杀掉(见perf.hpp，需要reaper)
+        const sock_fprog *seccomp = nullptr; // 不为nullptr时子进程在exec之前安装这个seccomp过滤器
+        int uid = -1; // 不为-1时子进程在exec之前切换到这个用户和组(沙箱里的用户程序不以root运行)
+        int gid = -1;
+    };
+
+    // 子进程的资源使用情况，来自wait4
+    struct ResourceUsage
+    {
+        int64_t cpu_ms = 0;     // 用户态+内核态的CPU时间，包括它等待过的子进程(比如g++的cc1plus)
+        int64_t wall_ms = 0;    // 从创建到退出的墙上时间
+        int64_t max_rss_kb = 0; // 峰值常驻内存
+        int64_t instructions = 0; // 用户态执行的指令数(见perf.hpp)，没有统计时为0
+    };
+
+    // 子进程的退出信息
+    struct ExitInfo
+    {
+        int status = 0;               // waitpid风格的退出状态
+        bool wall_timeout = false;    // 是否因为超过墙上时间被杀掉
+        bool cancelled = false;       // 是否因为所在的取消组被取消而被杀掉(见reaper.hpp)
+        bool output_exceeded = false; // 输出是否超过上限(见capture.hpp)，超过时整个进程组被杀掉
+        bool instructions_exceeded = false; // 指令数是否到达上限(见perf.hpp)
+        ResourceUsage usage;
+    };
+
+    class Launcher
+    {
+    private:
+        // 跳板需要的全部参数，子进程和父进程共享这块内存
+        struct Trampoline
+        {
+            char *const *argv;
+            int exe_fd;
+            int fds[3];
+            int cpu_limit;
+            int mem_limit;
+            int fsize_limit;
+            int cgroup_fd;
+            int control_fd;
+            int cpu;
+            const sock_fprog *seccomp;
+            int uid;
+            int gid;
+            const sigset_t *child_mask;
+            int exec_errno; // exec失败时子进程写入，父进程读取
+        };
+
+        static const size_t stack_size = 64 * 1024;
+
+    public:
+        // 创建子进程并exec，返回子进程pid，失败返回-1(errno有效)
+        // child_mask: 子进程的信号屏蔽字，nullptr表示沿用调用线程的
+        static pid_t Spawn(const SpawnRequest &req, const sigset_t *child_mask = nullptr)
+        {
+            if (req.argv.empty())
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            std::vector<char *> argv;
+            for (const auto &arg : req.argv)
+            {
+                argv.push_back(const_cast<char *>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+
+            // 子进程的栈，CLONE_VFORK期间父进程挂起，用完即可释放
+            void *stack = mmap(nullptr, stack_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+            if (stack == MAP_FAILED)
+            {
+                return -1;
+            }
+
+            // 先屏蔽所有信号，防止子进程在exec之前执行父进程的信号处理函数
+            sigset_t all, old_mask;
+            sigfillset(&all);
+            pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+
+            Trampoline t;
+            t.argv = argv.data();
+            t.exe_fd = req.exe_fd;
+            t.fds[0] = req.stdin_fd;
+            t.fds[1] = req.stdout_fd;
+            t.fds[2] = req.stderr_fd;
+            t.cpu_limit = req.cpu_limit;
+            t.mem_limit = req.mem_limit;
+            t.fsize_limit = req.fsize_limit;
+            t.cgroup_fd = req.cgroup_fd;
+            t.control_fd = req.control_fd;
+            t.cpu = req.cpu;
+            t.seccomp = req.seccomp;
+            t.uid = req.uid;
+            t.gid = req.gid;
+            t.child_mask = child_mask ? child_mask : &old_mask;
+            t.exec_errno = 0;
+
+            pid_t pid = clone(ChildMain, static_cast<char *>(stack) + stack_size,
+                              CLONE_VM | CLONE_VFORK | SIGCHLD, &t);
+            int clone_errno = errno;
+
+            pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+            munmap(stack, stack_size);
+
+            if (pid < 0)
+            {
+                errno = clone_errno;
+                return -1;
+            }
+            if (t.exec_errno != 0)
+            {
+                // 子进程已经_exit，回收掉
+                waitpid(pid, nullptr, 0);
+                errno = t.exec_errno;
+                return -1;
+            }
+            return pid;
+        }
+
+        // 创建子进程并阻塞等待它退出
+        // 返回值：true表示子进程已经退出，info中是退出信息；false表示创建失败
+        static bool SpawnAndWait(const SpawnRequest &req, ExitInfo *info)
+        {
+            int64_t start = TimeUtil::GetMonotonicMs();
+            pid_t pid = Spawn(req);
+            if (pid < 0)
+            {
+                LOG(ERROR) << "创建子进程失败: " << req.argv[0] << " " << strerror(errno) << "\n";
+                return false;
+            }
+            info->wall_timeout = false;
+            if (req.wall_limit > 0)
+            {
+                int pid_fd = OpenPidFd(pid);
+                info->wall_timeout = !WaitReadable(pid_fd, req.wall_limit);
+                if (pid_fd >= 0)
+                {
+                    close(pid_fd);
+                }
+                if (info->wall_timeout)
+                {
+                    KillGroup(pid);
+                }
+            }
+            Wait(pid, info);
+            info->usage.wall_ms = TimeUtil::GetMonotonicMs() - start;
+            return true;
+        }
+
+        // 回收子进程，取得退出状态和资源使用情况(墙上时间由调用方计算)
+        static void Wait(pid_t pid, ExitInfo *info)
+        {
+            struct rusage ru;
+            memset(&ru, 0, sizeof(ru));
+            while (wait4(pid, &info->status, 0, &ru) < 0 && errno == EINTR)
+            {
+            }
+            FillUsage(ru, &info->usage);
+        }
+
+        static void FillUsage(const struct rusage &ru, ResourceUsage *usage)
+        {
+            usage->cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000LL +
+                            (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+            usage->max_rss_kb = ru.ru_maxrss; // Linux下单位是kb
+        }
+
+        // 子进程退出时变为可读的fd，可以交给poll/epoll等待，失败返回-1
+        static int OpenPidFd(pid_t pid)
+        {
+            return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+        }
+
+        // 等待fd可读(pidfd在进程退出时可读，socket在对端应答时可读)，最多等待timeout_ms毫秒
+        // 返回值：false表示超时
+        static bool WaitReadable(int fd, int timeout_ms)
+        {
+            if (fd < 0)
+            {
+                return true;
+            }
+            int64_t deadline = TimeUtil::GetMonotonicMs() + timeout_ms;
+            while (true)
+            {
+                int64_t left = deadline - TimeUtil::GetMonotonicMs();
+                if (left <= 0)
+                {
+                    return false;
+                }
+                pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLIN;
+                int n = poll(&pfd, 1, static_cast<int>(left));
+                if (n > 0)
+                {
+                    return true;
+                }
+                if (n < 0 && errno != EINTR)
+                {
+                    return true;
+                }
+            }
+        }
+
+        // 子进程在跳板里自成一个进程组，连同它创建的进程(比如g++的cc1plus、as、ld)一起杀掉
+        // 子进程被回收之前pid不会被复用，调用方必须保证还没有waitpid
+        static void KillGroup(pid_t pid)
+        {
+            if (kill(-pid, SIGKILL) < 0)
+            {
+                kill(pid, SIGKILL);
+            }
+        }
+
+    private:
+        // 子进程执行的跳板，只能使用异步信号安全的系统调用
+        static int ChildMain(void *arg)
+        {
+            Trampoline *t = static_cast<Trampoline *>(arg);
+
+            // 被忽略的信号会被exec继承(比如httplib忽略了SIGPIPE)，全部恢复默认
+            struct sigaction dfl;
+            memset(&dfl, 0, sizeof(dfl));
+            dfl.sa_handler = SIG_DFL;
+            for (int sig = 1; sig < NSIG; ++sig)
+            {
+                if (sig != SIGKILL && sig != SIGSTOP)
+                {
+                    sigaction(sig, &dfl, nullptr);
+                }
+            }
+
+            setpgid(0, 0);
+
+            // 在exec之前加入cgroup，之后分配的内存都计入这个cgroup
+            if (t->cgroup_fd >= 0 && write(t->cgroup_fd, "0", 1) < 0)
+            {
+                t->exec_errno = errno;
+                _exit(127);
+            }
+
+            for (int i = 0; i < 3; ++i)
+            {
+                if (t->fds[i] < 0)
+                {
+                    continue;
+                }
+                if (t->fds[i] == i)
+                {
+                    // dup2到自己不会清除FD_CLOEXEC
+                    fcntl(i, F_SETFD, 0);
+                }
+                else if (dup2(t->fds[i], i) < 0)
+                {
+                    t->exec_errno = errno;
+                    _exit(127);
+                }
+            }
+            if (t->control_fd >= 0)
+            {
+                if (t->control_fd == ns_zygote::fork_server_fd)
+                {
+                    fcntl(t->control_fd, F_SETFD, 0);
+                }
+                else if (dup2(t->control_fd, ns_zygote::fork_server_fd) < 0)
+                {
+                    t->exec_errno = errno;
+                    _exit(127);
+                }
+            }
+
+            if (t->cpu >= 0)
+            {
+                cpu_set_t cpus;
+                CPU_ZERO(&cpus);
+                CPU_SET(t->cpu, &cpus);
+                if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+                {
+                    t->exec_errno = errno;
+                    _exit(127);
+                }
+            }
+            // 硬限制和软限制一起设置，降权之后的程序不能再把软限制调高；
+            // CPU的硬限制多1秒，先到软限制收到SIGXCPU(报告超时)，不理会SIGXCPU的程序到硬限制时被SIGKILL
+            if (t->cpu_limit > 0)
+            {
+                rlimit cpu_rlimit;
+                cpu_rlimit.rlim_cur = t->cpu_limit;
+                cpu_rlimit.rlim_max = t->cpu_limit + 1;
+                setrlimit(RLIMIT_CPU, &cpu_rlimit);
+            }
+            if (t->mem_limit > 0)
+            {
+                rlimit mem_rlimit;
+                mem_rlimit.rlim_cur = static_cast<rlim_t>(t->mem_limit) * 1024; // 转换为kb
+                mem_rlimit.rlim_max = mem_rlimit.rlim_cur;
+                setrlimit(RLIMIT_AS, &mem_rlimit);
+            }
+            if (t->fsize_limit > 0)
+            {
+                rlimit fsize_rlimit;
+                fsize_rlimit.rlim_cur = static_cast<rlim_t>(t->fsize_limit) * 1024;
+                fsize_rlimit.rlim_max = fsize_rlimit.rlim_cur;
+                setrlimit(RLIMIT_FSIZE, &fsize_rlimit);
+            }
+
+            // 加入cgroup、设置资源限制都需要root，做完之后再降权，附加组一起清空
+            // 直接用系统调用：glibc的setresuid等会通知同一进程的所有线程一起切换，而跳板和父进程共享地址空间
+            if (t->gid >= 0 && (syscall(SYS_setgroups, 0, nullptr) < 0 || syscall(SYS_setresgid, t->gid, t->gid, t->gid) < 0))
+            {
+                t->exec_errno = errno;
+                _exit(127);
+            }
+            if (t->uid >= 0 && syscall(SYS_setresuid, t->uid, t->uid, t->uid) < 0)
+            {
+                t->exec_errno = errno;
+                _exit(127);
+            }
+
+            // seccomp最后安装，之后只剩下exec
+            if (t->seccomp != nullptr &&
+                (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0 ||
+                 prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, t->seccomp) < 0))
+            {
+                t->exec_errno = errno;
+                _exit(127);
+            }
+
+            sigprocmask(SIG_SETMASK, t->child_mask, nullptr);
+            if (t->exe_fd >= 0)
+            {
+                fexecve(t->exe_fd, t->argv, environ);
+            }
+            else
+            {
+                execvp(t->argv[0], t->argv);
+            }
+            t->exec_errno = errno;
+            _exit(127);
+        }
+    };
+}
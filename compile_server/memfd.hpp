@@ -0,0 +1,112 @@
+#pragma once
+
+#include "../comm/log.hpp"
+
+#include <string>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// 内存文件：memfd_create创建的匿名文件，只存在于内存中，没有路径，关闭后自动释放
+// 用于编译和运行时的标准输入输出，避免读写磁盘上的临时文件
+namespace ns_memfd
+{
+    using namespace ns_log;
+
+    class MemFd
+    {
+    public:
+        // 创建内存文件并写入content，读写位置回到开头，失败返回-1
+        static int Create(const char *name, const std::string &content = "")
+        {
+            int fd = memfd_create(name, MFD_CLOEXEC);
+            if (fd < 0)
+            {
+                LOG(ERROR) << "创建内存文件失败: " << name << "\n";
+                return -1;
+            }
+            if (!WriteAll(fd, content) || lseek(fd, 0, SEEK_SET) < 0)
+            {
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        // 创建只读的内存文件：写入content后封存(seal)，之后任何人都不能再修改、截断或者追加
+        // 可以放心地同时交给多个子进程，也可以PROT_READ映射到内存里直接读取，失败返回-1
+        static int CreateSealed(const char *name, const std::string &content)
+        {
+            int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (fd < 0)
+            {
+                LOG(ERROR) << "创建内存文件失败: " << name << "\n";
+                return -1;
+            }
+            if (!WriteAll(fd, content) ||
+                fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+            {
+                LOG(ERROR) << "封存内存文件失败: " << name << "\n";
+                close(fd);
+                return -1;
+            }
+            return fd;
+        }
+
+        // 重新打开内存文件，得到一个独立的读写位置：dup出来的fd和原来的共享读写位置，
+        // 同一份数据同时作为多个子进程的标准输入时，每个子进程都要从头读，只能重新打开
+        // 内容和封存状态是同一份，不复制数据，失败返回-1
+        static int Reopen(int fd, int flags = O_RDONLY)
+        {
+            std::string path = "/proc/self/fd/" + std::to_string(fd);
+            return open(path.c_str(), flags | O_CLOEXEC);
+        }
+
+        // 从头读取内存文件的全部内容
+        static bool ReadAll(int fd, std::string *content)
+        {
+            content->clear();
+            char buffer[4096];
+            off_t offset = 0;
+            while (true)
+            {
+                ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0)
+                {
+                    return false;
+                }
+                if (n == 0)
+                {
+                    return true;
+                }
+                content->append(buffer, n);
+                offset += n;
+            }
+        }
+
+    private:
+        static bool WriteAll(int fd, const std::string &content)
+        {
+            size_t written = 0;
+            while (written < content.size())
+            {
+                ssize_t n = write(fd, content.data() + written, content.size() - written);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0)
+                {
+                    return false;
+                }
+                written += n;
+            }
+            return true;
+        }
+    };
+}
@@ -0,0 +1,390 @@
+#pragma once
+
+#include "compile.hpp"
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
+#include <sstream>
+#include <unordered_map>
+#include <sys/stat.h>
+#include <jsoncpp/json/json.h>
+
+// 预编译头：题目的header.cpp/tail.cpp几乎都包含 <iostream> <string> <vector> <map> <algorithm>
+// 每次编译大部分时间都花在重复解析这些标准库头文件上
+// 这里对每一种不同的开头的 #include <...> 序列(以及编译选项)生成一个pch.h和对应的pch.h.gch
+// 编译提交的代码时加上 -include pch.h，g++会优先使用pch.h.gch；
+// gch过期或者不可用时，g++会自动退化为直接包含pch.h，等价于一次普通的编译
+namespace ns_pch
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_compiler;
+
+    const std::string pch_path = "./pch/";
+    const int64_t pch_retry_ms = 60 * 1000;          // 生成失败之后第一次重试的间隔，之后每失败一次翻倍
+    const int64_t pch_max_retry_ms = 60 * 60 * 1000; // 重试间隔的上限
+
+    // 一次编译使用的预编译头：flags是需要附加的编译参数，为空时普通编译
+    // 编译结束之前要一直持有，持有期间这份预编译头不会被淘汰(删除文件)
+    struct PchLease
+    {
+        std::vector<std::string> flags;
+        std::shared_ptr<void> pin;
+    };
+
+    class PchManager
+    {
+    private:
+        enum class State
+        {
+            BUILDING, // 在后台生成
+            READY,    // 可以使用
+            FAILED,   // 生成失败，到retry_at之前这种头文件集合不再使用预编译头
+        };
+
+        struct Entry
+        {
+            State state = State::BUILDING;
+            std::list<std::string>::iterator lru; // 在lru中的位置
+            uint64_t bytes = 0;                   // gch文件的大小，计入used
+            int failures = 0;                     // 连续失败的次数
+            int64_t retry_at = 0;                 // FAILED时，到这个时间(单调时钟ms)之后再遇到就重新生成
+        };
+
+        struct BuildTask
+        {
+            std::string key;
+            std::string content;
+        };
+
+    public:
+        static PchManager &Instance()
+        {
+            static PchManager pch;
+            return pch;
+        }
+
+        // dir: 预编译头的存放目录 max_headers: 最多记录多少种头文件集合 max_bytes: gch文件总大小的上限
+        // 一份gch有几十MB(<bits/stdc++.h>约80MB)，两个上限防止被构造的include集合占满磁盘，
+        // 超过时淘汰最久没有使用的；生成预编译头由一个后台线程依次完成
+        void Init(const std::string &dir, size_t max_headers, uint64_t max_bytes)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            pch_dir = dir;
+            if (pch_dir.empty() || pch_dir.back() != '/')
+            {
+                pch_dir += "/";
+            }
+            capacity = max_headers;
+            max_total = max_bytes;
+            mkdir(pch_dir.c_str(), 0755);
+            if (!enabled)
+            {
+                std::thread(&PchManager::BuildLoop, this).detach();
+            }
+            enabled = true;
+            LOG(INFO) << "预编译头目录: " << pch_dir << "\n";
+        }
+
+        // 返回编译code使用的预编译头，没有可用的预编译头时flags为空
+        // 第一次遇到某种头文件集合时交给后台线程生成，这次提交先普通编译，不让用户等
+        PchLease Prepare(const std::string &code)
+        {
+            PchLease lease;
+            if (!enabled)
+            {
+                return lease;
+            }
+            std::vector<std::string> headers = LeadingHeaders(code);
+            if (headers.empty())
+            {
+                return lease;
+            }
+            std::string content;
+            for (const auto &header : headers)
+            {
+                content += "#include <" + header + ">\n";
+            }
+            std::string key = Key(content);
+            std::string header = pch_dir + key + "/pch.h";
+
+            std::lock_guard<std::mutex> lock(mtx);
+            auto iter = entries.find(key);
+            if (iter != entries.end())
+            {
+                std::shared_ptr<Entry> entry = iter->second;
+                lru.splice(lru.begin(), lru, entry->lru);
+                if (entry->state == State::READY && FileUtil::IsFileExists(header + ".gch"))
+                {
+                    ++hits;
+                    lease.flags = {"-include", header};
+                    lease.pin = entry;
+                    return lease;
+                }
+                if (entry->state == State::READY ||
+                    (entry->state == State::FAILED && TimeUtil::GetMonotonicMs() >= entry->retry_at))
+                {
+                    // gch文件丢失，或者失败之后已经过了退避时间(失败可能只是当时机器太忙、磁盘满了)，重新生成
+                    entry->state = State::BUILDING;
+                    EnqueueLocked(key, content);
+                }
+                // 正在生成或者还在退避就先普通编译
+                ++bypass;
+                return lease;
+            }
+            if (entries.size() >= capacity && !EvictLocked())
+            {
+                ++bypass;
+                return lease;
+            }
+            std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+            lru.push_front(key);
+            entry->lru = lru.begin();
+            entries[key] = entry;
+            EnqueueLocked(key, content);
+            ++bypass;
+            return lease;
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["headers"] = Json::UInt64(entries.size());
+            stats["bytes"] = Json::UInt64(used);
+            stats["max_bytes"] = Json::UInt64(max_total);
+            stats["queued"] = Json::UInt64(queue.size());
+            stats["hits"] = Json::UInt64(hits);
+            stats["builds"] = Json::UInt64(builds);
+            stats["failures"] = Json::UInt64(failures);
+            stats["evictions"] = Json::UInt64(evictions);
+            stats["bypass"] = Json::UInt64(bypass);
+            return stats;
+        }
+
+    private:
+        PchManager() = default;
+        PchManager(const PchManager &) = delete;
+        PchManager &operator=(const PchManager &) = delete;
+
+        void EnqueueLocked(const std::string &key, const std::string &content)
+        {
+            queue.push_back({key, content});
+            cv.notify_one();
+        }
+
+        // 淘汰最久没有使用的一份：正在生成的和正在被编译使用的(还有PchLease持有)跳过
+        // 没有可以淘汰的时返回false
+        bool EvictLocked()
+        {
+            for (auto iter = lru.rbegin(); iter != lru.rend(); ++iter)
+            {
+                std::shared_ptr<Entry> &entry = entries[*iter];
+                if (entry->state == State::BUILDING || entry.use_count() > 1)
+                {
+                    continue;
+                }
+                used -= entry->bytes;
+                std::string dir = pch_dir + *iter + "/";
+                unlink((dir + "pch.h.gch").c_str());
+                unlink((dir + "pch.h").c_str());
+                unlink((dir + "pch.err").c_str());
+                rmdir(dir.c_str());
+                entries.erase(*iter);
+                lru.erase(std::next(iter).base());
+                ++evictions;
+                return true;
+            }
+            return false;
+        }
+
+        // 后台线程：依次生成排队的预编译头
+        void BuildLoop()
+        {
+            while (true)
+            {
+                BuildTask task;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [this]()
+                            { return !queue.empty(); });
+                    task = std::move(queue.front());
+                    queue.pop_front();
+                }
+                std::string dir = pch_dir + task.key + "/";
+                bool success = Build(dir, dir + "pch.h", dir + "pch.h.gch", task.content);
+                struct stat st;
+                uint64_t bytes = success && stat((dir + "pch.h.gch").c_str(), &st) == 0 ? st.st_size : 0;
+                std::lock_guard<std::mutex> lock(mtx);
+                // 生成期间不会被淘汰，表项一定还在
+                std::shared_ptr<Entry> entry = entries[task.key];
+                used = used - entry->bytes + bytes;
+                entry->bytes = bytes;
+                if (success)
+                {
+                    entry->state = State::READY;
+                    entry->failures = 0;
+                    ++builds;
+                }
+                else
+                {
+                    entry->state = State::FAILED;
+                    int64_t backoff = pch_retry_ms << std::min(entry->failures, 6);
+                    entry->retry_at = TimeUtil::GetMonotonicMs() + std::min(backoff, pch_max_retry_ms);
+                    ++entry->failures;
+                    ++failures;
+                }
+                entry.reset();
+                while (used > max_total && EvictLocked())
+                {
+                }
+            }
+        }
+
+        // 代码开头连续的 #include <xxx>，中间只允许空行和注释，遇到别的预处理指令或者代码就停止
+        // 预编译头相当于把这些头文件提前到代码的最前面，只有它们本来就在最前面时才不改变代码的含义：
+        // 之前的 #define _GLIBCXX_DEBUG、#if 0 之类会影响头文件的内容，不能提前
+        // 只接受形如标准库的头文件名，引号包含的头文件依赖用户代码，不能预编译
+        static std::vector<std::string> LeadingHeaders(const std::string &code)
+        {
+            std::vector<std::string> headers;
+            std::istringstream in(code);
+            std::string line;
+            bool in_comment = false;
+            while (std::getline(in, line))
+            {
+                if (!line.empty() && line.back() == '\r')
+                {
+                    line.pop_back();
+                }
+                if (!line.empty() && line.back() == '\\')
+                {
+                    // 续行会把下一行拼进来，不再往下看
+                    break;
+                }
+                // 去掉注释，剩下的部分要么为空，要么是一条 #include <xxx>
+                std::string text;
+                for (size_t i = 0; i < line.size(); ++i)
+                {
+                    if (in_comment)
+                    {
+                        if (line.compare(i, 2, "*/") == 0)
+                        {
+                            in_comment = false;
+                            ++i;
+                        }
+                    }
+                    else if (line.compare(i, 2, "/*") == 0)
+                    {
+                        in_comment = true;
+                        text.push_back(' ');
+                        ++i;
+                    }
+                    else if (line.compare(i, 2, "//") == 0)
+                    {
+                        break;
+                    }
+                    else
+                    {
+                        text.push_back(line[i]);
+                    }
+                }
+                size_t pos = text.find_first_not_of(" \t");
+                if (pos == std::string::npos)
+                {
+                    continue;
+                }
+                if (text[pos] != '#')
+                {
+                    break;
+                }
+                pos = text.find_first_not_of(" \t", pos + 1);
+                if (pos == std::string::npos || text.compare(pos, 7, "include") != 0)
+                {
+                    break;
+                }
+                size_t begin = text.find_first_not_of(" \t", pos + 7);
+                size_t end = begin == std::string::npos ? std::string::npos : text.find('>', begin);
+                if (end == std::string::npos || text[begin] != '<' ||
+                    text.find_first_not_of(" \t", end + 1) != std::string::npos)
+                {
+                    break;
+                }
+                std::string name = text.substr(begin + 1, end - begin - 1);
+                bool valid = !name.empty() && name.find("..") == std::string::npos && name[0] != '/';
+                for (char c : name)
+                {
+                    valid = valid && (isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '/' || c == '.' || c == '+' || c == '-');
+                }
+                if (!valid)
+                {
+                    break;
+                }
+                // 保持原来的顺序，重复的只保留第一次
+                if (std::find(headers.begin(), headers.end(), name) == headers.end())
+                {
+                    headers.push_back(name);
+                }
+            }
+            return headers;
+        }
+
+        static std::string Key(const std::string &content)
+        {
+            std::string material;
+            for (const auto &flag : Compiler::Flags())
+            {
+                material += flag;
+                material.push_back('\0');
+            }
+            material += content;
+            return HashUtil::Sha256(material);
+        }
+
+        static bool Build(const std::string &dir, const std::string &header, const std::string &gch, const std::string &content)
+        {
+            mkdir(dir.c_str(), 0755);
+            std::string err_file = dir + "pch.err";
+            std::string tmp_gch = gch + ".tmp";
+            if (!FileUtil::WriteFile(header, content) ||
+                !Compiler::CompileHeader(header, tmp_gch, err_file) ||
+                rename(tmp_gch.c_str(), gch.c_str()) != 0)
+            {
+                unlink(tmp_gch.c_str());
+                LOG(WARNING) << "生成预编译头失败: " << header << "\n";
+                return false;
+            }
+            unlink(err_file.c_str());
+            LOG(INFO) << "生成预编译头成功: " << gch << "\n";
+            return true;
+        }
+
+    private:
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool enabled = false;
+        std::string pch_dir = pch_path;
+        size_t capacity = 0;
+        uint64_t max_total = 0; // gch文件总大小的上限
+        uint64_t used = 0;      // 所有gch文件合计的大小
+        std::unordered_map<std::string, std::shared_ptr<Entry>> entries; // key -> 表项
+        std::list<std::string> lru;                                      // 最近使用的在前面
+        std::deque<BuildTask> queue;                                     // 等待生成的预编译头
+        uint64_t hits = 0;
+        uint64_t builds = 0;
+        uint64_t failures = 0;
+        uint64_t evictions = 0;
+        uint64_t bypass = 0;
+    };
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <vector>
+#include <atomic>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <jsoncpp/json/json.h>
+
+// 按指令数限制运行时间：RLIMIT_CPU只精确到秒，又受机器快慢和负载(缓存、超线程的争用)影响
+// 开启后用perf_event_open统计用户程序主线程在用户态执行的指令数，
+// 计数到达上限时内核直接向整个进程组发SIGKILL，退出后按指令数判定是否超时，结果和机器负载无关
+// 题目的限制仍然是cpu_limit(秒)，按参考机器的"每毫秒指令数"换算成指令数：同一个程序的指令数和机器快慢无关，
+// 所以集群里每台机器都要用同一个值(instructions_per_ms，bench speed在参考机器上测得)，判定结果才一致
+// 启动时校准(instructions_per_ms=0)测的是本机，只适合单机部署；多机时按速度系数折算成参考机器的值，只是近似
+// 溢出通知(PERF_EVENT_IOC_REFRESH)不支持继承的计数器，其他线程和子进程不计数，由放宽后的RLIMIT_CPU兜底
+// 计数器在子进程创建之后才附加上去，之前的动态链接等启动过程不计入
+// 需要CPU的硬件性能计数器，虚拟机里往往没有，不可用时退回到CPU时间
+namespace ns_perf
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    class InstructionCounter
+    {
+    public:
+        static InstructionCounter &Instance()
+        {
+            static InstructionCounter counter;
+            return counter;
+        }
+
+        // per_ms: 参考机器上每毫秒CPU时间折合的指令数，集群里所有机器都应该配置同一个值
+        // 为0时在本机运行一段基准程序校准，再乘以速度系数speed_factor(慢的机器大于1)折算成参考机器的值
+        bool Init(int64_t per_ms, double speed_factor)
+        {
+            int fd = Open(0, 0);
+            if (fd < 0)
+            {
+                LOG(WARNING) << "无法统计指令数(" << strerror(errno) << ")，按CPU时间限制运行时间" << "\n";
+                return false;
+            }
+            if (per_ms <= 0)
+            {
+                calibrated_per_ms = Calibrate(fd);
+                per_ms = static_cast<int64_t>(calibrated_per_ms * speed_factor);
+                LOG(WARNING) << "每毫秒指令数由本机校准: " << calibrated_per_ms << "，速度系数: " << speed_factor
+                             << "，多机部署时应该为所有机器配置参考机器的instructions_per_ms" << "\n";
+            }
+            close(fd);
+            if (per_ms <= 0)
+            {
+                LOG(WARNING) << "校准每毫秒指令数失败，按CPU时间限制运行时间" << "\n";
+                return false;
+            }
+            instructions_per_ms = per_ms;
+            enabled = true;
+            LOG(INFO) << "按指令数限制运行时间，每毫秒指令数: " << per_ms << "\n";
+            return true;
+        }
+
+        // 在本机测量每毫秒指令数，计数器不可用时返回0；bench speed在参考机器上用它得到instructions_per_ms
+        static int64_t Measure()
+        {
+            int fd = Open(0, 0);
+            if (fd < 0)
+            {
+                return 0;
+            }
+            int64_t per_ms = Calibrate(fd);
+            close(fd);
+            return per_ms;
+        }
+
+        bool Enabled() const
+        {
+            return enabled;
+        }
+
+        int64_t PerMs() const
+        {
+            return instructions_per_ms;
+        }
+
+        // cpu_limit(秒)折合的指令数，没有开启时返回0
+        int64_t Limit(int cpu_limit) const
+        {
+            return enabled && cpu_limit > 0 ? static_cast<int64_t>(cpu_limit) * 1000 * instructions_per_ms : 0;
+        }
+
+        // 指令数折合的毫秒数
+        int64_t ToMs(int64_t instructions) const
+        {
+            return enabled ? instructions / instructions_per_ms : 0;
+        }
+
+        // 在已经创建的子进程上附加计数器，计数到达limit时向以pid为组长的进程组发SIGKILL
+        // 返回计数器的fd，失败(比如子进程已经退出)返回-1
+        int Attach(pid_t pid, int64_t limit)
+        {
+            int fd = Open(pid, limit);
+            if (fd < 0)
+            {
+                ++attach_failures;
+                return -1;
+            }
+            // 溢出时的通知：O_ASYNC + F_SETSIG把SIGIO换成SIGKILL，发给整个进程组
+            f_owner_ex owner;
+            owner.type = F_OWNER_PGRP;
+            owner.pid = pid;
+            if (fcntl(fd, F_SETOWN_EX, &owner) < 0 || fcntl(fd, F_SETSIG, SIGKILL) < 0 ||
+                fcntl(fd, F_SETFL, O_ASYNC) < 0 || ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) < 0)
+            {
+                LOG(WARNING) << "设置指令数上限失败: " << strerror(errno) << "\n";
+                close(fd);
+                ++attach_failures;
+                return -1;
+            }
+            ++attached;
+            return fd;
+        }
+
+        // 读取计数器的指令数，子进程退出之后读到的就是总数，失败返回-1
+        static int64_t Read(int fd)
+        {
+            uint64_t value = 0;
+            if (read(fd, &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value)))
+            {
+                return -1;
+            }
+            return static_cast<int64_t>(value);
+        }
+
+        Json::Value Stats()
+        {
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["instructions_per_ms"] = Json::Int64(instructions_per_ms);
+            stats["calibrated_per_ms"] = Json::Int64(calibrated_per_ms); // 0表示使用配置的参考值
+            stats["attached"] = Json::UInt64(attached);
+            stats["attach_failures"] = Json::UInt64(attach_failures);
+            return stats;
+        }
+
+    private:
+        InstructionCounter() = default;
+        InstructionCounter(const InstructionCounter &) = delete;
+        InstructionCounter &operator=(const InstructionCounter &) = delete;
+
+        // pid为0表示当前线程；period大于0时每period条指令溢出一次
+        static int Open(pid_t pid, int64_t period)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            if (period > 0)
+            {
+                attr.sample_period = static_cast<uint64_t>(period);
+                attr.wakeup_events = 1;
+                attr.disabled = 1; // 由PERF_EVENT_IOC_REFRESH开启，溢出一次后停止
+            }
+            return static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        }
+
+        static int64_t ThreadCpuNs()
+        {
+            timespec ts;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        }
+
+        // 校准：整数运算和随机访存混合的基准程序运行大约200ms，指令数除以CPU时间
+        static int64_t Calibrate(int fd)
+        {
+            std::vector<uint32_t> table(1 << 20);
+            for (size_t i = 0; i < table.size(); ++i)
+            {
+                table[i] = static_cast<uint32_t>(i * 2654435761u);
+            }
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            int64_t begin = ThreadCpuNs();
+            volatile uint32_t sink = 0;
+            uint32_t x = 1;
+            while (ThreadCpuNs() - begin < 200 * 1000000LL)
+            {
+                for (int i = 0; i < 100000; ++i)
+                {
+                    x = x * 1103515245u + 12345u;
+                    x ^= table[x & (table.size() - 1)];
+                }
+                sink = sink + x;
+            }
+            int64_t cpu_ns = ThreadCpuNs() - begin;
+            int64_t instructions = Read(fd);
+            if (instructions <= 0 || cpu_ns <= 0)
+            {
+                return 0;
+            }
+            return instructions * 1000000 / cpu_ns;
+        }
+
+    private:
+        bool enabled = false;
+        int64_t instructions_per_ms = 0; // 参考机器的值，换算指令数上限用
+        int64_t calibrated_per_ms = 0;   // 本机校准的值
+        std::atomic<uint64_t> attached{0};
+        std::atomic<uint64_t> attach_failures{0};
+    };
+}
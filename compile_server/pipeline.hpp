@@ -0,0 +1,283 @@
+#pragma once
+
+#include "compile_run.hpp"
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <iostream>
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <jsoncpp/json/json.h>
+
+// 判题流水线：编译阶段和运行阶段分别由各自大小的线程池执行
+// 编译吃内存和IO，运行要计时、需要安静的CPU，分开之后第N+1个任务的编译可以和第N个任务的运行重叠，
+// 又不会有过多的g++挤占正在计时的用户程序
+namespace ns_pipeline
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_compile_and_run;
+
+    // 固定线程数的线程池，任务按FIFO执行
+    class WorkerPool
+    {
+    public:
+        WorkerPool() = default;
+        ~WorkerPool()
+        {
+            Stop();
+        }
+
+        void Start(const std::string &pool_name, size_t workers)
+        {
+            name = pool_name;
+            for (size_t i = 0; i < workers; ++i)
+            {
+                threads.emplace_back([this]()
+                                     { Loop(); });
+            }
+            LOG(INFO) << name << " 线程池启动，线程数: " << workers << "\n";
+        }
+
+        void Stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            cv.notify_all();
+            for (auto &t : threads)
+            {
+                t.join();
+            }
+            threads.clear();
+        }
+
+        void Push(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                tasks.push_back({std::move(task), TimeUtil::GetMonotonicMs()});
+            }
+            cv.notify_one();
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["workers"] = Json::UInt64(threads.size());
+            stats["queued"] = Json::UInt64(tasks.size());
+            stats["active"] = Json::UInt64(active);
+            stats["completed"] = Json::UInt64(completed);
+            stats["queue_wait_ms"] = Json::UInt64(wait_ms);
+            return stats;
+        }
+
+    private:
+        struct Task
+        {
+            std::function<void()> func;
+            int64_t enqueue_ms;
+        };
+
+        void Loop()
+        {
+            while (true)
+            {
+                Task task;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [this]()
+                            { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                    {
+                        return;
+                    }
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                    ++active;
+                    wait_ms += TimeUtil::GetMonotonicMs() - task.enqueue_ms;
+                }
+                task.func();
+                std::lock_guard<std::mutex> lock(mtx);
+                --active;
+                ++completed;
+            }
+        }
+
+    private:
+        std::string name;
+        std::vector<std::thread> threads;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<Task> tasks;
+        bool stopping = false;
+        size_t active = 0;
+        uint64_t completed = 0;
+        uint64_t wait_ms = 0;
+    };
+
+    class Pipeline
+    {
+    public:
+        static Pipeline &Instance()
+        {
+            static Pipeline pipeline;
+            return pipeline;
+        }
+
+        // run_concurrency: 同时运行的用户程序个数上限
+        // reaper启动时运行线程只负责创建子进程，不等待它退出，少量的运行线程就可以驱动大量同时运行的程序
+        void Init(size_t compile_workers, size_t run_workers, size_t run_concurrency)
+        {
+            compile_pool.Start("compile", compile_workers > 0 ? compile_workers : 1);
+            run_pool.Start("run", run_workers > 0 ? run_workers : 1);
+            run_limit = run_concurrency > 0 ? run_concurrency : 1;
+            enabled = true;
+        }
+
+        bool Enabled() const
+        {
+            return enabled;
+        }
+
+        // 把判题任务送入流水线，阻塞直到得到结果，progress同CompileAndRun::Start
+        void Submit(const std::string &in_json, std::string *out_json, const JudgeProgress &progress = nullptr)
+        {
+            auto job = std::make_shared<Job>();
+            CompileAndRun::Parse(in_json, job.get());
+            job->progress = progress;
+            // 用户程序退出后的收尾(检查输出的结果、推送进度、汇总)在运行线程里执行，reaper线程只负责等待
+            job->post = [this](std::function<void()> task)
+            {
+                run_pool.Push(std::move(task));
+            };
+
+            auto done = std::make_shared<std::promise<void>>();
+            std::future<void> finished = done->get_future();
+            compile_pool.Push([this, job, done]()
+            {
+                if (!CompileAndRun::CompileStage(*job))
+                {
+                    done->set_value();
+                    return;
+                }
+                if (!job->tests.empty())
+                {
+                    PushCases(job, done);
+                    return;
+                }
+                PushRun([this, job, done]()
+                {
+                    CompileAndRun::RunStageAsync(*job, [this, job, done]()
+                    {
+                        ReleaseRun();
+                        done->set_value();
+                    });
+                });
+            });
+            finished.wait();
+            CompileAndRun::Finish(*job, out_json);
+        }
+
+        Json::Value Stats()
+        {
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["compile"] = compile_pool.Stats();
+            stats["run"] = run_pool.Stats();
+            std::lock_guard<std::mutex> lock(run_mtx);
+            stats["run"]["running"] = Json::UInt64(run_inflight);
+            stats["run"]["waiting"] = Json::UInt64(run_waiting.size());
+            stats["run"]["max_running"] = Json::UInt64(run_limit);
+            return stats;
+        }
+
+    private:
+        Pipeline() = default;
+        Pipeline(const Pipeline &) = delete;
+        Pipeline &operator=(const Pipeline &) = delete;
+
+        // 每个测试用例是一个单独的运行任务，各自占用一个运行名额，最后一个用例结束时任务完成
+        // 多个用例因此可以在不同的核上同时运行，也不会超过run_concurrency
+        void PushCases(const std::shared_ptr<Job> &job, const std::shared_ptr<std::promise<void>> &done)
+        {
+            auto remaining = std::make_shared<std::atomic<size_t>>(job->tests.size());
+            for (size_t i = 0; i < job->tests.size(); ++i)
+            {
+                PushRun([this, job, done, remaining, i]()
+                {
+                    // fail_fast的任务已经有结果时不再运行，马上让出运行名额
+                    if (CompileAndRun::SkipCase(*job, i))
+                    {
+                        ReleaseRun();
+                        if (--*remaining == 0)
+                        {
+                            done->set_value();
+                        }
+                        return;
+                    }
+                    CompileAndRun::RunCaseAsync(*job, i, [this, done, remaining]()
+                    {
+                        ReleaseRun();
+                        if (--*remaining == 0)
+                        {
+                            done->set_value();
+                        }
+                    });
+                });
+            }
+        }
+
+        // 运行任务先在这里排队等运行名额，拿到名额之后才交给运行线程，运行线程从不阻塞在等名额上
+        // 否则所有运行线程都在等名额时，归还名额的收尾任务(见Job::post)排在线程池里永远轮不到
+        void PushRun(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(run_mtx);
+                if (run_inflight >= run_limit)
+                {
+                    run_waiting.push_back(std::move(task));
+                    return;
+                }
+                ++run_inflight;
+            }
+            run_pool.Push(std::move(task));
+        }
+
+        // 运行名额直接交给排在最前面的任务
+        void ReleaseRun()
+        {
+            std::function<void()> next;
+            {
+                std::lock_guard<std::mutex> lock(run_mtx);
+                if (run_waiting.empty())
+                {
+                    --run_inflight;
+                    return;
+                }
+                next = std::move(run_waiting.front());
+                run_waiting.pop_front();
+            }
+            run_pool.Push(std::move(next));
+        }
+
+    private:
+        bool enabled = false;
+        WorkerPool compile_pool;
+        WorkerPool run_pool;
+        std::mutex run_mtx;
+        std::deque<std::function<void()>> run_waiting; // 等待运行名额的任务
+        size_t run_inflight = 0;
+        size_t run_limit = 1;
+    };
+}
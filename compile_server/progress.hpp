@@ -0,0 +1,70 @@
+#pragma once
+
+#include "../comm/util.hpp"
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <jsoncpp/json/json.h>
+
+// 判题进度的推送(/compile_and_run/stream)：编译线程、运行线程和reaper线程只把事件放进队列，
+// 由HTTP线程取出来写给oj_server，网络写得慢时不会拖住reaper线程，影响其他程序的计时
+namespace ns_progress
+{
+    using namespace ns_util;
+
+    class ProgressStream
+    {
+    public:
+        // 任意线程都可以调用
+        void Push(const std::string &event, const Json::Value &data)
+        {
+            Json::FastWriter writer;
+            std::string frame = SseUtil::Frame(event, writer.write(data));
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                frames.push_back(std::move(frame));
+            }
+            cv.notify_one();
+        }
+
+        // 判题结束，result是最后一个事件(内容同/compile_and_run的应答)
+        void Close(const std::string &result)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                frames.push_back(SseUtil::Frame("result", result));
+                closed = true;
+            }
+            cv.notify_one();
+        }
+
+        // 取出下一帧，最多等待wait_ms，超时时返回保持连接的注释
+        // 返回false：已经结束并且所有帧都已经取出
+        bool Pop(int64_t wait_ms, std::string *frame)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (!cv.wait_for(lock, std::chrono::milliseconds(wait_ms), [this]()
+                             { return closed || !frames.empty(); }))
+            {
+                *frame = ": keepalive\n\n";
+                return true;
+            }
+            if (frames.empty())
+            {
+                return false;
+            }
+            *frame = std::move(frames.front());
+            frames.pop_front();
+            return true;
+        }
+
+    private:
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::string> frames;
+        bool closed = false;
+    };
+}
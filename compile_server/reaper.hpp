@@ -0,0 +1,607 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+#include "launcher.hpp"
+#include "zygote.hpp"
+#include "capture.hpp"
+#include "perf.hpp"
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <jsoncpp/json/json.h>
+
+// 集中回收子进程：一个reaper线程用epoll同时等待所有子进程退出，退出后调用回调
+// 自己创建的子进程等待它的pidfd，zygote创建的子进程等待zygote的应答socket(收到EXITED时可读)
+// 墙上时间也在这个线程里计时，到期杀掉子进程的进程组，随后照常等待它退出
+// 子进程的输出管道(见capture.hpp)也交给这个线程读取，输出超过上限时同样杀掉进程组
+// 这样请求线程不需要阻塞在waitpid上，少量线程就可以同时驱动大量的子进程
+namespace ns_reaper
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_launcher;
+    using namespace ns_zygote;
+    using namespace ns_capture;
+    using namespace ns_perf;
+
+    // zygote创建的子进程超时被杀掉之后，最多再等这么久它的退出状态
+    const int64_t zygote_grace_ms = 1000;
+
+    // 一组可以一起取消的子进程，比如同一个任务的所有测试用例
+    class CancelGroup
+    {
+    public:
+        // 杀掉组里所有还在运行的子进程(整个进程组)，之后加入的子进程立即被杀掉
+        void Cancel()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            cancelled = true;
+            for (pid_t pid : pids)
+            {
+                Launcher::KillGroup(pid);
+            }
+        }
+
+        bool Cancelled()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return cancelled;
+        }
+
+    private:
+        friend class Reaper;
+
+        // 返回值：false表示已经取消，子进程被立即杀掉
+        bool Add(pid_t pid)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (cancelled)
+            {
+                Launcher::KillGroup(pid);
+                return false;
+            }
+            pids.insert(pid);
+            return true;
+        }
+
+        // 子进程退出、回收之前调用，之后Cancel不会再杀这个pid
+        void Remove(pid_t pid)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            pids.erase(pid);
+        }
+
+    private:
+        std::mutex mtx;
+        bool cancelled = false;
+        std::unordered_set<pid_t> pids;
+    };
+
+    class Reaper
+    {
+    public:
+        // 子进程退出后在reaper线程里调用，回调里不能做耗时的事情
+        typedef std::function<void(const ExitInfo &)> Callback;
+
+    private:
+        // 一个正在等待退出的子进程
+        struct Watch
+        {
+            int fd;           // pidfd或者zygote的应答socket
+            pid_t pid;
+            bool from_zygote; // 退出状态需要从zygote的应答socket读取
+            int64_t start;    // 创建的时刻(单调时钟ms)
+            int64_t deadline; // 墙上时间的截止时刻(单调时钟ms)，0表示不限制
+            bool wall_timeout;
+            std::shared_ptr<CancelGroup> cancel;    // 可以为空
+            std::shared_ptr<OutputCapture> capture; // 可以为空
+            bool output_killed;                     // 已经因为输出超过上限杀掉了进程组
+            int perf_fd;                            // 指令计数器，-1表示不统计
+            int64_t instruction_limit;
+            Callback done;
+        };
+
+    public:
+        static Reaper &Instance()
+        {
+            static Reaper reaper;
+            return reaper;
+        }
+
+        // 启动reaper线程，zygote要在它之前启动
+        bool Start()
+        {
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (epoll_fd < 0 || wake_fd < 0)
+            {
+                LOG(ERROR) << "创建reaper失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN;
+            ev.data.fd = wake_fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+            std::thread(&Reaper::Loop, this).detach();
+            running = true;
+            LOG(INFO) << "reaper线程启动成功" << "\n";
+            return true;
+        }
+
+        bool Running() const
+        {
+            return running;
+        }
+
+        // 创建子进程，不等待它退出，退出后在reaper线程里调用done
+        // 优先交给zygote创建，zygote不可用时自己通过Launcher创建
+        // sandbox: 不为nullptr时只能通过这个沙箱zygote创建，失败也不退回
+        // cancel: 不为空时子进程加入这个取消组，取消时被杀掉，退出信息中的cancelled为true
+        // capture: 不为空时req的stdout_fd/stderr_fd是它的写端，子进程运行期间读取输出，退出信息中有output_exceeded
+        // 返回值：false表示创建失败，done不会被调用
+        bool SpawnAsync(const SpawnRequest &req, Callback done, Zygote *sandbox = nullptr,
+                        std::shared_ptr<CancelGroup> cancel = nullptr, std::shared_ptr<OutputCapture> capture = nullptr)
+        {
+            std::unique_ptr<Watch> watch(new Watch());
+            watch->cancel = std::move(cancel);
+            watch->capture = std::move(capture);
+            watch->done = std::move(done);
+            if (!Create(req, sandbox, watch.get()))
+            {
+                return false;
+            }
+            Add(std::move(watch));
+            return true;
+        }
+
+        // 创建子进程并阻塞等待它退出，reaper没有启动时在当前线程里等待
+        // capture: 同SpawnAsync
+        // 返回值：true表示子进程已经退出，info中是退出信息；false表示创建失败
+        bool SpawnAndWait(const SpawnRequest &req, ExitInfo *info, Zygote *sandbox = nullptr,
+                          std::shared_ptr<OutputCapture> capture = nullptr)
+        {
+            if (!running && capture)
+            {
+                // 子进程写满管道后会阻塞，等待的同时要读取输出
+                Watch watch;
+                watch.capture = std::move(capture);
+                if (!Create(req, sandbox, &watch))
+                {
+                    return false;
+                }
+                WaitInline(watch, info);
+                return true;
+            }
+            if (!running && sandbox != nullptr)
+            {
+                return sandbox->Spawn(req, info);
+            }
+            if (!running)
+            {
+                if (Zygote::Instance().Available())
+                {
+                    if (Zygote::Instance().Spawn(req, info))
+                    {
+                        return true;
+                    }
+                    LOG(WARNING) << "zygote不可用，编译服务自己创建子进程" << "\n";
+                }
+                return Launcher::SpawnAndWait(req, info);
+            }
+            auto exited = std::make_shared<std::promise<ExitInfo>>();
+            std::future<ExitInfo> result = exited->get_future();
+            if (!SpawnAsync(req, [exited](const ExitInfo &exit_info)
+                            { exited->set_value(exit_info); }, sandbox, nullptr, capture))
+            {
+                return false;
+            }
+            *info = result.get();
+            return true;
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["running"] = running;
+            stats["watching"] = Json::UInt64(watches.size());
+            stats["reaped"] = Json::UInt64(reaped);
+            stats["wall_timeouts"] = Json::UInt64(wall_timeouts);
+            stats["cancelled"] = Json::UInt64(cancelled);
+            stats["output_exceeded"] = Json::UInt64(output_exceeded);
+            return stats;
+        }
+
+    private:
+        Reaper() = default;
+        Reaper(const Reaper &) = delete;
+        Reaper &operator=(const Reaper &) = delete;
+
+        // 创建子进程，填好watch中除了回调以外的部分
+        // 优先交给zygote创建，zygote不可用时自己通过Launcher创建；sandbox不为nullptr时只能通过它创建
+        bool Create(const SpawnRequest &req, Zygote *sandbox, Watch *watch)
+        {
+            watch->fd = -1;
+            watch->pid = -1;
+            watch->from_zygote = false;
+            watch->start = TimeUtil::GetMonotonicMs();
+            watch->deadline = req.wall_limit > 0 ? watch->start + req.wall_limit : 0;
+            watch->wall_timeout = false;
+            watch->output_killed = false;
+            watch->perf_fd = -1;
+            watch->instruction_limit = req.instruction_limit;
+
+            if (sandbox != nullptr)
+            {
+                watch->fd = sandbox->Launch(req, &watch->pid);
+                if (watch->fd < 0)
+                {
+                    LOG(ERROR) << "沙箱创建子进程失败" << "\n";
+                    return false;
+                }
+                watch->from_zygote = true;
+            }
+            else if (Zygote::Instance().Available())
+            {
+                watch->fd = Zygote::Instance().Launch(req, &watch->pid);
+                watch->from_zygote = watch->fd >= 0;
+                if (watch->fd < 0)
+                {
+                    LOG(WARNING) << "zygote不可用，编译服务自己创建子进程" << "\n";
+                }
+            }
+            if (watch->fd < 0)
+            {
+                watch->pid = Launcher::Spawn(req);
+                if (watch->pid < 0)
+                {
+                    LOG(ERROR) << "创建子进程失败: " << req.argv[0] << " " << strerror(errno) << "\n";
+                    return false;
+                }
+                watch->fd = Launcher::OpenPidFd(watch->pid);
+                if (watch->fd < 0)
+                {
+                    // 没有pidfd就没法交给epoll，杀掉子进程，当作创建失败
+                    LOG(ERROR) << "pidfd_open失败: " << strerror(errno) << "\n";
+                    Launcher::KillGroup(watch->pid);
+                    waitpid(watch->pid, nullptr, 0);
+                    return false;
+                }
+            }
+            if (req.instruction_limit > 0)
+            {
+                watch->perf_fd = InstructionCounter::Instance().Attach(watch->pid, req.instruction_limit);
+            }
+            // 子进程已经拿到了写端
+            if (watch->capture)
+            {
+                watch->capture->CloseWriteEnds();
+            }
+            if (watch->cancel)
+            {
+                watch->cancel->Add(watch->pid);
+            }
+            return true;
+        }
+
+        // 没有reaper时在当前线程里等待子进程退出，同时读取输出管道、计算墙上时间
+        void WaitInline(Watch &watch, ExitInfo *info)
+        {
+            OutputCapture &capture = *watch.capture;
+            while (true)
+            {
+                pollfd pfds[3];
+                pfds[0].fd = watch.fd;
+                pfds[1].fd = capture.ReadFd(OutputCapture::STDOUT);
+                pfds[2].fd = capture.ReadFd(OutputCapture::STDERR);
+                for (pollfd &pfd : pfds)
+                {
+                    pfd.events = POLLIN;
+                    pfd.revents = 0;
+                }
+                int timeout = -1;
+                if (watch.deadline > 0)
+                {
+                    timeout = static_cast<int>(std::max<int64_t>(0, watch.deadline - TimeUtil::GetMonotonicMs()));
+                }
+                int n = poll(pfds, 3, timeout);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                // 按时间判断是否到了截止时刻：一直有输出的程序让poll每次都立即返回
+                bool expired = watch.deadline > 0 && TimeUtil::GetMonotonicMs() >= watch.deadline;
+                if (expired && watch.wall_timeout)
+                {
+                    // 同NextTimeout：zygote迟迟不回报退出状态，按被杀掉回收
+                    shutdown(watch.fd, SHUT_RDWR);
+                    watch.deadline = 0;
+                    continue;
+                }
+                if (expired)
+                {
+                    // 还没有回收，pid不会被复用
+                    watch.wall_timeout = true;
+                    Launcher::KillGroup(watch.pid);
+                    watch.deadline = watch.from_zygote ? TimeUtil::GetMonotonicMs() + zygote_grace_ms : 0;
+                    continue;
+                }
+                for (int i = 0; i < 2; ++i)
+                {
+                    OutputCapture::Stream stream = static_cast<OutputCapture::Stream>(i);
+                    if (pfds[i + 1].revents != 0 && !capture.Drain(stream, OutputCapture::drain_chunk))
+                    {
+                        capture.Close(stream);
+                    }
+                }
+                CheckOutput(watch);
+                if (n < 0 || pfds[0].revents != 0)
+                {
+                    break;
+                }
+            }
+            Reap(watch, info);
+        }
+
+        // 输出超过上限时杀掉进程组，之后照常等待它退出
+        static bool CheckOutput(Watch &watch)
+        {
+            if (watch.output_killed || !watch.capture->Exceeded())
+            {
+                return false;
+            }
+            watch.output_killed = true;
+            Launcher::KillGroup(watch.pid);
+            return true;
+        }
+
+        void Add(std::unique_ptr<Watch> watch)
+        {
+            int fd = watch->fd;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.fd = fd;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+                if (watch->capture)
+                {
+                    for (int i = 0; i < 2; ++i)
+                    {
+                        OutputCapture::Stream stream = static_cast<OutputCapture::Stream>(i);
+                        int pipe_fd = watch->capture->ReadFd(stream);
+                        ev.data.fd = pipe_fd;
+                        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fd, &ev);
+                        pipes[pipe_fd] = std::make_pair(watch.get(), stream);
+                    }
+                }
+                watches[fd] = std::move(watch);
+            }
+            // 唤醒reaper线程重新计算最近的截止时刻
+            uint64_t one = 1;
+            ssize_t n = write(wake_fd, &one, sizeof(one));
+            (void)n;
+        }
+
+        // 距离最近一个截止时刻的毫秒数，-1表示没有截止时刻；顺便杀掉已经超时的子进程
+        int NextTimeout()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            int64_t now = TimeUtil::GetMonotonicMs();
+            int64_t next = -1;
+            for (auto &item : watches)
+            {
+                Watch &watch = *item.second;
+                if (watch.deadline == 0)
+                {
+                    continue;
+                }
+                if (watch.deadline <= now && watch.wall_timeout)
+                {
+                    // 杀掉之后zygote迟迟不回报退出状态(比如用户程序自己的fork server停止了响应)：
+                    // 关闭应答socket，epoll马上报告可读，按被杀掉回收，不让它一直占着运行名额
+                    shutdown(watch.fd, SHUT_RDWR);
+                    watch.deadline = 0;
+                    continue;
+                }
+                if (watch.deadline <= now)
+                {
+                    // 还没有回收，pid不会被复用
+                    watch.wall_timeout = true;
+                    ++wall_timeouts;
+                    Launcher::KillGroup(watch.pid);
+                    watch.deadline = watch.from_zygote ? now + zygote_grace_ms : 0;
+                    if (watch.deadline == 0)
+                    {
+                        continue;
+                    }
+                }
+                if (next < 0 || watch.deadline - now < next)
+                {
+                    next = watch.deadline - now;
+                }
+            }
+            return static_cast<int>(next);
+        }
+
+        // 不再读取这个子进程的输出管道，调用方持有mtx
+        void RemovePipes(Watch &watch)
+        {
+            if (!watch.capture)
+            {
+                return;
+            }
+            for (int i = 0; i < 2; ++i)
+            {
+                int pipe_fd = watch.capture->ReadFd(static_cast<OutputCapture::Stream>(i));
+                if (pipe_fd >= 0)
+                {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pipe_fd, nullptr);
+                    pipes.erase(pipe_fd);
+                }
+            }
+        }
+
+        // 输出管道可读，读到EOF时关闭
+        void OnPipe(int fd)
+        {
+            Watch *watch = nullptr;
+            OutputCapture::Stream stream;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                auto iter = pipes.find(fd);
+                if (iter == pipes.end())
+                {
+                    return;
+                }
+                watch = iter->second.first;
+                stream = iter->second.second;
+            }
+            // 只有reaper线程会删除watch、读写capture；每轮只读一部分，不让一个输出很多的程序占住reaper线程
+            if (!watch->capture->Drain(stream, OutputCapture::drain_chunk))
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                pipes.erase(fd);
+                watch->capture->Close(stream);
+            }
+            if (CheckOutput(*watch))
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                ++output_exceeded;
+            }
+        }
+
+        // 子进程已经退出，取出退出状态、资源使用情况和剩下的输出
+        static void Reap(Watch &watch, ExitInfo *info)
+        {
+            if (watch.cancel)
+            {
+                watch.cancel->Remove(watch.pid);
+            }
+            if (watch.capture)
+            {
+                watch.capture->Finish();
+                info->output_exceeded = watch.capture->Exceeded();
+            }
+            info->wall_timeout = watch.wall_timeout;
+            if (watch.from_zygote)
+            {
+                // Collect会关闭应答socket
+                if (!Zygote::Collect(watch.fd, info))
+                {
+                    info->status = SIGKILL; // 当作被杀掉
+                }
+            }
+            else
+            {
+                Launcher::Wait(watch.pid, info);
+                close(watch.fd);
+            }
+            info->usage.wall_ms = TimeUtil::GetMonotonicMs() - watch.start;
+            if (watch.perf_fd >= 0)
+            {
+                info->usage.instructions = std::max<int64_t>(0, InstructionCounter::Read(watch.perf_fd));
+                info->instructions_exceeded = info->usage.instructions >= watch.instruction_limit;
+                close(watch.perf_fd);
+            }
+            // 取消之前已经正常结束的子进程照常报告
+            info->cancelled = watch.cancel && watch.cancel->Cancelled() && WIFSIGNALED(info->status) &&
+                              WTERMSIG(info->status) == SIGKILL;
+        }
+
+        void Loop()
+        {
+            const int max_events = 64;
+            epoll_event events[max_events];
+            while (true)
+            {
+                int n = epoll_wait(epoll_fd, events, max_events, NextTimeout());
+                // 先读输出管道，再处理退出的子进程：回收时会关闭它的管道，
+                // 同一批事件里之后的fd可能已经被关闭、甚至被别的线程复用
+                for (int i = 0; i < n; ++i)
+                {
+                    int fd = events[i].data.fd;
+                    if (fd == wake_fd)
+                    {
+                        uint64_t value;
+                        ssize_t ret = read(wake_fd, &value, sizeof(value));
+                        (void)ret;
+                        events[i].data.fd = -1;
+                        continue;
+                    }
+                    bool is_pipe;
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        is_pipe = pipes.count(fd) > 0;
+                    }
+                    if (is_pipe)
+                    {
+                        OnPipe(fd);
+                        events[i].data.fd = -1;
+                    }
+                }
+                for (int i = 0; i < n; ++i)
+                {
+                    int fd = events[i].data.fd;
+                    if (fd < 0)
+                    {
+                        continue;
+                    }
+                    std::unique_ptr<Watch> watch;
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        auto iter = watches.find(fd);
+                        if (iter == watches.end())
+                        {
+                            continue;
+                        }
+                        watch = std::move(iter->second);
+                        watches.erase(iter);
+                        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                        RemovePipes(*watch);
+                        ++reaped;
+                    }
+                    ExitInfo info;
+                    Reap(*watch, &info);
+                    if (info.cancelled)
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        ++cancelled;
+                    }
+                    watch->done(info);
+                }
+            }
+        }
+
+    private:
+        bool running = false;
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::mutex mtx;
+        std::unordered_map<int, std::unique_ptr<Watch>> watches; // fd -> 等待中的子进程
+        std::unordered_map<int, std::pair<Watch *, OutputCapture::Stream>> pipes; // 输出管道的读端 -> 所属的子进程
+        uint64_t reaped = 0;
+        uint64_t wall_timeouts = 0;
+        uint64_t cancelled = 0;
+        uint64_t output_exceeded = 0;
+    };
+}
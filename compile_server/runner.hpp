@@ -2,9 +2,23 @@
 
 #include "../comm/util.hpp"
 #include "../comm/log.hpp"
+#include "launcher.hpp"
+#include "zygote.hpp"
+#include "reaper.hpp"
+#include "cgroup.hpp"
+#include "sandbox.hpp"
+#include "memfd.hpp"
+#include "compile.hpp"
+#include "capture.hpp"
+#include "cpuset.hpp"
+#include "perf.hpp"
+#include "speed.hpp"
 
 #include <iostream>
 #include <string>
+#include <memory>
+#include <future>
+#include <functional>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -17,6 +31,41 @@ namespace ns_runner
 {
     using namespace ns_util;
     using namespace ns_log;
+    using namespace ns_launcher;
+    using namespace ns_zygote;
+    using namespace ns_reaper;
+    using namespace ns_cgroup;
+    using namespace ns_sandbox;
+    using namespace ns_memfd;
+    using namespace ns_compiler;
+    using namespace ns_capture;
+    using namespace ns_cpuset;
+    using namespace ns_perf;
+    using namespace ns_speed;
+
+    // Runner::RunAsync的可选参数
+    struct RunOptions
+    {
+        // 不为nullptr时由这个fork server(见forkserver.hpp)fork出子进程，不再exec，也不再占用沙箱
+        // fork server不可用时退回到普通的运行方式
+        Zygote *server = nullptr;
+        // 不为-1时交给程序作为fork server的控制socket，用来启动fork server本身
+        int control_fd = -1;
+        // 不为空时程序加入这个取消组，取消时还在运行的程序被杀掉，返回cancelled(需要reaper)
+        std::shared_ptr<CancelGroup> cancel;
+        // 不为空时标准输出从管道读出一块就交给它一块(在reaper线程里)，out只得到前stdout_keep个字节
+        // 用于边运行边检查输出(见checker.hpp)，程序输出多大都不需要整个保存
+        std::function<void(const char *, size_t)> stdout_sink;
+        size_t stdout_keep = 0;
+        // 标准输出和标准错误合计的字节数上限，超过时杀掉整个进程组，返回output_limit_exceeded；0表示不限制
+        size_t output_limit = 0;
+        // 不为空时子进程退出后的收尾(读取cgroup的统计、取出输出、调用done)交给它执行，不占用reaper线程
+        // 比如交给运行线程池；核和沙箱在reaper线程里先归还，等它们的运行线程不用排在收尾后面
+        std::function<void(std::function<void()>)> post;
+        // 不为-1时用这个文件作为标准输入，忽略input(比如测试数据仓库里封存的内存文件，见testdata.hpp)
+        // 每次运行重新打开一次，各自从头读，不复制数据
+        int stdin_fd = -1;
+    };
 
     class Runner
     {
@@ -24,32 +73,51 @@ namespace ns_runner
         Runner() {}
         ~Runner() {}
 
-        // 提供设置进程占用资源大小的接口
-        static void SetProcLimit(int cpu_limit, int mem_limit)
-        {
-            rlimit cpu_rlimit;
-            rlimit mem_rlimit;
-            
-            cpu_rlimit.rlim_cur = cpu_limit;
-            cpu_rlimit.rlim_max = RLIM_INFINITY;
-            mem_rlimit.rlim_cur = mem_limit * 1024; // 转换为kb
-            mem_rlimit.rlim_max = RLIM_INFINITY;
-
-            setrlimit(RLIMIT_CPU, &cpu_rlimit);
-            setrlimit(RLIMIT_AS, &mem_rlimit);
-        }
+        // Run的返回值：超过墙上时间被杀掉
+        static const int wall_time_exceeded = -3;
+        // Run的返回值：超过cgroup的memory.max被OOM杀掉
+        static const int memory_limit_exceeded = -4;
+        // Run的返回值：所在的取消组被取消(见reaper.hpp的CancelGroup)，程序被杀掉
+        static const int cancelled = -5;
+        // Run的返回值：输出超过上限(RunOptions::output_limit)，程序被杀掉
+        static const int output_limit_exceeded = -6;
 
         /**
          * 返回值 > 0：程序异常，退出时收到了信号，返回值就是对应的信号编号
-         * 返回值 == 0： 正常运行完毕的，结果保存到了对应的临时文件
+         * 返回值 == 0： 正常运行完毕的，结果保存到了out和err中
+         * 返回值 == wall_time_exceeded：超过墙上时间，整个进程组被杀掉
+         * 返回值 == memory_limit_exceeded：cgroup后端下内存超过限制被OOM杀掉
+         * 返回值 == cancelled：运行中被取消
+         * 返回值 == output_limit_exceeded：输出超过上限，整个进程组被杀掉
          * 返回值 < 0：内部错误
          * 
          * cpu_limit: 该程序运行时，可以使用最大的CPU资源上限
-         * mem_limit: 内存限制
+         * mem_limit: 内存限制(kb)，cgroup可用时限制真正使用的内存(memory.max)，否则限制地址空间(RLIMIT_AS)
+         * wall_limit: 墙上时间限制(ms)，sleep、阻塞在输入上或者死锁的程序不消耗CPU，只能靠它结束
+         * out/err: 程序的标准输出和标准错误，通过管道收集，为nullptr时丢弃
+         * usage: 不为nullptr时填入程序的CPU时间、墙上时间和峰值内存
         */
 
         // 指明文件名即可，不需要带路径和带后缀
-        static int Run(const std::string &file_name, int cpu_limit, int mem_limit)
+        static int Run(const std::string &file_name, int cpu_limit, int mem_limit, int wall_limit,
+                       std::string *out, std::string *err, ResourceUsage *usage = nullptr,
+                       const RunOptions &options = RunOptions())
+        {
+            auto finished = std::make_shared<std::promise<int>>();
+            std::future<int> result = finished->get_future();
+            RunAsync(file_name, file_name, "", cpu_limit, mem_limit, wall_limit, out, err, usage, [finished](int code)
+                     { finished->set_value(code); }, options);
+            return result.get();
+        }
+
+        // 异步运行：创建子进程后立即返回，程序结束后调用done(返回值同Run)
+        // reaper启动时done在reaper线程里调用(设置了RunOptions::post时交给post)，out/err/usage要保证在done被调用之前一直有效
+        // io_name: 标准输入文件的名称，同一个程序运行多个测试用例时每个用例各不相同
+        // input: 写入标准输入的内容
+        static void RunAsync(const std::string &file_name, const std::string &io_name, const std::string &input,
+                             int cpu_limit, int mem_limit, int wall_limit,
+                             std::string *out, std::string *err, ResourceUsage *usage, std::function<void(int)> done,
+                             const RunOptions &options = RunOptions())
         {
             /**************************
              * 程序运行：
@@ -58,54 +126,297 @@ namespace ns_runner
              * 3. 代码没跑完，出现异常
              * 我们只考虑是否正确运行完毕
              */
+            std::shared_ptr<RunContext> ctx = std::make_shared<RunContext>();
+            ctx->io_name = io_name;
+            ctx->in_memory = Compiler::InMemory();
+            // 题目的时间限制是参考机器上的时间，按本机的速度系数放大(见speed.hpp)
+            SpeedCalibration &speed = SpeedCalibration::Instance();
+            ctx->cpu_limit = cpu_limit;
+            ctx->wall_limit = speed.ScaleMs(wall_limit);
+            Zygote *server = options.server;
             std::string _execute = PathUtil::Exe(file_name);
-            std::string _stdin = PathUtil::Stdin(file_name);
-            std::string _stdout = PathUtil::Stdout(file_name);
-            std::string _stderr = PathUtil::Stderr(file_name);
+            std::string _stdin = PathUtil::Stdin(io_name);
 
-            umask(0);
-            int _stdin_fd = open(_stdin.c_str(), O_CREAT | O_RDONLY, 0644);
-            int _stdout_fd = open(_stdout.c_str(), O_CREAT | O_WRONLY, 0644);
-            int _stderr_fd = open(_stderr.c_str(), O_CREAT | O_WRONLY, 0644);
+            if (options.stdin_fd >= 0)
+            {
+                ctx->stdin_fd = MemFd::Reopen(options.stdin_fd);
+            }
+            if (ctx->in_memory)
+            {
+                // 标准输入是内存文件，可执行程序通过fexecve执行
+                // 多个测试用例共用同一个可执行程序，由CompileAndRun::RemoveTempFile删除
+                if (server == nullptr)
+                {
+                    ctx->exe_fd = open(_execute.c_str(), O_RDONLY | O_CLOEXEC);
+                }
+                if (options.stdin_fd < 0)
+                {
+                    ctx->stdin_fd = MemFd::Create("stdin", input);
+                }
+            }
+            else
+            {
+                // 沙箱的根文件系统和编译服务看到的不一样，可执行程序通过fd交给沙箱
+                if (server == nullptr && SandboxPool::Instance().Enabled())
+                {
+                    ctx->exe_fd = open(_execute.c_str(), O_RDONLY | O_CLOEXEC);
+                }
+            }
+            // 沙箱里以没有特权的用户运行，可执行程序的权限不依赖编译服务启动时的umask
+            if (ctx->exe_fd >= 0 && SandboxPool::Instance().Enabled())
+            {
+                fchmod(ctx->exe_fd, 0755);
+            }
+            if (!ctx->in_memory && options.stdin_fd < 0)
+            {
+                if (!input.empty() && !FileUtil::WriteFile(_stdin, input))
+                {
+                    LOG(ERROR) << "写入标准输入失败: " << _stdin << "\n";
+                }
+                // O_CLOEXEC：其他线程同时创建的子进程不会继承这个文件，Launcher会dup2到0
+                ctx->stdin_fd = open(_stdin.c_str(), O_CREAT | O_RDONLY | O_CLOEXEC, 0644);
+            }
+            // 标准输出和标准错误通过管道收集，不再写临时文件
+            ctx->capture = std::make_shared<OutputCapture>(options.output_limit);
+            if (options.stdout_sink)
+            {
+                ctx->capture->SetStdoutSink(options.stdout_sink, options.stdout_keep);
+            }
 
-            if(_stdin_fd < 0 || _stdout_fd < 0 || _stderr_fd < 0)
+            bool need_exe_fd = server == nullptr && (ctx->in_memory || SandboxPool::Instance().Enabled());
+            if ((need_exe_fd && ctx->exe_fd < 0) || ctx->stdin_fd < 0 || !ctx->capture->Open())
             {
                 LOG(ERROR) << "运行时打开标准文件失败" << "\n";
-                return -1; // 代表打开文件失败
+                done(-1); // 代表打开文件失败
+                return;
             }
 
+            if (CgroupPool::Instance().Enabled())
+            {
+                ctx->cgroup = CgroupPool::Instance().Acquire(mem_limit);
+            }
+            // fork server自己已经在沙箱里，它fork出的子进程继承它的命名空间和seccomp
+            if (server == nullptr && SandboxPool::Instance().Enabled())
+            {
+                if (options.control_fd < 0)
+                {
+                    ctx->sandbox = SandboxPool::Instance().Acquire();
+                }
+                else if ((ctx->sandbox = SandboxPool::Instance().TryAcquire()) == nullptr)
+                {
+                    // fork server不排队等沙箱，调用方看到控制socket关闭后改为exec运行
+                    LOG(WARNING) << "没有空闲的沙箱，不启动fork server" << "\n";
+                    done(-2);
+                    return;
+                }
+            }
+            // 独占一个核，没有空闲的核时在这里排队；fork server本身大部分时间在等待请求，不占核，它fork出的用例各自占核
+            if (options.control_fd < 0)
+            {
+                ctx->cpu = CorePool::Instance().Acquire();
+            }
 
-            pid_t pid = fork();
-            if (pid < 0)
+            // fork server不可用时回到这里改为exec运行，已经拿到的核、cgroup、管道和标准输入直接沿用，不重新排队
+            while (true)
             {
-                LOG(ERROR) << "运行时创建子进程失败" << "\n";
-                close(_stdin_fd);
-                close(_stdout_fd);
-                close(_stderr_fd);
-                return -2; // 代表创建子进程失败
+                SpawnRequest req;
+                req.argv = {_execute};
+                req.exe_fd = ctx->exe_fd;
+                req.stdin_fd = ctx->stdin_fd;
+                req.stdout_fd = ctx->capture->WriteFd(OutputCapture::STDOUT);
+                req.stderr_fd = ctx->capture->WriteFd(OutputCapture::STDERR);
+                req.cpu_limit = speed.ScaleSeconds(cpu_limit); // 设置资源限制
+                req.instruction_limit = InstructionCounter::Instance().Limit(cpu_limit);
+                if (req.instruction_limit > 0)
+                {
+                    // 按指令数判定超时，RLIMIT_CPU只是兜底(其他线程、子进程不计指令数)
+                    req.cpu_limit = req.cpu_limit * 2 + 1;
+                }
+                req.mem_limit = ctx->cgroup ? 0 : mem_limit; // 有cgroup时不再限制地址空间
+                req.wall_limit = ctx->wall_limit;
+                req.cgroup_fd = ctx->cgroup ? ctx->cgroup->ProcsFd() : -1;
+                req.control_fd = options.control_fd;
+                req.cpu = ctx->cpu;
+                Zygote *via = server != nullptr ? server : ctx->sandbox;
+
+                // 子进程交给reaper等待，当前线程不阻塞
+                Reaper &reaper = Reaper::Instance();
+                if (!reaper.Running())
+                {
+                    ExitInfo info;
+                    if (reaper.SpawnAndWait(req, &info, via, ctx->capture))
+                    {
+                        done(Collect(*ctx, info, out, err, usage));
+                        return;
+                    }
+                }
+                else
+                {
+                    std::function<void(std::function<void()>)> post = options.post;
+                    bool spawned = reaper.SpawnAsync(req, [ctx, out, err, usage, done, post](const ExitInfo &info)
+                                                     {
+                                                         if (!post)
+                                                         {
+                                                             done(Collect(*ctx, info, out, err, usage));
+                                                             return;
+                                                         }
+                                                         ctx->ReleaseSlots();
+                                                         post([ctx, info, out, err, usage, done]()
+                                                              { done(Collect(*ctx, info, out, err, usage)); });
+                                                     },
+                                                     via, options.cancel, ctx->capture);
+                    if (spawned)
+                    {
+                        return;
+                    }
+                }
+                if (server == nullptr)
+                {
+                    LOG(ERROR) << "运行时创建子进程失败" << "\n";
+                    done(-2); // 代表创建子进程失败
+                    return;
+                }
+                LOG(WARNING) << "fork server不可用，改为exec运行" << "\n";
+                server = nullptr;
+                if (!PrepareExec(*ctx, _execute))
+                {
+                    LOG(ERROR) << "运行时打开可执行程序失败" << "\n";
+                    done(-1);
+                    return;
+                }
             }
-            else if (pid == 0)
+        }
+
+    private:
+        // 一次运行打开的文件，子进程退出后才能读取输出并关闭
+        struct RunContext
+        {
+            std::string io_name;
+            bool in_memory = false;
+            int cpu_limit = 0;  // 题目的CPU时间限制(s)，参考机器上的时间
+            int wall_limit = 0; // 本机的墙上时间限制(ms)，已经乘以速度系数
+            int exe_fd = -1;
+            int stdin_fd = -1;
+            std::shared_ptr<OutputCapture> capture; // 标准输出和标准错误的管道
+            std::shared_ptr<Cgroup> cgroup;         // 为空表示使用rlimit
+            Zygote *sandbox = nullptr;              // 为空表示不在沙箱里运行
+            int cpu = -1;                           // 独占的核，-1表示不绑核
+
+            // 子进程已经退出，归还独占的核和沙箱，不等RunContext析构
+            void ReleaseSlots()
             {
-                dup2(_stdin_fd,0);
-                dup2(_stdout_fd,1);
-                dup2(_stderr_fd,2);
+                CorePool::Instance().Release(cpu);
+                cpu = -1;
+                if (sandbox) SandboxPool::Instance().Release(sandbox);
+                sandbox = nullptr;
+            }
 
-                SetProcLimit(cpu_limit, mem_limit); // 设置资源限制
+            ~RunContext()
+            {
+                ReleaseSlots();
+                if (cgroup) CgroupPool::Instance().Release(cgroup);
+                if (exe_fd >= 0) close(exe_fd);
+                if (stdin_fd >= 0) close(stdin_fd);
+            }
+        };
 
-                execl(_execute.c_str(),_execute.c_str(),nullptr);
-                exit(1);
-            }   
-            else
+        // fork server不可用时改为exec运行：补上exec需要而fork server不需要的可执行程序fd和沙箱
+        // 等沙箱之前先让出核，和第一次运行时一样先拿沙箱再拿核，不会和别的运行互相等待
+        static bool PrepareExec(RunContext &ctx, const std::string &execute)
+        {
+            bool sandboxed = SandboxPool::Instance().Enabled();
+            if ((ctx.in_memory || sandboxed) && ctx.exe_fd < 0)
+            {
+                ctx.exe_fd = open(execute.c_str(), O_RDONLY | O_CLOEXEC);
+                if (ctx.exe_fd < 0)
+                {
+                    return false;
+                }
+            }
+            if (sandboxed && ctx.sandbox == nullptr)
+            {
+                bool had_cpu = ctx.cpu >= 0;
+                CorePool::Instance().Release(ctx.cpu);
+                ctx.cpu = -1;
+                ctx.sandbox = SandboxPool::Instance().Acquire();
+                if (had_cpu)
+                {
+                    ctx.cpu = CorePool::Instance().Acquire();
+                }
+            }
+            return true;
+        }
+
+        // 子进程退出后取出输出，返回值同Run
+        static int Collect(RunContext &ctx, const ExitInfo &info, std::string *out, std::string *err, ResourceUsage *usage)
+        {
+            ctx.ReleaseSlots();
+            ResourceUsage run_usage = info.usage;
+            bool oom = ctx.cgroup && ctx.cgroup->Collect(&run_usage);
+            if (usage != nullptr)
+            {
+                *usage = run_usage;
+            }
+            int result = ExitResult(ctx, info, oom, run_usage);
+            if (out != nullptr)
+            {
+                *out = std::move(ctx.capture->Data(OutputCapture::STDOUT));
+            }
+            if (err != nullptr)
+            {
+                *err = std::move(ctx.capture->Data(OutputCapture::STDERR));
+            }
+            ctx.capture.reset();
+            return result;
+        }
+
+        // 子进程的退出信息转换成返回值
+        static int ExitResult(RunContext &ctx, const ExitInfo &info, bool oom, const ResourceUsage &run_usage)
+        {
+            if (info.cancelled)
+            {
+                LOG(INFO) << "运行被取消" << "\n";
+                return cancelled;
+            }
+            if (info.output_exceeded)
+            {
+                LOG(INFO) << "运行时输出超过上限" << "\n";
+                return output_limit_exceeded;
+            }
+            if (info.instructions_exceeded)
+            {
+                LOG(INFO) << "运行超过指令数上限: " << run_usage.instructions << "\n";
+                return SIGXCPU; // 和CPU时间超限一样报告
+            }
+            if (info.wall_timeout)
+            {
+                LOG(INFO) << "运行超过墙上时间: " << ctx.wall_limit << "ms" << "\n";
+                return wall_time_exceeded;
+            }
+            if (oom)
+            {
+                LOG(INFO) << "运行超过内存限制, 峰值: " << run_usage.max_rss_kb << "kb" << "\n";
+                return memory_limit_exceeded;
+            }
+            // RLIMIT_CPU按秒向上取整，折算回参考机器的CPU时间之后再精确判定一次；按指令数限制时以指令数为准
+            SpeedCalibration &speed = SpeedCalibration::Instance();
+            if (speed.Scaling() && info.usage.instructions == 0 && ctx.cpu_limit > 0 &&
+                speed.Normalize(run_usage.cpu_ms) > static_cast<int64_t>(ctx.cpu_limit) * 1000)
+            {
+                LOG(INFO) << "运行超过CPU时间限制，折算后: " << speed.Normalize(run_usage.cpu_ms) << "ms" << "\n";
+                return SIGXCPU;
+            }
+            // 忽略了SIGXCPU的程序在RLIMIT_CPU的硬限制(软限制+1秒)处被SIGKILL
+            if (WIFSIGNALED(info.status) && WTERMSIG(info.status) == SIGKILL && ctx.cpu_limit > 0 &&
+                speed.Normalize(run_usage.cpu_ms) >= static_cast<int64_t>(ctx.cpu_limit) * 1000)
             {
-                close(_stdin_fd);
-                close(_stdout_fd);
-                close(_stderr_fd);
-                int status = 0;
-                waitpid(pid, &status, 0);
-                LOG(INFO) << "运行完毕，info: " << (status & 0x7F) << "\n";
-                // 程序运行异常，一定是因为收到了信号
-                return status & 0x7F;
+                LOG(INFO) << "运行超过CPU时间的硬限制: " << run_usage.cpu_ms << "ms" << "\n";
+                return SIGXCPU;
             }
+            LOG(INFO) << "运行完毕，info: " << (info.status & 0x7F) << " cpu: " << run_usage.cpu_ms << "ms wall: "
+                      << run_usage.wall_ms << "ms rss: " << run_usage.max_rss_kb << "kb" << "\n";
+            // 程序运行异常，一定是因为收到了信号
+            return info.status & 0x7F;
         }
     };
 }
\ No newline at end of file
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+#include "launcher.hpp"
+#include "zygote.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <jsoncpp/json/json.h>
+
+// 沙箱：用户程序运行在独立的mount/network/ipc/uts/pid命名空间里，以没有特权的用户(默认nobody)运行
+// 根目录换成一个只读的最小根目录，只有系统目录(只读绑定)和几个设备文件，看不到编译服务的工作目录和测试数据，
+// /tmp和/dev/shm是私有的小tmpfs，/proc是新挂载的，只看得到沙箱里的进程，
+// 看不到编译服务(它打开的测试数据memfd、内存)，也没法给沙箱外的进程发信号
+// 没有网络(只有一个没启动的lo)，exec之前安装seccomp过滤器
+// 创建命名空间(尤其是network命名空间)和重新挂载文件系统很贵，所以沙箱是池化的：
+// 每个沙箱是一个在启动时就建好环境的zygote进程，运行时从池子里取一个，通过它创建用户程序，
+// 程序退出后沙箱清空/tmp、/dev/shm，放回池子，热路径上只剩下一次clone
+namespace ns_sandbox
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_launcher;
+    using namespace ns_zygote;
+
+    class Sandbox
+    {
+    public:
+        // 在沙箱zygote进程里执行一次：创建命名空间，切换到最小的只读根目录，挂载私有的/tmp、/dev/shm和/proc
+        // 这时zygote已经是新PID命名空间里的1号进程(ZygoteOptions::pid_namespace)
+        // tmp_size_mb: 私有tmpfs的大小
+        static bool Setup(int tmp_size_mb)
+        {
+            if (unshare(CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS) < 0)
+            {
+                LOG(ERROR) << "沙箱创建命名空间失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            // 之后的挂载不传播回编译服务所在的命名空间
+            if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) < 0)
+            {
+                LOG(ERROR) << "沙箱设置私有挂载失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            if (!PivotToMinimalRoot())
+            {
+                return false;
+            }
+            if (!MountTmp("/tmp", tmp_size_mb) || !MountTmp("/dev/shm", tmp_size_mb))
+            {
+                return false;
+            }
+            // 新的proc反映的是挂载者所在的PID命名空间，只看得到沙箱里的进程
+            if (mount("proc", "/proc", "proc", MS_NOSUID | MS_NODEV | MS_NOEXEC | MS_RDONLY, nullptr) < 0)
+            {
+                LOG(ERROR) << "沙箱挂载/proc失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            // 新根目录建好以后改为只读，用户程序只能写/tmp和/dev/shm
+            if (mount(nullptr, "/", nullptr, MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | MS_NODEV, nullptr) < 0)
+            {
+                LOG(ERROR) << "沙箱把根目录改为只读失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            sethostname("sandbox", 7);
+            return true;
+        }
+
+        // 每次运行结束后执行：杀掉上一次运行留下的进程(比如脱离了进程组的后台进程)，丢掉它在/tmp、/dev/shm里留下的东西
+        // zygote是1号进程，kill(-1)发给命名空间里除自己以外的所有进程，它们随后由zygote回收
+        static void Recycle(int tmp_size_mb)
+        {
+            kill(-1, SIGKILL);
+            MountTmp("/tmp", tmp_size_mb);
+            MountTmp("/dev/shm", tmp_size_mb);
+        }
+
+        // 用户程序的seccomp过滤器：禁止网络、挂载、命名空间、调试其他进程、内核模块等系统调用
+        // 返回的指针在fork出来的沙箱进程里同样有效
+        static const sock_fprog *Filter()
+        {
+            static std::vector<sock_filter> filter = BuildFilter();
+            static sock_fprog prog = {static_cast<unsigned short>(filter.size()), filter.data()};
+            return &prog;
+        }
+
+    private:
+        // 新的根目录是一个tmpfs，里面只有只读绑定的系统目录(程序运行要用的动态库、/etc)、几个设备文件，
+        // 以及/tmp、/dev/shm、/proc挂载点。编译服务的工作目录(其他提交的源文件、可执行程序、编译缓存)
+        // 和同机部署的oj_server的测试数据都不在新根目录里，pivot_root之后原来的根目录整个卸载掉，用户程序看不到也摸不到
+        // 可执行程序通过fd交给沙箱(SpawnRequest::exe_fd)，不需要路径
+        static bool PivotToMinimalRoot()
+        {
+            // 借/tmp当新根目录的挂载点：它在哪台机器上都存在，而且这个挂载只在沙箱的mount命名空间里
+            const std::string root = "/tmp";
+            if (mount("tmpfs", root.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, "size=1m,mode=0755") < 0)
+            {
+                LOG(ERROR) << "沙箱挂载新根目录失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            static const char *const system_dirs[] = {"/bin", "/sbin", "/usr", "/lib", "/lib32", "/lib64", "/libx32", "/etc"};
+            for (const char *dir : system_dirs)
+            {
+                struct stat st;
+                if (lstat(dir, &st) < 0)
+                {
+                    continue;
+                }
+                std::string target = root + dir;
+                if (S_ISLNK(st.st_mode))
+                {
+                    // usrmerge的系统上/bin、/lib等是指向usr的符号链接，照原样建一个
+                    char link[PATH_MAX];
+                    ssize_t n = readlink(dir, link, sizeof(link) - 1);
+                    if (n < 0)
+                    {
+                        continue;
+                    }
+                    link[n] = '\0';
+                    if (symlink(link, target.c_str()) < 0)
+                    {
+                        LOG(ERROR) << "沙箱创建符号链接 " << target << " 失败: " << strerror(errno) << "\n";
+                        return false;
+                    }
+                    continue;
+                }
+                if (!S_ISDIR(st.st_mode))
+                {
+                    continue;
+                }
+                if (mkdir(target.c_str(), 0755) < 0 ||
+                    mount(dir, target.c_str(), nullptr, MS_BIND | MS_REC, nullptr) < 0 ||
+                    mount(nullptr, target.c_str(), nullptr, MS_BIND | MS_REMOUNT | MS_RDONLY | MS_NOSUID | MS_NODEV, nullptr) < 0)
+                {
+                    LOG(ERROR) << "沙箱只读绑定 " << dir << " 失败: " << strerror(errno) << "\n";
+                    return false;
+                }
+            }
+            if (mkdir((root + "/dev").c_str(), 0755) < 0 || mkdir((root + "/dev/shm").c_str(), 01777) < 0 ||
+                mkdir((root + "/tmp").c_str(), 01777) < 0 || mkdir((root + "/proc").c_str(), 0555) < 0)
+            {
+                LOG(ERROR) << "沙箱创建目录失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            // 设备文件只绑定这几个，其余的(磁盘、终端等)不存在
+            static const char *const devices[] = {"/dev/null", "/dev/zero", "/dev/full", "/dev/random", "/dev/urandom"};
+            for (const char *dev : devices)
+            {
+                if (!FileUtil::IsFileExists(dev))
+                {
+                    continue;
+                }
+                std::string target = root + dev;
+                int fd = open(target.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0666);
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+                if (fd < 0 || mount(dev, target.c_str(), nullptr, MS_BIND, nullptr) < 0)
+                {
+                    LOG(ERROR) << "沙箱绑定 " << dev << " 失败: " << strerror(errno) << "\n";
+                    return false;
+                }
+            }
+            symlink("/proc/self/fd", (root + "/dev/fd").c_str());
+            symlink("/proc/self/fd/0", (root + "/dev/stdin").c_str());
+            symlink("/proc/self/fd/1", (root + "/dev/stdout").c_str());
+            symlink("/proc/self/fd/2", (root + "/dev/stderr").c_str());
+
+            // pivot_root(".", ".")把原来的根目录叠在新根目录下面，随后卸载它，不需要额外的put_old目录
+            if (chdir(root.c_str()) < 0 || syscall(SYS_pivot_root, ".", ".") < 0)
+            {
+                LOG(ERROR) << "沙箱切换根目录失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            if (umount2(".", MNT_DETACH) < 0 || chdir("/") < 0)
+            {
+                LOG(ERROR) << "沙箱卸载原来的根目录失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        static bool MountTmp(const std::string &target, int size_mb)
+        {
+            umount2(target.c_str(), MNT_DETACH);
+            std::string options = "size=" + std::to_string(size_mb) + "m,mode=1777";
+            if (mount("tmpfs", target.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, options.c_str()) < 0)
+            {
+                LOG(ERROR) << "沙箱挂载 " << target << " 失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            return true;
+        }
+
+        static std::vector<sock_filter> BuildFilter()
+        {
+            static const long denied[] = {
+                SYS_socket, SYS_ptrace, SYS_process_vm_readv, SYS_process_vm_writev,
+                SYS_mount, SYS_umount2, SYS_pivot_root, SYS_chroot, SYS_unshare, SYS_setns,
+                SYS_reboot, SYS_kexec_load, SYS_init_module, SYS_finit_module, SYS_delete_module,
+                SYS_bpf, SYS_perf_event_open, SYS_keyctl, SYS_add_key, SYS_request_key, SYS_userfaultfd,
+                SYS_io_uring_setup, SYS_swapon, SYS_swapoff, SYS_sethostname, SYS_setdomainname, SYS_acct,
+                SYS_quotactl, SYS_open_by_handle_at, SYS_name_to_handle_at, SYS_fanotify_init, SYS_syslog,
+                SYS_settimeofday, SYS_clock_settime, SYS_clock_adjtime, SYS_adjtimex,
+                SYS_sched_setaffinity, // 开启绑核时用户程序不能离开分配给它的核
+#ifdef __x86_64__
+                SYS_iopl, SYS_ioperm,
+#endif
+            };
+            const unsigned long new_namespaces = CLONE_NEWNS | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS |
+                                                 CLONE_NEWPID | CLONE_NEWUSER | CLONE_NEWCGROUP;
+#if defined(__x86_64__)
+            const unsigned int arch = AUDIT_ARCH_X86_64;
+#elif defined(__aarch64__)
+            const unsigned int arch = AUDIT_ARCH_AARCH64;
+#else
+#error "seccomp filter: unsupported architecture"
+#endif
+            std::vector<sock_filter> filter;
+            // 只允许本机的系统调用约定，防止通过32位/x32的系统调用号绕过
+            filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)));
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, arch, 1, 0));
+            filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS));
+            filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)));
+#ifdef __x86_64__
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 0x40000000, 0, 1)); // __X32_SYSCALL_BIT
+            filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS));
+#endif
+            for (long nr : denied)
+            {
+                filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<unsigned int>(nr), 0, 1));
+                filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM));
+            }
+            // 资源限制只能调低：setrlimit全部拒绝；prlimit64只允许读取(new_limit为NULL)，glibc的getrlimit用的就是它
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_setrlimit, 0, 1));
+            filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM));
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_prlimit64, 0, 5));
+            filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, args[2])));
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2));
+            filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, args[2]) + 4));
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 0));
+            filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM));
+            filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)));
+            // clone3的参数在内存里，seccomp检查不了，让libc退回到clone
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_clone3, 0, 1));
+            filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | ENOSYS));
+            // clone不允许创建新的命名空间
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_clone, 0, 3));
+            filter.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, args[0])));
+            filter.push_back(BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, static_cast<unsigned int>(new_namespaces), 0, 1));
+            filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM));
+            filter.push_back(BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW));
+            return filter;
+        }
+    };
+
+    // 预先建好的沙箱池，Init必须在创建任何线程之前调用(每个沙箱都是fork出来的zygote)
+    class SandboxPool
+    {
+    public:
+        static SandboxPool &Instance()
+        {
+            static SandboxPool pool;
+            return pool;
+        }
+
+        // user: 用户程序的运行用户，在这里解析成uid/gid(沙箱进程里不再读/etc/passwd)
+        bool Init(size_t count, int tmp_size_mb, const std::string &user)
+        {
+            passwd *pw = getpwnam(user.c_str());
+            if (pw == nullptr || pw->pw_uid == 0)
+            {
+                LOG(ERROR) << "沙箱的运行用户不存在或者是root: " << user << "，用户程序将不在沙箱里运行" << "\n";
+                return false;
+            }
+            ZygoteOptions options;
+            options.uid = static_cast<int>(pw->pw_uid);
+            options.gid = static_cast<int>(pw->pw_gid);
+            options.pid_namespace = true;
+            options.setup = [tmp_size_mb]()
+            { return Sandbox::Setup(tmp_size_mb); };
+            options.recycle = [tmp_size_mb]()
+            { Sandbox::Recycle(tmp_size_mb); };
+            options.seccomp = Sandbox::Filter();
+            for (size_t i = 0; i < count; ++i)
+            {
+                std::unique_ptr<Zygote> sandbox(new Zygote());
+                if (!sandbox->Start(options) || !Probe(sandbox.get()))
+                {
+                    LOG(ERROR) << "沙箱不可用，用户程序将不在沙箱里运行" << "\n";
+                    sandboxes.clear();
+                    free_list.clear();
+                    return false;
+                }
+                free_list.push_back(sandbox.get());
+                sandboxes.push_back(std::move(sandbox));
+            }
+            enabled = !sandboxes.empty();
+            LOG(INFO) << "沙箱池启动成功，沙箱个数: " << sandboxes.size() << "\n";
+            return enabled;
+        }
+
+        bool Enabled() const
+        {
+            return enabled;
+        }
+
+        // 取出一个空闲的沙箱，没有空闲的就等待
+        Zygote *Acquire()
+        {
+            int64_t begin = TimeUtil::GetMonotonicMs();
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]()
+                    { return !free_list.empty(); });
+            Zygote *sandbox = free_list.back();
+            free_list.pop_back();
+            ++acquired;
+            wait_ms += TimeUtil::GetMonotonicMs() - begin;
+            return sandbox;
+        }
+
+        // 不等待：没有空闲的沙箱时返回nullptr
+        // fork server用它：fork server占着沙箱直到整个作业结束，不能在call_once里排队等沙箱，
+        // 拿不到就不启动，用例改为exec运行，和普通运行一样按用例排队
+        Zygote *TryAcquire()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (free_list.empty())
+            {
+                ++unavailable;
+                return nullptr;
+            }
+            Zygote *sandbox = free_list.back();
+            free_list.pop_back();
+            ++acquired;
+            return sandbox;
+        }
+
+        // 用户程序已经退出，沙箱放回池子(沙箱进程会先清理环境再处理下一个请求)
+        void Release(Zygote *sandbox)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                free_list.push_back(sandbox);
+            }
+            cv.notify_one();
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["enabled"] = enabled;
+            stats["sandboxes"] = Json::UInt64(sandboxes.size());
+            stats["free"] = Json::UInt64(free_list.size());
+            stats["acquired"] = Json::UInt64(acquired);
+            stats["wait_ms"] = Json::UInt64(wait_ms);
+            stats["unavailable"] = Json::UInt64(unavailable);
+            return stats;
+        }
+
+    private:
+        SandboxPool() = default;
+        SandboxPool(const SandboxPool &) = delete;
+        SandboxPool &operator=(const SandboxPool &) = delete;
+
+        // 在沙箱里跑一次/bin/true，确认命名空间、挂载、降权和seccomp都设置成功
+        static bool Probe(Zygote *sandbox)
+        {
+            SpawnRequest req;
+            req.argv = {"/bin/true"};
+            ExitInfo info;
+            return sandbox->Spawn(req, &info) && WIFEXITED(info.status) && WEXITSTATUS(info.status) == 0;
+        }
+
+    private:
+        bool enabled = false;
+        std::vector<std::unique_ptr<Zygote>> sandboxes;
+        std::vector<Zygote *> free_list;
+        std::mutex mtx;
+        std::condition_variable cv;
+        uint64_t acquired = 0;
+        uint64_t wait_ms = 0;
+        uint64_t unavailable = 0; // TryAcquire没拿到沙箱的次数
+    };
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <iostream>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <jsoncpp/json/json.h>
+
+// 判题任务的准入控制：同时执行的任务数不超过max_running，多出来的按到达顺序(FIFO)排队，
+// 排队的任务数也有上限max_queued，队列满了立即拒绝(503 + Retry-After)，让oj_server换一台主机或者稍后重试
+// 这样比赛时的突发流量不会让所有g++同时抢CPU和内存，把每个任务都拖慢
+namespace ns_scheduler
+{
+    using namespace ns_util;
+    using namespace ns_log;
+
+    class JobScheduler
+    {
+    public:
+        static JobScheduler &Instance()
+        {
+            static JobScheduler scheduler;
+            return scheduler;
+        }
+
+        void Init(size_t running_limit, size_t queue_limit)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            max_running = running_limit > 0 ? running_limit : 1;
+            max_queued = queue_limit;
+            LOG(INFO) << "判题并发上限: " << max_running << " 排队上限: " << max_queued << "\n";
+        }
+
+        // 申请一个执行名额：有空闲名额直接返回true；队列已满立即返回false；否则排队等待
+        bool Acquire()
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            if (running < max_running && waiting.empty())
+            {
+                ++running;
+                ++admitted;
+                return true;
+            }
+            if (waiting.size() >= max_queued)
+            {
+                ++rejected;
+                return false;
+            }
+            uint64_t ticket = next_ticket++;
+            waiting.push_back(ticket);
+            int64_t begin = TimeUtil::GetMonotonicMs();
+            cv.wait(lock, [&]()
+                    { return waiting.front() == ticket && running < max_running; });
+            waiting.pop_front();
+            ++running;
+            ++admitted;
+            wait_ms += TimeUtil::GetMonotonicMs() - begin;
+            // 唤醒下一个排队的任务检查是否还有空闲名额
+            cv.notify_all();
+            return true;
+        }
+
+        void Release()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            --running;
+            cv.notify_all();
+        }
+
+        size_t Capacity()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            return max_running + max_queued;
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["running"] = Json::UInt64(running);
+            stats["queued"] = Json::UInt64(waiting.size());
+            stats["max_running"] = Json::UInt64(max_running);
+            stats["max_queued"] = Json::UInt64(max_queued);
+            stats["admitted"] = Json::UInt64(admitted);
+            stats["rejected"] = Json::UInt64(rejected);
+            stats["queue_wait_ms"] = Json::UInt64(wait_ms);
+            return stats;
+        }
+
+    private:
+        JobScheduler() = default;
+        JobScheduler(const JobScheduler &) = delete;
+        JobScheduler &operator=(const JobScheduler &) = delete;
+
+    private:
+        std::mutex mtx;
+        std::condition_variable cv;
+        size_t max_running = 1;
+        size_t max_queued = 0;
+        size_t running = 0;
+        std::deque<uint64_t> waiting; // 排队任务的号码，队头先执行
+        uint64_t next_ticket = 0;
+        uint64_t admitted = 0;
+        uint64_t rejected = 0;
+        uint64_t wait_ms = 0;
+    };
+
+    // 执行名额的RAII封装
+    class JobSlot
+    {
+    public:
+        JobSlot() : acquired(JobScheduler::Instance().Acquire())
+        {}
+        ~JobSlot()
+        {
+            if (acquired) JobScheduler::Instance().Release();
+        }
+        bool Acquired() const
+        {
+            return acquired;
+        }
+
+    private:
+        JobSlot(const JobSlot &) = delete;
+        JobSlot &operator=(const JobSlot &) = delete;
+
+        bool acquired;
+    };
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "../comm/log.hpp"
+
+#include <string>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <jsoncpp/json/json.h>
+
+// 机器速度校准：集群里新旧机器混用，同样的cpu_limit在慢的机器上更容易超时
+// 启动时运行一段固定的单线程基准程序，和参考机器上的耗时相比得到速度系数(慢的机器大于1)
+// 运行时的CPU时间和墙上时间限制乘以这个系数，运行结束后CPU时间除以这个系数再和题目的限制比较，
+// 题目的时间限制因此在每台机器上都是"参考机器上的时间"，负载均衡可以把任务发给任意一台机器
+namespace ns_speed
+{
+    using namespace ns_log;
+
+    class SpeedCalibration
+    {
+    public:
+        static SpeedCalibration &Instance()
+        {
+            static SpeedCalibration speed;
+            return speed;
+        }
+
+        // reference_ms: 参考机器上基准程序的耗时，0表示不缩放，也不运行基准程序(启动时大约多花1秒)
+        // factor: 不为0时直接使用这个系数，不运行基准程序
+        void Init(int64_t reference_ms, double factor)
+        {
+            if (factor > 0)
+            {
+                speed_factor = factor;
+            }
+            else if (reference_ms > 0)
+            {
+                benchmark_ms = Benchmark();
+                speed_factor = static_cast<double>(benchmark_ms) / reference_ms;
+            }
+            else
+            {
+                return;
+            }
+            LOG(INFO) << "机器速度校准，基准程序耗时: " << benchmark_ms << "ms 速度系数: " << speed_factor << "\n";
+        }
+
+        // 是否需要缩放时间限制
+        bool Scaling() const
+        {
+            return speed_factor != 1.0;
+        }
+
+        double Factor() const
+        {
+            return speed_factor;
+        }
+
+        // 参考机器上的时间(ms)换算成本机的时间
+        int64_t ScaleMs(int64_t ms) const
+        {
+            return static_cast<int64_t>(std::ceil(ms * speed_factor));
+        }
+
+        // RLIMIT_CPU只能按秒设置，向上取整，精确的判定由Normalize之后的CPU时间完成
+        int ScaleSeconds(int seconds) const
+        {
+            return static_cast<int>(std::ceil(seconds * speed_factor));
+        }
+
+        // 本机的时间(ms)换算成参考机器上的时间
+        int64_t Normalize(int64_t ms) const
+        {
+            return static_cast<int64_t>(ms / speed_factor);
+        }
+
+        Json::Value Stats()
+        {
+            Json::Value stats;
+            stats["benchmark_ms"] = Json::Int64(benchmark_ms);
+            stats["factor"] = speed_factor;
+            return stats;
+        }
+
+        // 基准程序：整数运算、随机访存(8MB，超出L2)和指针追逐(依赖的访存)的混合，运行3次取最快的一次(ms)
+        // 工作量固定，耗时只取决于单核的速度；bench speed可以单独运行，得到参考机器的speed_reference_ms
+        // 编译服务和bench的优化级别不同，这里固定为O2，两者测得的耗时才能相互比较；
+        // 因此只用裸数组和内联的循环，不调用标准库的模板(它们按调用方的优化级别实例化)
+        __attribute__((optimize("O2"))) static int64_t Benchmark()
+        {
+            const uint32_t size = 1 << 21;
+            uint32_t *table = new uint32_t[size];
+            int64_t best = 0;
+            for (int round = 0; round < 3; ++round)
+            {
+                int64_t begin = ThreadCpuNs();
+                uint32_t x = 1;
+                for (uint32_t i = 0; i < size; ++i)
+                {
+                    x = x * 1103515245u + 12345u;
+                    table[i] = x;
+                }
+                for (int i = 0; i < 20000000; ++i)
+                {
+                    x = x * 1103515245u + 12345u;
+                    table[x & (size - 1)] += x >> 7;
+                }
+                uint32_t next = x & (size - 1);
+                for (int i = 0; i < 2000000; ++i)
+                {
+                    next = table[next] & (size - 1);
+                }
+                volatile uint32_t sink = next;
+                (void)sink;
+                int64_t ms = (ThreadCpuNs() - begin) / 1000000;
+                if (round == 0 || ms < best)
+                {
+                    best = ms;
+                }
+            }
+            delete[] table;
+            return best > 0 ? best : 1;
+        }
+
+    private:
+        SpeedCalibration() = default;
+        SpeedCalibration(const SpeedCalibration &) = delete;
+        SpeedCalibration &operator=(const SpeedCalibration &) = delete;
+
+        static int64_t ThreadCpuNs()
+        {
+            timespec ts;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        }
+
+    private:
+        int64_t benchmark_ms = 0;
+        double speed_factor = 1.0;
+    };
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "memfd.hpp"
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <jsoncpp/json/json.h>
+
+// 测试数据仓库：每道题每个版本的测试数据只在编译服务上保存一份
+// 输入和期望输出都是封存(只读)的内存文件，输入按fd交给子进程作为标准输入，期望输出映射到内存里直接给checker比较
+// 同时运行的多个用例、多次提交共用同一份数据，不再为每次运行复制一遍输入或者写临时文件
+// oj_server只在编译服务没有这份数据时才附带测试数据(见oj_control.hpp)，版本是所有输入输出的摘要(HashUtil::Sha256List)
+// 新版本上传后原子地替换旧版本，正在运行的用例持有旧版本的shared_ptr，用完后才释放
+namespace ns_testdata
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_memfd;
+
+    // 一个封存的内存文件，可选地只读映射到内存
+    class SealedFile
+    {
+    public:
+        SealedFile() = default;
+        SealedFile(const SealedFile &) = delete;
+        SealedFile &operator=(const SealedFile &) = delete;
+
+        ~SealedFile()
+        {
+            if (mapped != nullptr)
+            {
+                munmap(mapped, size);
+            }
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+
+        // map: 是否映射到内存(期望输出需要，标准输入只需要fd)
+        bool Create(const char *name, const std::string &content, bool map)
+        {
+            fd = MemFd::CreateSealed(name, content);
+            if (fd < 0)
+            {
+                return false;
+            }
+            size = content.size();
+            // 长度为0的文件不能映射
+            if (map && size > 0)
+            {
+                void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p == MAP_FAILED)
+                {
+                    LOG(ERROR) << "映射测试数据失败: " << name << "\n";
+                    return false;
+                }
+                mapped = static_cast<char *>(p);
+            }
+            return true;
+        }
+
+        int Fd() const
+        {
+            return fd;
+        }
+
+        const char *Data() const
+        {
+            return mapped != nullptr ? mapped : "";
+        }
+
+        size_t Size() const
+        {
+            return size;
+        }
+
+    private:
+        int fd = -1;
+        char *mapped = nullptr;
+        size_t size = 0;
+    };
+
+    // 一道题某个版本的全部测试用例，创建之后只读，可以被多个线程同时使用
+    class TestData
+    {
+    public:
+        // tests: [{"input": 标准输入, "output": 期望输出}, ...]，失败返回nullptr
+        static std::shared_ptr<const TestData> Create(const Json::Value &tests)
+        {
+            std::shared_ptr<TestData> data = std::make_shared<TestData>();
+            for (const auto &test : tests)
+            {
+                std::unique_ptr<SealedFile> input(new SealedFile());
+                std::unique_ptr<SealedFile> output(new SealedFile());
+                if (!input->Create("test_input", test["input"].asString(), false) ||
+                    !output->Create("test_output", test["output"].asString(), true))
+                {
+                    return nullptr;
+                }
+                data->bytes += input->Size() + output->Size();
+                data->inputs.push_back(std::move(input));
+                data->outputs.push_back(std::move(output));
+            }
+            return data;
+        }
+
+        // 按请求里的测试用例计算版本
+        static std::string Version(const Json::Value &tests)
+        {
+            std::vector<std::string> parts;
+            for (const auto &test : tests)
+            {
+                parts.push_back(test["input"].asString());
+                parts.push_back(test["output"].asString());
+            }
+            return HashUtil::Sha256List(parts);
+        }
+
+        size_t Size() const
+        {
+            return inputs.size();
+        }
+
+        // 第index个用例的标准输入，所有运行共用这一个fd，使用前要MemFd::Reopen得到自己的读取位置
+        int InputFd(size_t index) const
+        {
+            return inputs[index]->Fd();
+        }
+
+        // 第index个用例的期望输出
+        const SealedFile &Expected(size_t index) const
+        {
+            return *outputs[index];
+        }
+
+        size_t Bytes() const
+        {
+            return bytes;
+        }
+
+    private:
+        std::vector<std::unique_ptr<SealedFile>> inputs;
+        std::vector<std::unique_ptr<SealedFile>> outputs;
+        size_t bytes = 0;
+    };
+
+    class TestDataStore
+    {
+    public:
+        static TestDataStore &Instance()
+        {
+            static TestDataStore store;
+            return store;
+        }
+
+        // max_bytes: 所有题目的测试数据合计的上限，超过时淘汰最久没有用到的题目，0表示不限制
+        void Init(uint64_t max_bytes)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            capacity = max_bytes;
+        }
+
+        // 取题号为id、版本为version的测试数据，没有(从没上传过、版本已经更新或者被淘汰)时返回nullptr
+        std::shared_ptr<const TestData> Get(const std::string &id, const std::string &version)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto iter = entries.find(id);
+            if (iter == entries.end() || iter->second.version != version)
+            {
+                ++misses;
+                return nullptr;
+            }
+            ++hits;
+            iter->second.last_use = ++clock;
+            return iter->second.data;
+        }
+
+        // 上传测试数据：版本必须和内容一致；已经有这个版本时直接返回，否则创建后替换这道题原来的版本
+        // 失败返回nullptr
+        std::shared_ptr<const TestData> Put(const std::string &id, const std::string &version, const Json::Value &tests)
+        {
+            if (std::shared_ptr<const TestData> data = Get(id, version))
+            {
+                return data;
+            }
+            if (id.empty() || version != TestData::Version(tests))
+            {
+                LOG(ERROR) << "测试数据参数不合法，题号: " << id << " 版本: " << version << "\n";
+                return nullptr;
+            }
+            // 在锁外创建，创建好之后整体替换，同一时刻只有完整的旧版本或者新版本
+            std::shared_ptr<const TestData> data = TestData::Create(tests);
+            if (!data)
+            {
+                return nullptr;
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            Entry &entry = entries[id];
+            used -= entry.data ? entry.data->Bytes() : 0;
+            entry.version = version;
+            entry.data = data;
+            entry.last_use = ++clock;
+            used += data->Bytes();
+            ++uploads;
+            EvictLocked(id);
+            LOG(INFO) << "测试数据已更新，题号: " << id << " 用例数: " << data->Size() << " 字节: " << data->Bytes() << "\n";
+            return data;
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["questions"] = Json::UInt64(entries.size());
+            stats["bytes"] = Json::UInt64(used);
+            stats["hits"] = Json::UInt64(hits);
+            stats["misses"] = Json::UInt64(misses);
+            stats["uploads"] = Json::UInt64(uploads);
+            stats["evictions"] = Json::UInt64(evictions);
+            return stats;
+        }
+
+    private:
+        TestDataStore() = default;
+        TestDataStore(const TestDataStore &) = delete;
+        TestDataStore &operator=(const TestDataStore &) = delete;
+
+        struct Entry
+        {
+            std::string version;
+            std::shared_ptr<const TestData> data;
+            uint64_t last_use = 0;
+        };
+
+        // 超过上限时淘汰最久没有用到的题目，刚上传的keep除外；题目不多，直接遍历
+        void EvictLocked(const std::string &keep)
+        {
+            while (capacity > 0 && used > capacity)
+            {
+                auto victim = entries.end();
+                for (auto iter = entries.begin(); iter != entries.end(); ++iter)
+                {
+                    if (iter->first != keep && (victim == entries.end() || iter->second.last_use < victim->second.last_use))
+                    {
+                        victim = iter;
+                    }
+                }
+                if (victim == entries.end())
+                {
+                    return;
+                }
+                used -= victim->second.data->Bytes();
+                entries.erase(victim);
+                ++evictions;
+            }
+        }
+
+    private:
+        std::mutex mtx;
+        std::unordered_map<std::string, Entry> entries; // 题号 -> 当前版本
+        uint64_t capacity = 0;
+        uint64_t used = 0;
+        uint64_t clock = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t uploads = 0;
+        uint64_t evictions = 0;
+    };
+}
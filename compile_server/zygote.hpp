@@ -0,0 +1,547 @@
+#pragma once
+
+#include "../comm/util.hpp"
+#include "../comm/log.hpp"
+#include "launcher.hpp"
+#include "zygote_protocol.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <cstring>
+#include <cerrno>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+
+// zygote：编译服务启动时(还没有创建任何线程)fork出来的单线程小进程
+// 编译服务的请求线程不再自己fork，而是把"创建子进程"的请求通过socketpair发给zygote，
+// 由zygote通过Launcher完成创建子进程，并把子进程的pid和退出状态回传
+// zygote的地址空间很小而且只有一个线程，fork的开销不会随着编译服务变大变忙而增长
+// 协议见zygote_protocol.hpp，用户程序里的fork server(见forkserver.hpp)也说同样的协议，同样用这个类作为客户端
+namespace ns_zygote
+{
+    using namespace ns_util;
+    using namespace ns_log;
+    using namespace ns_launcher;
+
+    // 定制zygote进程，用于把zygote变成沙箱(见sandbox.hpp)
+    struct ZygoteOptions
+    {
+        std::function<bool()> setup;   // fork之后、进入主循环之前在zygote进程里执行，返回false则zygote退出
+        std::function<void()> recycle; // 每回收一个子进程之后在zygote进程里执行，用来清理环境
+        const sock_fprog *seccomp = nullptr; // 子进程exec之前安装的seccomp过滤器，指向zygote进程里的内存
+        int uid = -1;                  // 子进程exec之前切换到的用户和组，-1表示不切换
+        int gid = -1;
+        bool pid_namespace = false;    // zygote在新的PID命名空间里作为1号进程运行(在setup之前进入)
+    };
+
+    class Zygote
+    {
+    public:
+        static Zygote &Instance()
+        {
+            static Zygote zygote;
+            return zygote;
+        }
+
+        Zygote() = default;
+
+        // 必须在创建任何线程之前调用
+        bool Start(const ZygoteOptions &options = ZygoteOptions())
+        {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+            {
+                LOG(ERROR) << "创建zygote通信管道失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                LOG(ERROR) << "创建zygote进程失败: " << strerror(errno) << "\n";
+                close(sv[0]);
+                close(sv[1]);
+                return false;
+            }
+            if (pid == 0)
+            {
+                close(sv[0]);
+                // 编译服务退出，zygote跟着退出
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+                if (options.pid_namespace && !EnterPidNamespace(sv[1]))
+                {
+                    _exit(1);
+                }
+                if (options.setup && !options.setup())
+                {
+                    _exit(1);
+                }
+                Loop(sv[1], options);
+                _exit(0);
+            }
+            close(sv[1]);
+            control_fd = sv[0];
+            LOG(INFO) << "zygote进程启动成功, pid: " << pid << "\n";
+            return true;
+        }
+
+        // 接管一个已经建立好的控制socket，对端是停在main之前的fork server
+        void Attach(int fd)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            control_fd = fd;
+        }
+
+        // 关闭控制socket，对端处理完剩下的子进程之后退出
+        void Close()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (control_fd >= 0)
+            {
+                close(control_fd);
+                control_fd = -1;
+            }
+        }
+
+        bool Available() const
+        {
+            return control_fd >= 0;
+        }
+
+        // 通过zygote创建子进程并等待其退出
+        // 返回值：true表示子进程已经退出，info中是退出信息；false表示内部错误
+        // 墙上时间在这一侧计时，超时直接杀掉子进程的进程组，zygote随后照常回传退出状态
+        bool Spawn(const SpawnRequest &req, ExitInfo *info)
+        {
+            int64_t start = TimeUtil::GetMonotonicMs();
+            pid_t pid = -1;
+            int reply_fd = Launch(req, &pid);
+            if (reply_fd < 0)
+            {
+                return false;
+            }
+            info->wall_timeout = false;
+            if (req.wall_limit > 0 && !Launcher::WaitReadable(reply_fd, req.wall_limit))
+            {
+                // 还没有收到EXITED，说明zygote还没有回收子进程，pid不会被复用
+                info->wall_timeout = true;
+                Launcher::KillGroup(pid);
+            }
+            if (!Collect(reply_fd, info))
+            {
+                return false;
+            }
+            info->usage.wall_ms = TimeUtil::GetMonotonicMs() - start;
+            return true;
+        }
+
+        // 把创建请求发给zygote，收到STARTED之后返回应答socket，子进程退出后它变为可读
+        // 返回值：应答socket，失败返回-1；pid：子进程的pid
+        int Launch(const SpawnRequest &req, pid_t *pid)
+        {
+            std::string payload;
+            RequestHeader header;
+            header.argc = static_cast<int>(req.argv.size());
+            header.cpu_limit = req.cpu_limit;
+            header.mem_limit = req.mem_limit;
+            header.fsize_limit = req.fsize_limit;
+            header.has_exe = req.exe_fd >= 0;
+            header.has_stdin = req.stdin_fd >= 0;
+            header.has_stdout = req.stdout_fd >= 0;
+            header.has_stderr = req.stderr_fd >= 0;
+            header.has_cgroup = req.cgroup_fd >= 0;
+            header.has_control = req.control_fd >= 0;
+            header.cpu = req.cpu;
+            payload.append(reinterpret_cast<const char *>(&header), sizeof(header));
+            for (const auto &arg : req.argv)
+            {
+                payload += arg;
+                payload.push_back('\0');
+            }
+            if (req.argv.empty() || payload.size() > max_request_size)
+            {
+                LOG(ERROR) << "zygote请求不合法" << "\n";
+                return -1;
+            }
+
+            int sv[2];
+            int on = 1;
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+            {
+                LOG(ERROR) << "创建zygote应答管道失败: " << strerror(errno) << "\n";
+                return -1;
+            }
+            // STARTED附带发送方的凭证，子进程的pid以它为准，见ReadStarted
+            if (setsockopt(sv[0], SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
+            {
+                LOG(ERROR) << "设置zygote应答管道失败: " << strerror(errno) << "\n";
+                close(sv[0]);
+                close(sv[1]);
+                return -1;
+            }
+            std::vector<int> fds = {sv[1]};
+            if (header.has_exe) fds.push_back(req.exe_fd);
+            if (header.has_stdin) fds.push_back(req.stdin_fd);
+            if (header.has_stdout) fds.push_back(req.stdout_fd);
+            if (header.has_stderr) fds.push_back(req.stderr_fd);
+            if (header.has_cgroup) fds.push_back(req.cgroup_fd);
+            if (header.has_control) fds.push_back(req.control_fd);
+
+            bool sent = false;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                sent = control_fd >= 0 && SendFds(control_fd, payload, fds);
+            }
+            close(sv[1]);
+            if (!sent)
+            {
+                LOG(ERROR) << "发送请求给zygote失败: " << strerror(errno) << "\n";
+                close(sv[0]);
+                return -1;
+            }
+
+            Reply reply;
+            if (!ReadStarted(sv[0], &reply))
+            {
+                LOG(ERROR) << "zygote创建子进程失败" << "\n";
+                close(sv[0]);
+                return -1;
+            }
+            *pid = reply.pid;
+            return sv[0];
+        }
+
+        // 读取Launch返回的应答socket上的EXITED，并关闭socket
+        // info中填入退出状态、CPU时间和峰值内存(墙上时间由调用方计算)
+        // 返回值：false表示没有收到退出状态
+        static bool Collect(int reply_fd, ExitInfo *info)
+        {
+            Reply reply;
+            bool exited = ReadReply(reply_fd, &reply) && reply.type == EXITED;
+            close(reply_fd);
+            if (!exited)
+            {
+                LOG(ERROR) << "没有收到zygote回传的退出状态" << "\n";
+                return false;
+            }
+            info->status = reply.status;
+            info->usage.cpu_ms = reply.cpu_ms;
+            info->usage.max_rss_kb = reply.max_rss_kb;
+            return true;
+        }
+
+        // 读取一条应答，fork server启动时的READY也用它读取
+        static bool ReadReply(int sock, Reply *reply)
+        {
+            ssize_t n;
+            do
+            {
+                n = read(sock, reply, sizeof(*reply));
+            } while (n < 0 && errno == EINTR);
+            return n == sizeof(*reply);
+        }
+
+    private:
+        Zygote(const Zygote &) = delete;
+        Zygote &operator=(const Zygote &) = delete;
+
+        // 读取STARTED，子进程的pid取自内核附上的SCM_CREDENTIALS而不是应答的内容：
+        // 内核把它换算成编译服务所在PID命名空间里的pid(沙箱里的pid和外面不一样)，
+        // 没有特权的发送方也没法冒充别的进程(fork server是用户程序，由子进程自己发送STARTED)
+        static bool ReadStarted(int sock, Reply *reply)
+        {
+            iovec iov;
+            iov.iov_base = reply;
+            iov.iov_len = sizeof(*reply);
+            char control[CMSG_SPACE(sizeof(ucred))];
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            ssize_t n;
+            do
+            {
+                n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            } while (n < 0 && errno == EINTR);
+            if (n != sizeof(*reply) || reply->type != STARTED || reply->pid < 0)
+            {
+                return false;
+            }
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS)
+                {
+                    ucred cred;
+                    memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+                    reply->pid = cred.pid;
+                    return cred.pid > 0;
+                }
+            }
+            return false;
+        }
+
+        // 进入新的PID命名空间：unshare之后只有新创建的子进程在里面，所以再fork一次，
+        // 子进程成为1号进程并返回true继续做zygote；当前进程只等它退出，不再返回
+        // 1号进程退出时内核杀掉命名空间里剩下的所有进程
+        static bool EnterPidNamespace(int control)
+        {
+            if (unshare(CLONE_NEWPID) < 0)
+            {
+                LOG(ERROR) << "zygote创建PID命名空间失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                LOG(ERROR) << "zygote进入PID命名空间失败: " << strerror(errno) << "\n";
+                return false;
+            }
+            if (pid == 0)
+            {
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+                return true;
+            }
+            close(control);
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            {
+            }
+            _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+        }
+
+        static bool SendFds(int sock, const std::string &payload, const std::vector<int> &fds)
+        {
+            iovec iov;
+            iov.iov_base = const_cast<char *>(payload.data());
+            iov.iov_len = payload.size();
+
+            std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()), 0);
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+            return sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(payload.size());
+        }
+
+        // 返回收到的字节数，0表示对端关闭，<0表示出错
+        static ssize_t RecvFds(int sock, char *buffer, size_t size, std::vector<int> *fds)
+        {
+            iovec iov;
+            iov.iov_base = buffer;
+            iov.iov_len = size;
+
+            char control[CMSG_SPACE(sizeof(int) * 8)];
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            if (n <= 0)
+            {
+                return n;
+            }
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                {
+                    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    int *data = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+                    fds->insert(fds->end(), data, data + count);
+                }
+            }
+            return n;
+        }
+
+        static void WriteReply(int sock, const Reply &reply)
+        {
+            // 请求方已经放弃等待时会失败，忽略即可
+            send(sock, &reply, sizeof(reply), MSG_NOSIGNAL);
+        }
+
+        // 回复STARTED，显式附上子进程的凭证(zygote是root，可以代子进程发送)，请求方从中取得pid
+        static void WriteStarted(int sock, const Reply &reply)
+        {
+            iovec iov;
+            iov.iov_base = const_cast<Reply *>(&reply);
+            iov.iov_len = sizeof(reply);
+            char control[CMSG_SPACE(sizeof(ucred))];
+            memset(control, 0, sizeof(control));
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            if (reply.pid > 0)
+            {
+                ucred cred;
+                cred.pid = reply.pid;
+                cred.uid = getuid();
+                cred.gid = getgid();
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+                cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_CREDENTIALS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(cred));
+                memcpy(CMSG_DATA(cmsg), &cred, sizeof(cred));
+            }
+            sendmsg(sock, &msg, MSG_NOSIGNAL);
+        }
+
+        // zygote进程的主循环，只处理两类事件：新的创建请求、子进程退出
+        static void Loop(int control, const ZygoteOptions &options)
+        {
+            sigset_t mask, old_mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &mask, &old_mask);
+            int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+            std::unordered_map<pid_t, int> waiting; // 子进程pid -> 应答的socket
+            std::vector<char> buffer(max_request_size);
+            bool running = true;
+            while (running || !waiting.empty())
+            {
+                pollfd pfds[2];
+                pfds[0].fd = sig_fd;
+                pfds[0].events = POLLIN;
+                pfds[1].fd = running ? control : -1;
+                pfds[1].events = POLLIN;
+                if (poll(pfds, 2, -1) < 0)
+                {
+                    continue;
+                }
+
+                if (pfds[0].revents & POLLIN)
+                {
+                    signalfd_siginfo info;
+                    while (read(sig_fd, &info, sizeof(info)) > 0)
+                    {
+                    }
+                    int status = 0;
+                    struct rusage ru;
+                    pid_t pid;
+                    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+                    {
+                        auto iter = waiting.find(pid);
+                        if (iter == waiting.end())
+                        {
+                            continue;
+                        }
+                        ExitInfo info;
+                        Launcher::FillUsage(ru, &info.usage);
+                        Reply reply = {EXITED, pid, status, 0, info.usage.cpu_ms, info.usage.max_rss_kb};
+                        WriteReply(iter->second, reply);
+                        close(iter->second);
+                        waiting.erase(iter);
+                        if (options.recycle)
+                        {
+                            options.recycle();
+                        }
+                    }
+                }
+
+                if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR))
+                {
+                    std::vector<int> fds;
+                    ssize_t n = RecvFds(control, buffer.data(), buffer.size(), &fds);
+                    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN))
+                    {
+                        // 编译服务关闭了通信管道，处理完剩下的子进程就退出
+                        running = false;
+                        continue;
+                    }
+                    if (n > 0)
+                    {
+                        HandleRequest(buffer.data(), n, fds, old_mask, options, &waiting);
+                    }
+                }
+            }
+        }
+
+        static void HandleRequest(const char *data, size_t size, const std::vector<int> &fds, const sigset_t &child_mask,
+                                  const ZygoteOptions &options, std::unordered_map<pid_t, int> *waiting)
+        {
+            RequestHeader header;
+            if (size < sizeof(header) || fds.empty())
+            {
+                for (int fd : fds) close(fd);
+                return;
+            }
+            memcpy(&header, data, sizeof(header));
+            int reply_fd = fds[0];
+            size_t index = 1;
+            int exe_fd = header.has_exe && index < fds.size() ? fds[index++] : -1;
+            int stdin_fd = header.has_stdin && index < fds.size() ? fds[index++] : -1;
+            int stdout_fd = header.has_stdout && index < fds.size() ? fds[index++] : -1;
+            int stderr_fd = header.has_stderr && index < fds.size() ? fds[index++] : -1;
+            int cgroup_fd = header.has_cgroup && index < fds.size() ? fds[index++] : -1;
+            int control_fd = header.has_control && index < fds.size() ? fds[index++] : -1;
+
+            SpawnRequest req;
+            req.exe_fd = exe_fd;
+            req.stdin_fd = stdin_fd;
+            req.stdout_fd = stdout_fd;
+            req.stderr_fd = stderr_fd;
+            req.cgroup_fd = cgroup_fd;
+            req.control_fd = control_fd;
+            req.cpu_limit = header.cpu_limit;
+            req.mem_limit = header.mem_limit;
+            req.fsize_limit = header.fsize_limit;
+            req.cpu = header.cpu;
+            req.seccomp = options.seccomp;
+            req.uid = options.uid;
+            req.gid = options.gid;
+            const char *p = data + sizeof(header);
+            const char *end = data + size;
+            while (p < end && static_cast<int>(req.argv.size()) < header.argc)
+            {
+                size_t len = strnlen(p, end - p);
+                req.argv.emplace_back(p, len);
+                p += len + 1;
+            }
+
+            pid_t pid = Launcher::Spawn(req, &child_mask);
+            Reply reply = {STARTED, pid, 0, pid < 0 ? errno : 0, 0, 0};
+            WriteStarted(reply_fd, reply);
+            for (size_t i = 1; i < fds.size(); ++i)
+            {
+                close(fds[i]);
+            }
+            if (pid < 0)
+            {
+                close(reply_fd);
+                return;
+            }
+            (*waiting)[pid] = reply_fd;
+        }
+
+    private:
+        std::mutex mtx;
+        int control_fd = -1;
+    };
+}
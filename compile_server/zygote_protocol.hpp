@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// zygote的通信协议：编译服务和zygote、沙箱、用户程序里的fork server(forkserver_stub.cpp)共用
+// 只有定长的结构体，不依赖编译服务的其他头文件，链接进用户程序的stub也可以直接包含(-std=c++11)
+//
+// 每次请求新建一对SOCK_SEQPACKET，把其中一端和子进程的标准输入输出(以及要执行的文件、要加入的cgroup)一起通过SCM_RIGHTS发出
+// 对方在这一端先回复一条STARTED(pid)，子进程退出后再回复一条EXITED(status)，然后关闭
+// STARTED要带上子进程的SCM_CREDENTIALS(zygote显式附上，fork server由子进程自己发送)，请求方只认凭证里的pid
+namespace ns_zygote
+{
+    enum ReplyType
+    {
+        STARTED = 1,
+        EXITED = 2,
+        READY = 3, // fork server停在main之前、可以接收请求时在控制socket上发送一次
+    };
+
+    struct Reply
+    {
+        int type;
+        int pid;    // STARTED: 子进程pid(发送方所在PID命名空间里的)，创建失败为-1
+        int status; // EXITED: waitpid风格的退出状态
+        int err;    // 创建失败时的errno
+        int64_t cpu_ms;     // EXITED: 子进程的CPU时间
+        int64_t max_rss_kb; // EXITED: 子进程的峰值常驻内存
+    };
+
+    // 请求的定长头部，后面紧跟着以'\0'分隔的argv
+    // 随请求发送的fd依次为：应答socket、exe、stdin、stdout、stderr、cgroup、control，没有的跳过
+    struct RequestHeader
+    {
+        int argc;
+        int cpu_limit;
+        int mem_limit;
+        int fsize_limit;
+        int has_exe;
+        int has_stdin;
+        int has_stdout;
+        int has_stderr;
+        int has_cgroup;
+        int has_control;
+        int cpu; // 绑定的核，-1表示不绑定
+    };
+
+    const size_t max_request_size = 64 * 1024;
+
+    // fork server的控制socket在用户程序里的fd，和AFL一样选一个普通程序用不到的编号
+    const int fork_server_fd = 198;
+}
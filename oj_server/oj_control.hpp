@@ -7,12 +7,16 @@
 #include <mutex>
 #include <cassert>
 #include <fstream>
+#include <thread>
+#include <functional>
+#include <atomic>
 
 #include <jsoncpp/json/json.h>
 
 #include "../comm/httplib.h"
 #include "oj_model.hpp"
 #include "oj_view.hpp"
+#include "oj_job.hpp"
 
 namespace ns_control
 {
@@ -20,9 +24,43 @@ namespace ns_control
     using namespace ns_util;
     using namespace ns_model;
     using namespace ns_view;
+    using namespace ns_job;
     using namespace httplib;
 
     const std::string service_machine = "./conf/service_machine.conf";
+    const int judge_workers = 16; // 异步判题的后台线程数，也是同时发给编译服务的异步任务的上限
+    // httplib每个连接占用一个线程，事件流和长轮询在等待判题进度的整个过程中都占着线程
+    // 同时等待的请求不超过max_waiters，超过时事件流返回503、长轮询立即返回，浏览器退回到普通轮询；
+    // 线程池在此之外再留出http_spare_threads个线程，题目页面、提交等普通请求不会被等待的请求饿死
+    const size_t max_waiters = judge_workers * 4;
+    const size_t http_spare_threads = 16;
+    const size_t http_threads = max_waiters + http_spare_threads;
+
+    // 一个等待判题进度的名额，析构时归还；事件流的名额由chunked content provider持有，直到应答结束
+    class WaitSlot
+    {
+    public:
+        explicit WaitSlot(std::atomic<size_t>* waiting)
+            : count(waiting), acquired(++*waiting <= max_waiters)
+        {
+            if(!acquired) --*count;
+        }
+        ~WaitSlot()
+        {
+            if(acquired) --*count;
+        }
+        bool Acquired() const
+        {
+            return acquired;
+        }
+
+    private:
+        WaitSlot(const WaitSlot&) = delete;
+        WaitSlot& operator=(const WaitSlot&) = delete;
+
+        std::atomic<size_t>* count;
+        bool acquired;
+    };
 
     // 提供服务的主机
     struct Machine
@@ -117,7 +155,8 @@ namespace ns_control
             return true;
         }
 
-        bool SmartChoice(int *id, Machine** m)
+        // exclude: 本次请求中已经返回繁忙的主机，不再选择
+        bool SmartChoice(int *id, Machine** m, const std::vector<int>& exclude = std::vector<int>())
         {
             // 1. 使用选择好的主机(更新主机的负载)
             // 2. 需要选择可能离线该主机
@@ -133,21 +172,29 @@ namespace ns_control
                 return false;
             }
             // 找到负载最小的机器
-            *id = online[0];
-            *m = &machines[online[0]];
-            uint64_t min_load = machines[online[0]].Load();
-            for(int i = 1;i < online_num; ++i)
+            bool found = false;
+            uint64_t min_load = 0;
+            for(int i = 0;i < online_num; ++i)
             {
+                if(find(exclude.begin(), exclude.end(), online[i]) != exclude.end())
+                {
+                    continue;
+                }
                 uint64_t curr_load = machines[online[i]].Load();
-                if(min_load > curr_load)
+                if(!found || min_load > curr_load)
                 {
+                    found = true;
                     min_load = curr_load;
                     *id = online[i];
                     *m = &machines[online[i]];
                 }
             }
             mtx.unlock();
-            return true;
+            if(!found)
+            {
+                LOG(WARNING) << " 所有在线的编译主机都繁忙! " << "\n";
+            }
+            return found;
         }
 
         void OfflineMachine(int which)
@@ -201,8 +248,21 @@ namespace ns_control
     class Control
     {
     public:
-        Control() {}
-        ~Control() {}
+        Control()
+        {
+            for(int i = 0; i < judge_workers; ++i)
+            {
+                workers.emplace_back([this]() { JudgeWorker(); });
+            }
+        }
+        ~Control()
+        {
+            jobs.Close();
+            for(auto& worker : workers)
+            {
+                worker.join();
+            }
+        }
 
         void RecoveryMachine()
         {
@@ -250,9 +310,14 @@ namespace ns_control
         }
 
 
+        // 判题进度的回调：event是事件名称，data是编译服务推送的事件内容(json)
+        typedef std::function<void(const std::string& event, const std::string& data)> JudgeProgress;
+
         // code:
         // input: 
-        void Judge(const std::string& number, const std::string& in_json, std::string* out_json)
+        // progress: 可选，不为空时使用编译服务的流式接口，判题过程中的进度交给progress
+        void Judge(const std::string& number, const std::string& in_json, std::string* out_json,
+                   const JudgeProgress& progress = nullptr)
         {
             // 0. 根据题目编号，拿到对应题目的细节
             Question q;
@@ -265,23 +330,83 @@ namespace ns_control
 
             
             // 2. 重新拼接用户代码+测试用例代码，形成新的代码
+            //    有单独编译的harness时，只拼接适配代码，harness交给编译服务编译一次后链接
             std::string code = in_value["code"].asString();
             Json::Value compile_value;
             compile_value["input"] = in_value["input"].asString();
-            compile_value["code"] = code + q.tail; // 用户代码 + 测试用例代码
+            if(!q.harness.empty())
+            {
+                compile_value["code"] = code + "\n" + q.adapter; // 用户代码 + 适配代码
+                compile_value["harness"]["id"] = q.number;
+                compile_value["harness"]["version"] = q.harness_version;
+                compile_value["harness"]["source"] = q.harness;
+            }
+            else
+            {
+                compile_value["code"] = code + q.tail; // 用户代码 + 测试用例代码
+            }
+            // 数据驱动的测试用例，编译服务对每个用例单独运行一次程序
+            // 测试数据保存在编译服务上，只发送题号和版本，编译服务没有这个版本时(状态码-11)再附带测试数据
+            bool tests_attached = q.tests.empty();
+            if(!q.tests.empty())
+            {
+                compile_value["test_data"]["id"] = q.number;
+                compile_value["test_data"]["version"] = q.tests_version;
+            }
+            // 提交判题时第一个没通过的用例就决定了结果，剩下的用例取消掉，把判题机让给其他提交
+            // 带自定义输入运行时用户想看到每个用例的结果，不取消
+            compile_value["fail_fast"] = !q.tests.empty() && compile_value["input"].asString().empty();
+            if(!q.checker.empty())
+            {
+                compile_value["checker"]["mode"] = q.checker;
+                if(q.checker_epsilon > 0)
+                {
+                    compile_value["checker"]["epsilon"] = q.checker_epsilon;
+                }
+            }
             compile_value["cpu_limit"] = q.cpu_limit;
             compile_value["mem_limit"] = q.mem_limit;
+            if(q.output_limit > 0)
+            {
+                compile_value["output_limit"] = q.output_limit;
+            }
             Json::FastWriter writer;
             std::string compile_string = writer.write(compile_value);
 
             // 3. 选择负载最低的主机
-            // 规则： 一直选择，直到主机可用，否则，就是全部挂掉
+            // 规则： 一直选择，直到主机可用，否则，就是全部挂掉或者全部繁忙
+            std::vector<int> busy; // 返回503的主机，本次请求不再选择
+            bool reported = false; // 这一次请求是否已经推送过判题进度
+            JudgeProgress attempt_progress;
+            if(progress)
+            {
+                attempt_progress = [&](const std::string& event, const std::string& data)
+                {
+                    reported = true;
+                    progress(event, data);
+                };
+            }
             while(true)
             {
+                if(reported)
+                {
+                    // 上一台主机推送了一部分进度后失败了，换主机重新判题，让订阅者丢掉之前的进度
+                    progress("reset", "{\"state\":\"queued\"}");
+                    reported = false;
+                }
                 int id = 0;
                 Machine* m = nullptr;
-                if(!load_blance.SmartChoice(&id, &m))
+                if(!load_blance.SmartChoice(&id, &m, busy))
                 {
+                    if(!busy.empty())
+                    {
+                        // 所有主机都在排队上限，把繁忙的结果交给用户，稍后再提交
+                        Json::Value busy_value;
+                        busy_value["status"] = -4;
+                        busy_value["reason"] = "编译服务繁忙，请稍后再试";
+                        Json::FastWriter busy_writer;
+                        *out_json = busy_writer.write(busy_value);
+                    }
                     break;
                 }
                 LOG(INFO) << "选择主机成功 主机ID: " << id << "详情: " << m->ip << ":" << m->port << "\n";
@@ -289,16 +414,45 @@ namespace ns_control
                 // 4. 然后发起http请求，得到结果
                 Client cli(m->ip, m->port);
                 m->IncLoad();
-                if(auto res = cli.Post("/compile_and_run", compile_string, "application/json;charset=utf-8"))
+                std::string body;
+                auto res = progress ? PostStream(cli, compile_string, attempt_progress, &body)
+                                    : cli.Post("/compile_and_run", compile_string, "application/json;charset=utf-8");
+                bool ok = static_cast<bool>(res);
+                if(ok && !progress)
+                {
+                    body = res->body;
+                }
+                if(ok && progress && res->status == 200 && body.empty())
+                {
+                    // 事件流没有等到最终结果就断开了，按主机挂掉处理
+                    ok = false;
+                }
+                if(ok)
                 {
                     // 5. 将结果赋值给out_json
+                    if(res->status == 200 && !tests_attached && MissingTestData(body))
+                    {
+                        // 这台主机还没有这份测试数据(第一次判这道题、题目更新了或者被淘汰了)，附带测试数据重新请求
+                        LOG(INFO) << "编译服务缺少测试数据，附带测试数据重新请求 主机ID: " << id << "\n";
+                        m->DecLoad();
+                        AttachTests(q, &compile_value);
+                        compile_string = writer.write(compile_value);
+                        tests_attached = true;
+                        continue;
+                    }
                     if(res->status == 200)
                     {
                         LOG(INFO) << "请求编译和运行服务成功..." << "\n";
-                        *out_json = res->body;
+                        *out_json = body;
                         break;
                     }
                     m->DecLoad();
+                    if(res->status == 503)
+                    {
+                        // 该主机的判题队列已满，换一台主机
+                        LOG(WARNING) << "当前请求的主机繁忙 主机ID: " << id << "详情: " << m->ip << ":" << m->port << "\n";
+                        busy.push_back(id);
+                    }
                 }
                 else
                 {
@@ -310,9 +464,160 @@ namespace ns_control
             }
         }
 
+        // 异步判题：检查题号后放入队列，立即返回任务ID
+        // 返回HTTP状态码：200成功，404题目不存在，503排队的任务太多
+        int Submit(const std::string& number, const std::string& in_json, std::string* out_json)
+        {
+            Json::Value out_value;
+            Json::FastWriter writer;
+            Question q;
+            std::string id;
+            int status = 200;
+            if(!model.GetOneQuestion(number, &q))
+            {
+                out_value["status"] = -2;
+                out_value["reason"] = "指定题目: " + number + " 不存在";
+                status = 404;
+            }
+            else if(!jobs.Submit(number, in_json, &id))
+            {
+                out_value["status"] = -4;
+                out_value["reason"] = "判题队列已满，请稍后再试";
+                status = 503;
+            }
+            else
+            {
+                out_value["id"] = id;
+                out_value["state"] = "queued";
+            }
+            *out_json = writer.write(out_value);
+            return status;
+        }
+
+        // 订阅事件流的名额，等待的请求太多时返回nullptr
+        std::shared_ptr<WaitSlot> AcquireWait()
+        {
+            auto slot = std::make_shared<WaitSlot>(&waiting);
+            return slot->Acquired() ? slot : nullptr;
+        }
+
+        // 读取异步判题任务从第from个开始的事件，最多等待wait_ms；任务不存在时返回false
+        bool Events(const std::string& id, size_t from, int64_t wait_ms, std::vector<std::string>* events, bool* done)
+        {
+            return jobs.Events(id, from, wait_ms, events, done);
+        }
+
+        // 查询异步判题的结果，state为客户端已知的状态，不为空时长轮询最多wait_ms等状态变化
+        // 任务不存在或者结果已经过期时返回false
+        // 等待的请求太多时不等待，立即返回当前状态
+        bool Result(const std::string& id, const std::string& state, int64_t wait_ms, std::string* out_json)
+        {
+            Json::Value out_value;
+            Json::FastWriter writer;
+            WaitSlot slot(&waiting);
+            if(!slot.Acquired())
+            {
+                wait_ms = 0;
+            }
+            if(!jobs.Query(id, state, wait_ms, &out_value))
+            {
+                out_value["status"] = -2;
+                out_value["reason"] = "判题任务不存在或者结果已经过期";
+            }
+            *out_json = writer.write(out_value);
+            return out_value.isMember("state");
+        }
+
+    private:
+        // 后台判题线程：逐个取出排队的任务，按同步判题的流程交给编译服务
+        void JudgeWorker()
+        {
+            while(std::shared_ptr<JudgeJob> job = jobs.Next())
+            {
+                // 编译服务推送的状态变化和每个用例的结果保存到任务里，订阅者实时收到
+                std::string result;
+                Judge(job->number, job->body, &result, [this, &job](const std::string& event, const std::string& data)
+                {
+                    jobs.AddEvent(job, event, data);
+                });
+                if(result.empty())
+                {
+                    // 所有的编译服务都离线了
+                    Json::Value error_value;
+                    error_value["status"] = -2;
+                    error_value["reason"] = "没有可用的编译服务，请稍后再试";
+                    Json::FastWriter writer;
+                    result = writer.write(error_value);
+                }
+                jobs.Finish(job, result);
+            }
+        }
+
+        // 请求编译服务的流式接口，state、test事件交给progress，最终结果(result事件)放到body里
+        // 繁忙(503)等不是事件流的应答不解析，由调用方按状态码处理
+        static httplib::Result PostStream(Client& cli, const std::string& compile_string, const JudgeProgress& progress, std::string* body)
+        {
+            Request req;
+            req.method = "POST";
+            req.path = "/compile_and_run/stream";
+            req.headers.emplace("Content-Type", "application/json;charset=utf-8");
+            req.body = compile_string;
+            int status = 0;
+            SseParser parser;
+            req.response_handler = [&status](const Response& res)
+            {
+                status = res.status;
+                return true;
+            };
+            req.content_receiver = [&](const char* data, size_t len, uint64_t, uint64_t)
+            {
+                if(status != 200)
+                {
+                    return true;
+                }
+                parser.Append(data, len);
+                std::string event, payload;
+                while(parser.Next(&event, &payload))
+                {
+                    if(event == "result")
+                    {
+                        *body = payload;
+                    }
+                    else
+                    {
+                        progress(event, payload);
+                    }
+                }
+                return true;
+            };
+            return cli.send(req);
+        }
+
+        static void AttachTests(const Question& q, Json::Value* compile_value)
+        {
+            for(const auto& test : q.tests)
+            {
+                Json::Value test_value;
+                test_value["input"] = test.input;
+                test_value["output"] = test.output;
+                (*compile_value)["tests"].append(test_value);
+            }
+        }
+
+        // 编译服务的应答是否表示缺少测试数据
+        static bool MissingTestData(const std::string& body)
+        {
+            Json::Reader reader;
+            Json::Value value;
+            return reader.parse(body, value) && value["status"].asInt() == -11;
+        }
+
     private:
-        Model model;            // 提供与数据交互的model
-        View view;              // 提供网页渲染功能
-        LoadBlance load_blance; // 核心负载均衡器
+        Model model;                      // 提供与数据交互的model
+        View view;                        // 提供网页渲染功能
+        LoadBlance load_blance;           // 核心负载均衡器
+        JobTable jobs;                    // 异步判题的任务
+        std::vector<std::thread> workers; // 异步判题的后台线程
+        std::atomic<size_t> waiting{0};   // 正在等待判题进度的事件流和长轮询
     };
 }
\ No newline at end of file
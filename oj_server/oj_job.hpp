@@ -0,0 +1,275 @@
+#pragma once
+
+#include "../comm/log.hpp"
+#include "../comm/util.hpp"
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <random>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <sys/random.h>
+
+#include <jsoncpp/json/json.h>
+
+// 异步判题：提交后立即返回任务ID，判题由后台的线程完成，客户端再按ID查询结果
+// HTTP线程不再阻塞在整个编译+运行的往返上，比赛时的提交高峰不会占满httplib的线程池
+// 任务的状态: queued(排队) -> compiling(编译服务开始编译) -> running(开始运行) -> done(结果已经出来)
+// 查询时可以带上已知的状态长轮询，状态变化或者超时后才返回；也可以订阅任务的事件流(SSE)，
+// 编译服务推送的判题进度(状态变化、每个测试用例的结果)依次保存在任务里，转发给浏览器
+// 判完的结果保存在内存里，超过result_ttl_ms或者所有任务合计超过max_job_bytes时从最早完成的开始删除
+namespace ns_job
+{
+    using namespace ns_log;
+    using namespace ns_util;
+
+    const size_t max_pending = 1024;                   // 排队任务的上限，超过时拒绝提交
+    const size_t max_job_bytes = 256 * 1024 * 1024;    // 所有任务(提交的代码、事件、结果)合计的上限
+    const size_t job_overhead_bytes = 512;             // 每个任务除了内容之外的开销(表项、ID等)，按这个估算
+    const int64_t result_ttl_ms = 10 * 60 * 1000;      // 结果的保存时间
+    const int64_t max_wait_ms = 10 * 1000;             // 长轮询最多等待的时间
+
+    struct JudgeJob
+    {
+        std::string id;
+        std::string number;              // 题号
+        std::string body;                // 用户提交的json
+        std::string state;
+        std::string result;              // 判题结果(json)，done之后才有，也是最后一个事件(result)的内容
+        std::vector<std::string> events; // 按顺序保存的进度事件(SSE帧)，订阅者按下标继续读取
+        size_t bytes = 0;                // 计入JobTable::used的字节数
+        std::condition_variable changed; // 这个任务有新的事件，等待它的长轮询和事件流被唤醒
+    };
+
+    class JobTable
+    {
+    public:
+        JobTable() = default;
+        ~JobTable() = default;
+
+        // 提交一个判题任务，返回任务ID；排队的任务太多时返回false
+        bool Submit(const std::string& number, const std::string& body, std::string* id)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if(closed || pending.size() >= max_pending)
+            {
+                return false;
+            }
+            SweepLocked();
+            std::shared_ptr<JudgeJob> job = std::make_shared<JudgeJob>();
+            job->id = NewIdLocked();
+            job->number = number;
+            job->body = body;
+            job->state = "queued";
+            job->events.push_back(SseUtil::Frame("state", "{\"state\":\"queued\"}"));
+            Account(job, job_overhead_bytes + body.size() + job->events.back().size());
+            jobs[job->id] = job;
+            pending.push_back(job);
+            *id = job->id;
+            ++submitted;
+            work.notify_one();
+            return true;
+        }
+
+        // 判题线程取下一个任务，没有任务时阻塞，Close之后返回nullptr
+        std::shared_ptr<JudgeJob> Next()
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            work.wait(lock, [this]() { return closed || !pending.empty(); });
+            if(pending.empty())
+            {
+                return nullptr;
+            }
+            std::shared_ptr<JudgeJob> job = pending.front();
+            pending.pop_front();
+            return job;
+        }
+
+        // 编译服务推送的判题进度，state事件同时更新任务的状态
+        // reset: 换主机重新判题，之前的进度作废，任务回到排队状态
+        void AddEvent(const std::shared_ptr<JudgeJob>& job, const std::string& event, const std::string& data)
+        {
+            std::string state;
+            if(event == "state" || event == "reset")
+            {
+                Json::Reader reader;
+                Json::Value value;
+                reader.parse(data, value);
+                state = value["state"].asString();
+            }
+            std::lock_guard<std::mutex> lock(mtx);
+            if(!state.empty())
+            {
+                job->state = state;
+            }
+            job->events.push_back(SseUtil::Frame(event, data));
+            Account(job, job->events.back().size());
+            job->changed.notify_all();
+        }
+
+        void Finish(const std::shared_ptr<JudgeJob>& job, const std::string& result)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            job->state = "done";
+            job->result = result;
+            Account(job, result.size(), job->body.size());
+            std::string().swap(job->body);
+            finished.push_back(std::make_pair(TimeUtil::GetMonotonicMs(), job->id));
+            ++completed;
+            SweepLocked();
+            job->changed.notify_all();
+        }
+
+        // 查询任务，状态和known_state相同时最多等待wait_ms，等到状态变化
+        // 任务不存在(ID错误或者结果已经过期)时返回false
+        bool Query(const std::string& id, const std::string& known_state, int64_t wait_ms, Json::Value* out)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto iter = jobs.find(id);
+            if(iter == jobs.end())
+            {
+                return false;
+            }
+            std::shared_ptr<JudgeJob> job = iter->second;
+            if(wait_ms > 0 && !known_state.empty())
+            {
+                if(wait_ms > max_wait_ms)
+                {
+                    wait_ms = max_wait_ms;
+                }
+                job->changed.wait_for(lock, std::chrono::milliseconds(wait_ms), [&]() { return closed || job->state != known_state; });
+            }
+            (*out)["id"] = job->id;
+            (*out)["state"] = job->state;
+            if(job->state == "done")
+            {
+                Json::Reader reader;
+                Json::Value result;
+                reader.parse(job->result, result);
+                (*out)["result"] = result;
+            }
+            return true;
+        }
+
+        // 读取任务从第from个开始的事件，没有新的事件时最多等待wait_ms
+        // 任务结束后最后一个事件是result，内容就是job->result，读取时才拼成帧，不再另外保存一份
+        // done: 任务是否已经结束并且所有事件都已经读完；任务不存在时返回false
+        bool Events(const std::string& id, size_t from, int64_t wait_ms, std::vector<std::string>* events, bool* done)
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            auto iter = jobs.find(id);
+            if(iter == jobs.end())
+            {
+                return false;
+            }
+            std::shared_ptr<JudgeJob> job = iter->second;
+            job->changed.wait_for(lock, std::chrono::milliseconds(wait_ms), [&]()
+                                  { return closed || job->state == "done" || job->events.size() > from; });
+            for(size_t i = from; i < job->events.size(); ++i)
+            {
+                events->push_back(job->events[i]);
+            }
+            *done = job->state == "done";
+            if(*done && from <= job->events.size())
+            {
+                events->push_back(SseUtil::Frame("result", job->result));
+            }
+            return true;
+        }
+
+        // 停止接受任务，唤醒所有等待的线程
+        void Close()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+            work.notify_all();
+            for(auto& entry : jobs)
+            {
+                entry.second->changed.notify_all();
+            }
+        }
+
+        Json::Value Stats()
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            Json::Value stats;
+            stats["jobs"] = Json::UInt64(jobs.size());
+            stats["pending"] = Json::UInt64(pending.size());
+            stats["finished"] = Json::UInt64(finished.size());
+            stats["bytes"] = Json::UInt64(used);
+            stats["submitted"] = Json::UInt64(submitted);
+            stats["completed"] = Json::UInt64(completed);
+            stats["expired"] = Json::UInt64(expired);
+            return stats;
+        }
+
+    private:
+        // 任务占用的内存增加了add字节、减少了remove字节
+        void Account(const std::shared_ptr<JudgeJob>& job, size_t add, size_t remove = 0)
+        {
+            job->bytes = job->bytes + add - remove;
+            used = used + add - remove;
+        }
+
+        // 删除过期的结果，finished按完成时间排列，只需要看最前面的
+        // 还没有判完的任务不删除，它们的大小受max_pending和用例个数限制
+        void SweepLocked()
+        {
+            int64_t now = TimeUtil::GetMonotonicMs();
+            while(!finished.empty() && (used > max_job_bytes || finished.front().first + result_ttl_ms < now))
+            {
+                auto iter = jobs.find(finished.front().second);
+                used -= iter->second->bytes;
+                jobs.erase(iter);
+                finished.pop_front();
+                ++expired;
+            }
+        }
+
+        // 随机的任务ID：每个ID直接取128位的系统随机数，不能从自己的ID猜到别人的
+        std::string NewIdLocked()
+        {
+            std::string id;
+            do
+            {
+                unsigned char bytes[16];
+                if(getrandom(bytes, sizeof(bytes), 0) != static_cast<ssize_t>(sizeof(bytes)))
+                {
+                    // 不应该发生(熵池早已初始化)，退回到random_device，同样来自系统的随机源
+                    std::random_device device;
+                    for(size_t i = 0; i < sizeof(bytes); i += 4)
+                    {
+                        uint32_t value = device();
+                        memcpy(bytes + i, &value, 4);
+                    }
+                }
+                char hex[33];
+                for(size_t i = 0; i < sizeof(bytes); ++i)
+                {
+                    snprintf(hex + i * 2, 3, "%02x", bytes[i]);
+                }
+                id = hex;
+            } while(jobs.count(id) > 0);
+            return id;
+        }
+
+    private:
+        std::mutex mtx;
+        std::condition_variable work; // 有新任务，只唤醒判题线程；等待进度的请求用各个任务自己的changed
+        std::unordered_map<std::string, std::shared_ptr<JudgeJob>> jobs; // 任务ID -> 任务
+        std::deque<std::shared_ptr<JudgeJob>> pending;                   // 排队的任务
+        std::deque<std::pair<int64_t, std::string>> finished;            // (完成时间, 任务ID)
+        bool closed = false;
+        size_t used = 0; // 所有任务合计的字节数
+        uint64_t submitted = 0;
+        uint64_t completed = 0;
+        uint64_t expired = 0;
+    };
+}
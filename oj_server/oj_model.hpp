@@ -16,6 +16,13 @@ namespace ns_model
     using namespace ns_log;
     using namespace ns_util;
 
+    // 数据驱动的测试用例：questions/<题号>/tests/<i>.in 和 <i>.out，i从1开始连续编号
+    struct TestCase
+    {
+        std::string input;  // 喂给程序标准输入的内容
+        std::string output; // 期望的标准输出
+    };
+
     struct Question
     {
         std::string number; // 题目的编号
@@ -26,6 +33,14 @@ namespace ns_model
         std::string desc;   // 题目的描述
         std::string header; // 题目预设给用户在线编辑器的代码
         std::string tail;   // 题目的测试用例
+        std::string harness;         // 可选，单独编译的测试用例，和用户代码分别编译后链接
+        std::string adapter;         // 可选，追加在用户代码之后，供harness调用的入口函数
+        std::string harness_version; // harness的版本(源代码的SHA-256)，编译服务按它缓存目标文件
+        std::vector<TestCase> tests; // 可选，有测试用例时每个用例单独运行一次程序并比较输出
+        std::string tests_version;   // 测试用例的版本(所有输入输出的摘要)，编译服务按它保存测试数据
+        std::string checker;         // 可选，输出的比较方式(exact/line/token/float)，为空时由编译服务决定
+        double checker_epsilon = 0;  // 可选，float方式允许的误差，0表示使用编译服务的默认值
+        int output_limit = 0;        // 可选，运行时输出的上限(kb)，0表示使用编译服务的默认值
     };
 
     const std::string questions_list = "./questions/questions.list";
@@ -54,7 +69,8 @@ namespace ns_model
             {   
                 std::vector<std::string> tokens;
                 StringUtil::SplitString(line, &tokens, " ");
-                if(tokens.size() != 5)
+                // 编号 标题 难度 时间 空间 [输出上限]
+                if(tokens.size() != 5 && tokens.size() != 6)
                 {
                     LOG(WARNING) << "加载部分题目失败，请检查文件格式" << "\n";
                     continue;
@@ -65,6 +81,10 @@ namespace ns_model
                 q.star = tokens[2];
                 q.cpu_limit = atoi(tokens[3].c_str());
                 q.mem_limit = atoi(tokens[4].c_str());
+                if(tokens.size() == 6)
+                {
+                    q.output_limit = atoi(tokens[5].c_str());
+                }
 
                 std::string path = questions_path;
                 path += q.number + "/";
@@ -72,6 +92,30 @@ namespace ns_model
                 FileUtil::ReadFile(path + "desc.txt",&(q.desc), true);
                 FileUtil::ReadFile(path + "header.cpp", &(q.header), true);
                 FileUtil::ReadFile(path + "tail.cpp", &(q.tail), true);
+                // 没有harness.cpp的题目依然把tail.cpp拼接到用户代码之后
+                if(FileUtil::ReadFile(path + "harness.cpp", &(q.harness), true) &&
+                   FileUtil::ReadFile(path + "adapter.cpp", &(q.adapter), true))
+                {
+                    q.harness_version = HashUtil::Sha256(q.harness);
+                }
+                else
+                {
+                    q.harness.clear();
+                    q.adapter.clear();
+                }
+
+                LoadTests(path + "tests/", &(q.tests));
+                if(!q.tests.empty())
+                {
+                    std::vector<std::string> parts;
+                    for(const auto& test : q.tests)
+                    {
+                        parts.push_back(test.input);
+                        parts.push_back(test.output);
+                    }
+                    q.tests_version = HashUtil::Sha256List(parts);
+                }
+                LoadChecker(path + "tests/checker", &q);
 
                 questions.insert({q.number, q});
             }
@@ -80,6 +124,43 @@ namespace ns_model
             return true;
         }
 
+        // 按编号依次读取 1.in/1.out、2.in/2.out ...，直到缺少某一个文件
+        void LoadTests(const std::string& tests_path, std::vector<TestCase>* tests)
+        {
+            for(int i = 1; ; ++i)
+            {
+                TestCase test;
+                std::string name = tests_path + std::to_string(i);
+                if(!FileUtil::ReadFile(name + ".in", &(test.input), true) ||
+                   !FileUtil::ReadFile(name + ".out", &(test.output), true))
+                {
+                    break;
+                }
+                tests->push_back(test);
+            }
+        }
+
+        // 比较方式的配置文件只有一行："比较方式 [误差]"，比如 "float 1e-6"，没有这个文件时按默认方式比较
+        void LoadChecker(const std::string& checker_path, Question* q)
+        {
+            std::string content;
+            if(!FileUtil::ReadFile(checker_path, &content, false))
+            {
+                return;
+            }
+            std::vector<std::string> tokens;
+            StringUtil::SplitString(content, &tokens, " ");
+            if(tokens.empty())
+            {
+                return;
+            }
+            q->checker = tokens[0];
+            if(tokens.size() > 1)
+            {
+                q->checker_epsilon = atof(tokens[1].c_str());
+            }
+        }
+
         bool GetAllQuestions(std::vector<Question>* out)
         {
             if(questions.size() == 0)
@@ -18,6 +18,8 @@ int main()
     signal(SIGQUIT, Recovery);
     // 用户请求的服务路由功能
     Server svr;
+    // 线程数要容纳所有等待判题进度的请求(见max_waiters)，再加上处理普通请求的线程
+    svr.new_task_queue = []() { return new ThreadPool(http_threads); };
     Control ctrl;
     ctrl_ptr = &ctrl;
     
@@ -48,7 +50,84 @@ int main()
         ctrl.Judge(number, req.body, &result_json);
         resp.set_content(result_json, "application/json; charset=utf-8");
     });
-    
+
+    // 异步判题：提交后立即返回任务ID，不占用HTTP线程等待判题结果
+    svr.Post(R"(/judge/submit/(\d+))",[&ctrl](const Request& req,Response& resp)
+    {
+        std::string number = req.matches[1];
+        std::string out_json;
+        resp.status = ctrl.Submit(number, req.body, &out_json);
+        resp.set_content(out_json, "application/json; charset=utf-8");
+    });
+
+    // 按任务ID查询判题结果: ?state=已知的状态&wait=毫秒，状态没有变化时长轮询等待
+    svr.Get(R"(/judge/result/([0-9a-f]+))",[&ctrl](const Request& req,Response& resp)
+    {
+        std::string id = req.matches[1];
+        std::string state = req.get_param_value("state");
+        int64_t wait_ms = atoll(req.get_param_value("wait").c_str());
+        std::string out_json;
+        if(!ctrl.Result(id, state, wait_ms, &out_json))
+        {
+            resp.status = 404;
+        }
+        resp.set_content(out_json, "application/json; charset=utf-8");
+    });
+
+    // 订阅异步判题任务的事件流(SSE)：state(queued/compiling/running)、每个测试用例结束时的test，最后是result
+    // 编译主机中途失败、换主机重新判题时有reset，之前收到的进度作废
+    // 事件带有序号，浏览器断线重连时按Last-Event-ID从下一个事件继续
+    // 每个订阅者在判题结束之前一直占用一个HTTP线程，同时订阅的个数有上限，超过时返回503，浏览器改为轮询结果
+    svr.Get(R"(/judge/events/([0-9a-f]+))",[&ctrl](const Request& req,Response& resp)
+    {
+        std::string id = req.matches[1];
+        auto next = std::make_shared<size_t>(0);
+        if(req.has_header("Last-Event-ID"))
+        {
+            *next = atoll(req.get_header_value("Last-Event-ID").c_str()) + 1;
+        }
+        std::vector<std::string> events;
+        bool done = false;
+        if(!ctrl.Events(id, *next, 0, &events, &done))
+        {
+            resp.status = 404;
+            resp.set_content("{\"status\":-2,\"reason\":\"判题任务不存在或者结果已经过期\"}", "application/json; charset=utf-8");
+            return;
+        }
+        std::shared_ptr<WaitSlot> slot = ctrl.AcquireWait();
+        if(!slot)
+        {
+            resp.status = 503;
+            resp.set_header("Retry-After", "1");
+            resp.set_content("{\"status\":-4,\"reason\":\"订阅判题进度的人太多，请轮询结果\"}", "application/json; charset=utf-8");
+            return;
+        }
+        resp.set_header("Cache-Control", "no-cache");
+        resp.set_chunked_content_provider("text/event-stream", [&ctrl, id, next, slot](size_t, DataSink& sink)
+        {
+            std::vector<std::string> events;
+            bool done = false;
+            if(!ctrl.Events(id, *next, 15000, &events, &done))
+            {
+                return false;
+            }
+            // 没有新事件时写一个注释，及时发现浏览器已经断开
+            std::string chunk = events.empty() ? ": keepalive\n\n" : "";
+            for(const auto& event : events)
+            {
+                chunk += "id: " + std::to_string((*next)++) + "\n" + event;
+            }
+            if(!sink.write(chunk.data(), chunk.size()))
+            {
+                return false;
+            }
+            if(done)
+            {
+                sink.done();
+            }
+            return true;
+        });
+    });
 
     svr.set_base_dir("./wwwroot");
     svr.listen("0.0.0.0", 8080);
@@ -0,0 +1,6 @@
+// 追加在用户代码之后，把Solution的成员函数包装成harness.cpp可以调用的普通函数
+bool IsPalindrome(int x)
+{
+    // 通过定义临时对象，来完成方法的调用
+    return Solution().isPalindrome(x);
+}
@@ -0,0 +1,15 @@
+#include <iostream>
+
+// 单独编译的测试入口，只依赖adapter.cpp中的入口函数
+// 和用户代码分别编译，再链接成一个可执行程序
+// 测试数据在tests/目录下：从标准输入读入x，输出判断结果，由编译服务和期望输出比较
+bool IsPalindrome(int x);
+
+int main()
+{
+    int x;
+    while(std::cin >> x)
+    {
+        std::cout << (IsPalindrome(x) ? "true" : "false") << std::endl;
+    }
+}
@@ -2,28 +2,13 @@
 #include "header.cpp"
 #endif
 
-void Test1()
-{
-    // 通过定义临时对象，来完成方法的调用
-    bool ret = Solution().isPalindrome(121);
-    if(ret)
-        std::cout << "通过用例1, 测试121通过 ... OK!" << std::endl;
-    else 
-        std::cout << "未通过用例1, 测试的值是121" << std::endl;
-}
-
-void Test2()
-{
-    // 通过定义临时对象，来完成方法的调用
-    bool ret = Solution().isPalindrome(-10);
-    if(!ret)
-        std::cout << "通过用例2, 测试-1通过 ... OK!" << std::endl;
-    else 
-        std::cout << "未通过用例2, 测试的值是-10" << std::endl;
-}
-
+// 测试数据在tests/目录下：从标准输入读入x，输出判断结果，由编译服务和期望输出比较
 int main()
 {
-    Test1();
-    Test2();
-}
\ No newline at end of file
+    int x;
+    while(std::cin >> x)
+    {
+        // 通过定义临时对象，来完成方法的调用
+        std::cout << (Solution().isPalindrome(x) ? "true" : "false") << std::endl;
+    }
+}